@@ -0,0 +1,264 @@
+#ifndef EXEC_RW_APPEND_REWRITE_HPP
+#define EXEC_RW_APPEND_REWRITE_HPP
+
+#include "fatbin-align.hpp"
+#include "fatbin-pieces.hpp"
+#include "fatbin-slot.hpp"
+#include "file-copy.hpp"
+#include "log.hpp"
+#include "mapped-elf.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The append layout (--layout=append) leaves every byte of the original
+// executable where it is. The output starts as a copy (or reflink) of the
+// original, and the following is appended to it, in a new PT_LOAD segment:
+//
+//   [ relocated program header table ][ padding ][ new fatbin ]
+//
+// With slack, the new fatbin is followed by that many zeroes and by the slot
+// note, which gets a PT_NOTE segment of its own:
+//
+//   [ program headers ][ padding ][ new fatbin ][ slack ][ slot note ]
+//
+// Then only the ELF header (e_phoff, e_phnum) and the pointers in the
+// .hipFatBinSegment wrappers (and their relocations) are patched. The section
+// header table is left untouched, so the new fatbin has no section of its own.
+//
+// The new segment is placed at the same vaddr-to-offset delta as the first
+// PT_LOAD, so that loaders which compute AT_PHDR from e_phoff still find the
+// program headers in memory. The fatbin is aligned within it as --align asks,
+// see fatbin-align.hpp, which takes a delta that is a multiple of the
+// alignment; executables whose delta isn't get a page-aligned fatbin.
+
+static uint64_t alignUp(uint64_t value, uint64_t alignment) {
+  if (alignment <= 1)
+    return value;
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+// In position-independent executables, the loader overwrites the fatbin
+// pointers with the addends of their R_X86_64_RELATIVE relocations. Returns
+// the file offsets of those addends, indexed like the wrappers, and 0 for the
+// wrappers that aren't relocated.
+static std::vector<uint64_t>
+findWrapperRelocations(const MappedElf &ogExec, uint64_t wrapperAddr,
+                       size_t numWrappers) {
+  const uint32_t relativeRelocType = 8; // R_X86_64_RELATIVE
+  std::vector<uint64_t> addendOffsets(numWrappers, 0);
+
+  for (size_t i = 1; i < ogExec.numSections(); ++i) {
+    const ELFIO::Elf64_Shdr &section = ogExec.sectionHeader(i);
+    if (section.sh_type != ELFIO::SHT_RELA ||
+        !(section.sh_flags & ELFIO::SHF_ALLOC) ||
+        section.sh_offset > ogExec.size() ||
+        section.sh_size > ogExec.size() - section.sh_offset)
+      continue;
+
+    const ELFIO::Elf64_Rela *relocs =
+        (const ELFIO::Elf64_Rela *)(ogExec.data() + section.sh_offset);
+    size_t numRelocs = section.sh_size / sizeof(ELFIO::Elf64_Rela);
+    for (size_t j = 0; j < numRelocs; ++j) {
+      if ((relocs[j].r_info & 0xffffffff) != relativeRelocType ||
+          relocs[j].r_offset < wrapperAddr + 8)
+        continue;
+
+      uint64_t wrapperOffset = relocs[j].r_offset - wrapperAddr - 8;
+      if (wrapperOffset % 24 == 0 && wrapperOffset / 24 < numWrappers)
+        addendOffsets[wrapperOffset / 24] =
+            section.sh_offset + j * sizeof(ELFIO::Elf64_Rela) +
+            offsetof(ELFIO::Elf64_Rela, r_addend);
+    }
+  }
+  return addendOffsets;
+}
+
+// fatbinOffsets[i] is the offset of the code object bundle that the i-th
+// wrapper in .hipFatBinSegment should point to, relative to the start of the
+// new fatbin.
+static bool appendRewrite(const MappedElf &ogExec, const char *rwExecPath,
+                          const FatbinPieces &newFatbin,
+                          const std::vector<uint64_t> &fatbinOffsets,
+                          uint64_t slack = 0,
+                          FatbinAlign align = FatbinAlign::Auto) {
+  const uint64_t pageSize = sysconf(_SC_PAGESIZE);
+  const ELFIO::Elf64_Ehdr &ogHeader = ogExec.header();
+  const uint64_t newFatbinSize = newFatbin.size();
+
+  size_t fatbinIdx = ogExec.findSection(".hip_fatbin");
+  size_t wrapperIdx = ogExec.findSection(".hipFatBinSegment");
+  if (!fatbinIdx || !wrapperIdx) {
+    logError() << "can't find .hip_fatbin or .hipFatBinSegment\n";
+    return false;
+  }
+
+  const ELFIO::Elf64_Shdr &wrapperSection = ogExec.sectionHeader(wrapperIdx);
+  if (wrapperSection.sh_type == ELFIO::SHT_NOBITS ||
+      fatbinOffsets.size() * 24 > wrapperSection.sh_size) {
+    logError() << ".hipFatBinSegment holds fewer than " << fatbinOffsets.size()
+               << " wrappers\n";
+    return false;
+  }
+
+  // Build the relocated program header table, with the new PT_LOAD inserted
+  // right after the last one, so that PT_LOADs stay sorted by address.
+  std::vector<ELFIO::Elf64_Phdr> phdrs;
+  const ELFIO::Elf64_Phdr *firstLoad = nullptr;
+  size_t lastLoadIdx = 0;
+  uint64_t lastSegmentEnd = 0;
+  for (size_t i = 0; i < ogExec.numSegments(); ++i) {
+    const ELFIO::Elf64_Phdr &phdr = ogExec.segmentHeader(i);
+    if (phdr.p_vaddr + phdr.p_memsz > lastSegmentEnd)
+      lastSegmentEnd = phdr.p_vaddr + phdr.p_memsz;
+
+    // The slot of an earlier rewrite no longer holds the fatbin in use.
+    FatbinSlot oldSlot;
+    uint64_t oldSlotDesc;
+    if (phdr.p_type == ELFIO::PT_NOTE &&
+        findFatbinSlotNote(ogExec, phdr.p_offset, phdr.p_filesz, oldSlot,
+                           oldSlotDesc))
+      continue;
+
+    phdrs.push_back(phdr);
+    if (phdr.p_type == ELFIO::PT_LOAD) {
+      if (!firstLoad)
+        firstLoad = &phdr;
+      lastLoadIdx = phdrs.size() - 1;
+    }
+  }
+
+  if (!firstLoad || (firstLoad->p_vaddr - firstLoad->p_offset) % pageSize) {
+    logError() << "can't find a page-aligned PT_LOAD in the executable\n";
+    return false;
+  }
+
+  const uint64_t loadDelta = firstLoad->p_vaddr - firstLoad->p_offset;
+  const size_t numNewPhdrs = slack ? 2 : 1;
+  const uint64_t phdrTableSize =
+      (phdrs.size() + numNewPhdrs) * sizeof(ELFIO::Elf64_Phdr);
+  uint64_t fatbinAlign =
+      fatbinAlignment(align, ogExec.sectionHeader(fatbinIdx).sh_addralign,
+                      newFatbinSize + slack);
+  if (loadDelta % fatbinAlign) {
+    logOut() << "can't align the new fatbin to " << fatbinAlign
+             << " bytes, its segment would be at a different offset than "
+                "address, aligning to pages\n";
+    fatbinAlign = pageSize;
+  }
+
+  uint64_t newOffset = alignUp(ogExec.size(), pageSize);
+  uint64_t minAddr = alignUp(lastSegmentEnd, pageSize);
+  if (newOffset + loadDelta < minAddr)
+    newOffset = minAddr - loadDelta;
+  const uint64_t newAddr = newOffset + loadDelta;
+  const uint64_t fatbinOffset =
+      alignUp(newOffset + phdrTableSize, fatbinAlign) - newOffset;
+  const uint64_t fatbinAddr = newAddr + fatbinOffset;
+  const uint64_t noteOffset = alignUp(fatbinOffset + newFatbinSize + slack, 4);
+  const uint64_t loadSize =
+      slack ? noteOffset + fatbinSlotNoteSize : fatbinOffset + newFatbinSize;
+
+  ELFIO::Elf64_Phdr newLoad = {};
+  newLoad.p_type = ELFIO::PT_LOAD;
+  newLoad.p_flags = ELFIO::PF_R;
+  newLoad.p_offset = newOffset;
+  newLoad.p_vaddr = newAddr;
+  newLoad.p_paddr = newAddr;
+  newLoad.p_filesz = loadSize;
+  newLoad.p_memsz = loadSize;
+  newLoad.p_align = fatbinAlign;
+  phdrs.insert(phdrs.begin() + lastLoadIdx + 1, newLoad);
+
+  FatbinSlot slot;
+  slot.offset = newOffset + fatbinOffset;
+  slot.addr = fatbinAddr;
+  slot.capacity = newFatbinSize + slack;
+  slot.size = newFatbinSize;
+
+  if (slack) {
+    ELFIO::Elf64_Phdr noteSegment = {};
+    noteSegment.p_type = ELFIO::PT_NOTE;
+    noteSegment.p_flags = ELFIO::PF_R;
+    noteSegment.p_offset = newOffset + noteOffset;
+    noteSegment.p_vaddr = newAddr + noteOffset;
+    noteSegment.p_paddr = newAddr + noteOffset;
+    noteSegment.p_filesz = fatbinSlotNoteSize;
+    noteSegment.p_memsz = fatbinSlotNoteSize;
+    noteSegment.p_align = 4;
+    phdrs.push_back(noteSegment);
+  }
+
+  for (ELFIO::Elf64_Phdr &phdr : phdrs) {
+    if (phdr.p_type != ELFIO::PT_PHDR)
+      continue;
+    phdr.p_offset = newOffset;
+    phdr.p_vaddr = newAddr;
+    phdr.p_paddr = newAddr;
+    phdr.p_filesz = phdrTableSize;
+    phdr.p_memsz = phdrTableSize;
+  }
+
+  ELFIO::Elf64_Ehdr newHeader = ogHeader;
+  newHeader.e_phoff = newOffset;
+  newHeader.e_phnum = phdrs.size();
+
+  struct stat st;
+  if (fstat(ogExec.fd(), &st) != 0)
+    return false;
+
+  int fd = open(rwExecPath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                st.st_mode & 07777);
+  if (fd < 0) {
+    logError() << "can't create " << rwExecPath << '\n';
+    return false;
+  }
+
+  logOut() << "Copying " << ogExec.size() << " bytes of the original...\n";
+  CopyStats stats;
+  bool ok = copyWholeFile(ogExec.fd(), fd, ogExec.size(), &stats);
+  logOut() << stats.cloned << " bytes reflinked, " << stats.copied
+           << " copied by the kernel, " << stats.buffered
+           << " copied through a buffer\n";
+
+  logOut() << "Appending program header table at " << newOffset
+           << " and new fatbin at " << newOffset + fatbinOffset << "...\n";
+  ok = ok && pwriteAll(fd, phdrs.data(), phdrTableSize, newOffset);
+  ok = ok && newFatbin.write(ogExec.fd(), fd, newOffset + fatbinOffset);
+
+  // The slack is a hole, the file is extended by the note.
+  if (slack) {
+    logOut() << "Reserving " << slack << " bytes of slack after the new "
+             << "fatbin\n";
+    std::vector<char> note = makeFatbinSlotNote(slot);
+    ok = ok && pwriteAll(fd, note.data(), note.size(), newOffset + noteOffset);
+  }
+
+  logOut() << "Patching ELF header, e_phoff : " << newHeader.e_phoff
+           << ", e_phnum : " << newHeader.e_phnum << '\n';
+  ok = ok && pwriteAll(fd, &newHeader, sizeof(newHeader), 0);
+
+  // The fatbin pointer is at offset 8 of each 24-byte wrapper.
+  std::vector<uint64_t> relocOffsets = findWrapperRelocations(
+      ogExec, wrapperSection.sh_addr, fatbinOffsets.size());
+  for (size_t i = 0; ok && i < fatbinOffsets.size(); ++i) {
+    uint64_t addr = fatbinAddr + fatbinOffsets[i];
+    ok = pwriteAll(fd, &addr, sizeof(addr),
+                   wrapperSection.sh_offset + i * 24 + 8);
+    if (ok && relocOffsets[i])
+      ok = pwriteAll(fd, &addr, sizeof(addr), relocOffsets[i]);
+  }
+
+  if (close(fd) != 0 || !ok) {
+    logError() << "can't write " << rwExecPath << '\n';
+    return false;
+  }
+  return true;
+}
+
+#endif // EXEC_RW_APPEND_REWRITE_HPP
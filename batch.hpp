@@ -0,0 +1,147 @@
+#ifndef EXEC_RW_BATCH_HPP
+#define EXEC_RW_BATCH_HPP
+
+#include "log.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Batch mode rewrites every executable listed in a manifest on a bounded pool
+// of worker threads. Each line of the manifest holds the arguments of one
+// rewrite, separated by whitespace. Empty lines and lines starting with '#'
+// are skipped.
+//
+// A job that fails doesn't stop the others. Its progress output is printed
+// along with its status, the output of successful jobs is dropped.
+
+struct BatchJob {
+  size_t line;
+  std::vector<std::string> args;
+  // Set when the manifest line itself is malformed.
+  std::string error;
+};
+
+// Parse the argument of --jobs, a positive number of worker threads.
+static bool parseJobs(const char *str, unsigned &numJobs) {
+  if (*str < '0' || *str > '9')
+    return false;
+  char *end;
+  errno = 0;
+  unsigned long value = strtoul(str, &end, 10);
+  if (*end != '\0' || errno == ERANGE || value == 0 || value > UINT_MAX)
+    return false;
+  numJobs = value;
+  return true;
+}
+
+// The arguments on a line of a manifest, separated by whitespace.
+static std::vector<std::string> splitBatchLine(const std::string &line) {
+  std::vector<std::string> args;
+  std::istringstream fields(line);
+  std::string field;
+  while (fields >> field)
+    args.push_back(field);
+  return args;
+}
+
+static bool readBatchManifest(const char *manifestPath, size_t minArgs,
+                              size_t maxArgs, std::vector<BatchJob> &jobs) {
+  std::ifstream manifest(manifestPath);
+  if (!manifest.is_open())
+    return false;
+
+  std::string line;
+  for (size_t lineNum = 1; std::getline(manifest, line); ++lineNum) {
+    BatchJob job;
+    job.line = lineNum;
+    job.args = splitBatchLine(line);
+
+    if (job.args.empty() || job.args[0][0] == '#')
+      continue;
+
+    if (job.args.size() < minArgs || job.args.size() > maxArgs)
+      job.error = "expected " + std::to_string(minArgs) + " to " +
+                  std::to_string(maxArgs) + " fields, found " +
+                  std::to_string(job.args.size());
+    jobs.push_back(job);
+  }
+  return true;
+}
+
+// Run rewrite(job.args) for every job on numWorkers threads. Returns true if
+// all the jobs succeeded.
+template <typename RewriteFn>
+static bool runBatch(const std::vector<BatchJob> &jobs, unsigned numWorkers,
+                     RewriteFn rewrite) {
+  using Clock = std::chrono::steady_clock;
+
+  std::atomic<size_t> nextJob(0);
+  std::atomic<size_t> numFailed(0);
+  std::mutex reportMutex;
+  size_t numDone = 0;
+  auto batchStart = Clock::now();
+
+  auto worker = [&]() {
+    for (size_t i = nextJob++; i < jobs.size(); i = nextJob++) {
+      const BatchJob &job = jobs[i];
+
+      std::ostringstream jobLog;
+      logStream = &jobLog;
+
+      auto jobStart = Clock::now();
+      bool ok = false;
+      if (!job.error.empty())
+        jobLog << job.error << '\n';
+      else
+        ok = rewrite(job.args);
+      double ms =
+          std::chrono::duration<double, std::milli>(Clock::now() - jobStart)
+              .count();
+
+      logStream = &std::cout;
+      if (!ok)
+        ++numFailed;
+
+      std::lock_guard<std::mutex> lock(reportMutex);
+      ++numDone;
+      std::cout << '[' << numDone << '/' << jobs.size() << "] "
+                << (ok ? "ok     " : "FAILED ") << ms << " ms  line "
+                << job.line << "  "
+                << (job.args.size() > 2 ? job.args[2] : std::string("?"))
+                << '\n';
+      if (!ok)
+        std::cout << jobLog.str() << '\n';
+    }
+  };
+
+  if (numWorkers == 0)
+    numWorkers = 1;
+  if (numWorkers > jobs.size())
+    numWorkers = jobs.size();
+
+  std::vector<std::thread> workers;
+  for (unsigned i = 0; i < numWorkers; ++i)
+    workers.emplace_back(worker);
+  for (std::thread &thread : workers)
+    thread.join();
+
+  double ms =
+      std::chrono::duration<double, std::milli>(Clock::now() - batchStart)
+          .count();
+  std::cout << jobs.size() - numFailed << " of " << jobs.size()
+            << " jobs succeeded in " << ms << " ms on " << numWorkers
+            << " threads\n";
+  return numFailed == 0;
+}
+
+#endif // EXEC_RW_BATCH_HPP
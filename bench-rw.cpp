@@ -0,0 +1,536 @@
+// bench-rw [options]
+//
+// Generates synthetic executables and times the phases of rewriting them with
+// each strategy. Every rewrite runs in a child process of its own, so that its
+// peak RSS can be measured. One JSON object per rewrite is printed to stdout.
+
+#include "execrw.hpp"
+#include "append-rewrite.hpp"
+#include "offload-bundle.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// === CORPUS GENERATOR BEGIN ===
+
+// What a synthetic executable looks like. The filler sections are spread
+// evenly over numLoads PT_LOAD segments. .hip_fatbin goes in the first one
+// and .hipFatBinSegment in the last one, as in executables built by hipcc.
+struct CorpusSpec {
+  size_t numSections = 64;
+  size_t numLoads = 4;
+  uint64_t sectionSize = 4096;
+  uint64_t fatbinSize = 1 << 20;
+  size_t numWrappers = 1;
+};
+
+static const uint64_t corpusBaseAddr = 0x400000;
+static const uint64_t corpusPageSize = 4096;
+
+// A fatbin of numBundles offload bundles with one code object each, taking
+// size bytes in total.
+static std::vector<char> makeFatbin(uint64_t size, size_t numBundles,
+                                    char fill) {
+  static const char codeObjectId[] = "hipv4-amdgcn-amd-amdhsa--gfx90a";
+  const uint64_t idSize = sizeof(codeObjectId) - 1;
+  const uint64_t headerSize =
+      alignUp(offloadBundleMagicSize + 8 + 3 * 8 + idSize, 8);
+  const uint64_t bundleSize = size / numBundles / 8 * 8;
+
+  std::vector<char> fatbin(size, fill);
+  if (bundleSize <= headerSize)
+    return fatbin;
+
+  for (size_t i = 0; i < numBundles; ++i) {
+    char *bundle = fatbin.data() + i * bundleSize;
+    uint64_t fields[4] = {1, headerSize, bundleSize - headerSize, idSize};
+
+    memset(bundle, 0, headerSize);
+    memcpy(bundle, offloadBundleMagic, offloadBundleMagicSize);
+    memcpy(bundle + offloadBundleMagicSize, fields, sizeof(fields));
+    memcpy(bundle + offloadBundleMagicSize + sizeof(fields),
+           codeObjectId, idSize);
+  }
+  return fatbin;
+}
+
+struct CorpusSection {
+  std::string name;
+  Elf64_Word type;
+  Elf64_Xword flags;
+  uint64_t align;
+  uint64_t offset = 0;
+  uint64_t size;
+};
+
+static bool writeFill(int fd, uint64_t offset, uint64_t size, char fill) {
+  std::vector<char> buffer(size < (1 << 20) ? size : (1 << 20), fill);
+  while (size != 0) {
+    uint64_t toWrite = size < buffer.size() ? size : buffer.size();
+    if (!pwriteAll(fd, buffer.data(), toWrite, offset))
+      return false;
+    offset += toWrite;
+    size -= toWrite;
+  }
+  return true;
+}
+
+// Write a non-PIE x86-64 executable laid out like a linker would: the ELF
+// header and program headers at the start of the first PT_LOAD, every
+// PT_LOAD page aligned, and the symbol tables and section headers at the end.
+// It isn't meant to be run.
+static bool generateExec(const char *path, const CorpusSpec &spec) {
+  std::vector<CorpusSection> sections;
+  sections.push_back({"", SHT_NULL, 0, 0, 0, 0});
+
+  std::vector<std::vector<size_t>> loadSections(spec.numLoads);
+  for (size_t i = 0; i < spec.numSections; ++i) {
+    size_t load = i * spec.numLoads / spec.numSections;
+    Elf64_Xword flags = SHF_ALLOC;
+    if (load == spec.numLoads - 1)
+      flags |= SHF_WRITE;
+    else if (load % 2 == 1)
+      flags |= SHF_EXECINSTR;
+
+    loadSections[load].push_back(sections.size());
+    sections.push_back({".bench." + std::to_string(i), SHT_PROGBITS, flags, 16,
+                        0, spec.sectionSize});
+  }
+
+  const size_t fatbinIdx = sections.size();
+  loadSections.front().push_back(fatbinIdx);
+  sections.push_back(
+      {".hip_fatbin", SHT_PROGBITS, SHF_ALLOC, 4096, 0, spec.fatbinSize});
+
+  const size_t wrapperIdx = sections.size();
+  loadSections.back().push_back(wrapperIdx);
+  sections.push_back({".hipFatBinSegment", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE,
+                      8, 0, spec.numWrappers * 24});
+
+  const size_t symtabIdx = sections.size();
+  sections.push_back({".symtab", SHT_SYMTAB, 0, 8, 0,
+                      (spec.numSections + 1) * sizeof(Elf64_Sym)});
+  const size_t strtabIdx = sections.size();
+  sections.push_back({".strtab", SHT_STRTAB, 0, 1, 0, 0});
+  const size_t shstrtabIdx = sections.size();
+  sections.push_back({".shstrtab", SHT_STRTAB, 0, 1, 0, 0});
+
+  std::string shstrtab(1, '\0');
+  std::vector<Elf64_Word> nameOffsets;
+  for (const CorpusSection &section : sections) {
+    nameOffsets.push_back(section.name.empty() ? 0 : shstrtab.size());
+    if (!section.name.empty())
+      shstrtab += section.name + '\0';
+  }
+  sections[shstrtabIdx].size = shstrtab.size();
+
+  std::string strtab(1, '\0');
+  std::vector<Elf64_Sym> symbols(1, Elf64_Sym());
+  for (size_t i = 0; i < spec.numSections; ++i) {
+    Elf64_Sym symbol = {};
+    symbol.st_name = strtab.size();
+    symbol.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_OBJECT);
+    symbol.st_shndx = i + 1;
+    symbol.st_size = spec.sectionSize;
+    symbols.push_back(symbol);
+    strtab += "bench_" + std::to_string(i) + '\0';
+  }
+  sections[strtabIdx].size = strtab.size();
+
+  // Lay the PT_LOADs out, program headers first.
+  const size_t numPhdrs = spec.numLoads + 2;
+  std::vector<Elf64_Phdr> phdrs(numPhdrs, Elf64_Phdr());
+  uint64_t offset = sizeof(Elf64_Ehdr) + numPhdrs * sizeof(Elf64_Phdr);
+
+  for (size_t load = 0; load < spec.numLoads; ++load) {
+    uint64_t loadBegin = load == 0 ? 0 : alignUp(offset, corpusPageSize);
+    offset = loadBegin == 0 ? offset : loadBegin;
+    Elf64_Word flags = PF_R;
+
+    for (size_t idx : loadSections[load]) {
+      CorpusSection &section = sections[idx];
+      offset = alignUp(offset, section.align);
+      section.offset = offset;
+      offset += section.size;
+      if (section.flags & SHF_WRITE)
+        flags |= PF_W;
+      if (section.flags & SHF_EXECINSTR)
+        flags |= PF_X;
+    }
+
+    Elf64_Phdr &phdr = phdrs[load + 1];
+    phdr.p_type = PT_LOAD;
+    phdr.p_flags = flags;
+    phdr.p_offset = loadBegin;
+    phdr.p_vaddr = corpusBaseAddr + loadBegin;
+    phdr.p_paddr = corpusBaseAddr + loadBegin;
+    phdr.p_filesz = offset - loadBegin;
+    phdr.p_memsz = offset - loadBegin;
+    phdr.p_align = corpusPageSize;
+  }
+
+  phdrs[0].p_type = PT_PHDR;
+  phdrs[0].p_flags = PF_R;
+  phdrs[0].p_offset = sizeof(Elf64_Ehdr);
+  phdrs[0].p_vaddr = corpusBaseAddr + sizeof(Elf64_Ehdr);
+  phdrs[0].p_paddr = corpusBaseAddr + sizeof(Elf64_Ehdr);
+  phdrs[0].p_filesz = numPhdrs * sizeof(Elf64_Phdr);
+  phdrs[0].p_memsz = numPhdrs * sizeof(Elf64_Phdr);
+  phdrs[0].p_align = 8;
+
+  phdrs.back().p_type = PT_GNU_STACK;
+  phdrs.back().p_flags = PF_R | PF_W;
+  phdrs.back().p_align = 16;
+
+  for (size_t idx : {symtabIdx, strtabIdx, shstrtabIdx}) {
+    offset = alignUp(offset, sections[idx].align);
+    sections[idx].offset = offset;
+    offset += sections[idx].size;
+  }
+  const uint64_t shoff = alignUp(offset, 8);
+
+  std::vector<Elf64_Shdr> shdrs;
+  for (size_t i = 0; i < sections.size(); ++i) {
+    const CorpusSection &section = sections[i];
+    Elf64_Shdr shdr = {};
+    shdr.sh_name = nameOffsets[i];
+    shdr.sh_type = section.type;
+    shdr.sh_flags = section.flags;
+    shdr.sh_addr = section.flags & SHF_ALLOC
+                       ? corpusBaseAddr + section.offset
+                       : 0;
+    shdr.sh_offset = section.offset;
+    shdr.sh_size = section.size;
+    shdr.sh_addralign = section.align;
+    if (i == symtabIdx) {
+      shdr.sh_link = strtabIdx;
+      shdr.sh_info = 1;
+      shdr.sh_entsize = sizeof(Elf64_Sym);
+    }
+    shdrs.push_back(shdr);
+  }
+
+  for (size_t i = 1; i < symbols.size(); ++i)
+    symbols[i].st_value = shdrs[symbols[i].st_shndx].sh_addr;
+
+  Elf64_Ehdr ehdr = {};
+  memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+  ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+  ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+  ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+  ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+  ehdr.e_type = ET_EXEC;
+  ehdr.e_machine = EM_X86_64;
+  ehdr.e_version = EV_CURRENT;
+  ehdr.e_entry = shdrs[1].sh_addr;
+  ehdr.e_phoff = sizeof(Elf64_Ehdr);
+  ehdr.e_shoff = shoff;
+  ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+  ehdr.e_phentsize = sizeof(Elf64_Phdr);
+  ehdr.e_phnum = phdrs.size();
+  ehdr.e_shentsize = sizeof(Elf64_Shdr);
+  ehdr.e_shnum = shdrs.size();
+  ehdr.e_shstrndx = shstrtabIdx;
+
+  // The wrappers point at the code object bundles of the fatbin.
+  const uint64_t fatbinAddr = shdrs[fatbinIdx].sh_addr;
+  const uint64_t bundleSize = spec.fatbinSize / spec.numWrappers / 8 * 8;
+  std::vector<char> wrappers(spec.numWrappers * 24, 0);
+  for (size_t i = 0; i < spec.numWrappers; ++i) {
+    uint32_t header[2] = {0x48495046, 1};
+    uint64_t addr = fatbinAddr + i * bundleSize;
+    memcpy(wrappers.data() + i * 24, header, sizeof(header));
+    memcpy(wrappers.data() + i * 24 + 8, &addr, sizeof(addr));
+  }
+
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0755);
+  if (fd < 0)
+    return false;
+
+  bool ok = ftruncate(fd, shoff + shdrs.size() * sizeof(Elf64_Shdr)) == 0;
+  ok = ok && pwriteAll(fd, &ehdr, sizeof(ehdr), 0);
+  ok = ok && pwriteAll(fd, phdrs.data(), phdrs.size() * sizeof(Elf64_Phdr),
+                       ehdr.e_phoff);
+  for (size_t i = 1; ok && i <= spec.numSections; ++i)
+    ok = writeFill(fd, sections[i].offset, sections[i].size, (char)i);
+  if (ok) {
+    std::vector<char> fatbin =
+        makeFatbin(spec.fatbinSize, spec.numWrappers, 'o');
+    ok = pwriteAll(fd, fatbin.data(), fatbin.size(),
+                   sections[fatbinIdx].offset);
+  }
+  ok = ok && pwriteAll(fd, wrappers.data(), wrappers.size(),
+                       sections[wrapperIdx].offset);
+  ok = ok && pwriteAll(fd, symbols.data(), symbols.size() * sizeof(Elf64_Sym),
+                       sections[symtabIdx].offset);
+  ok = ok && pwriteAll(fd, strtab.data(), strtab.size(),
+                       sections[strtabIdx].offset);
+  ok = ok && pwriteAll(fd, shstrtab.data(), shstrtab.size(),
+                       sections[shstrtabIdx].offset);
+  ok = ok && pwriteAll(fd, shdrs.data(), shdrs.size() * sizeof(Elf64_Shdr),
+                       shoff);
+  return close(fd) == 0 && ok;
+}
+
+static bool generateFatbin(const char *path, const CorpusSpec &spec) {
+  std::vector<char> fatbin = makeFatbin(spec.fatbinSize, spec.numWrappers, 'n');
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return false;
+  bool ok = pwriteAll(fd, fatbin.data(), fatbin.size(), 0);
+  return close(fd) == 0 && ok;
+}
+
+// === CORPUS GENERATOR END ===
+
+// === REWRITE TIMING BEGIN ===
+
+// The options of libexecrw that make up each strategy (clone, mmap or
+// append).
+static RewriteOptions strategyOptions(const std::string &strategy) {
+  RewriteOptions options;
+  options.useMmap = strategy == "mmap";
+  options.layout = strategy == "append" ? "append" : "clone";
+  options.collectStats = true;
+  return options;
+}
+
+struct RunResult {
+  bool ok = false;
+  std::string phases;
+  double wallMs = 0;
+  long peakRssKb = 0;
+};
+
+// Rewrite in a child process, which reports the statistics of its phases
+// through a pipe. Its peak RSS comes from wait4().
+static RunResult runRewrite(const std::string &strategy, const char *execPath,
+                            const char *fatbinPath, const char *rwExecPath) {
+  RunResult result;
+  int fds[2];
+  if (pipe(fds) != 0)
+    return result;
+
+  auto start = std::chrono::steady_clock::now();
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    std::ostream nullStream(nullptr);
+    RewriteOptions options = strategyOptions(strategy);
+    options.log = &nullStream;
+
+    RewriteContext context(options);
+    bool ok = context.rewrite(execPath, fatbinPath, rwExecPath);
+    const std::string phases = context.stats().phasesJson();
+    for (size_t written = 0; written < phases.size();) {
+      ssize_t n = write(fds[1], phases.data() + written,
+                        phases.size() - written);
+      if (n <= 0)
+        break;
+      written += n;
+    }
+    _exit(ok ? 0 : 1);
+  }
+
+  close(fds[1]);
+  if (pid < 0) {
+    close(fds[0]);
+    return result;
+  }
+
+  char buffer[4096];
+  ssize_t n;
+  while ((n = read(fds[0], buffer, sizeof(buffer))) > 0)
+    result.phases.append(buffer, n);
+  close(fds[0]);
+
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) != pid)
+    return result;
+
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  result.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  result.wallMs = elapsed.count();
+  result.peakRssKb = usage.ru_maxrss;
+  return result;
+}
+
+// === REWRITE TIMING END ===
+
+static uint64_t fileSize(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0 ? st.st_size : 0;
+}
+
+static bool parseList(const char *str, std::vector<uint64_t> &values) {
+  values.clear();
+  std::stringstream list(str);
+  std::string item;
+  while (std::getline(list, item, ',')) {
+    uint64_t value;
+    if (!parseSize(item.c_str(), value) || value == 0)
+      return false;
+    values.push_back(value);
+  }
+  return !values.empty();
+}
+
+static void showBenchHelp(const char *toolName) {
+  std::cout << "usage : \n";
+  std::cout << "  " << toolName << " [options]\n\n";
+  std::cout << toolName
+            << " generates synthetic executables, rewrites them and prints "
+               "one JSON object\nper rewrite. Options taking a list accept "
+               "comma-separated values, every\ncombination is run.\n\n";
+  std::cout << "options : \n";
+  std::cout << "  --sections=<list>      filler sections per executable "
+               "(default : 64)\n";
+  std::cout << "  --segments=<list>      PT_LOAD segments per executable "
+               "(default : 4)\n";
+  std::cout << "  --section-size=<list>  bytes per filler section "
+               "(default : 4K)\n";
+  std::cout << "  --fatbin-size=<list>   bytes of .hip_fatbin and of the new "
+               "fatbin (default : 1M)\n";
+  std::cout << "  --wrappers=<list>      wrappers in .hipFatBinSegment, one "
+               "bundle each (default : 1)\n";
+  std::cout << "  --strategy=<list>      clone, mmap and/or append "
+               "(default : clone,mmap,append)\n";
+  std::cout << "  --runs=<n>             rewrites per combination "
+               "(default : 3)\n";
+  std::cout << "  --dir=<dir>            where to generate the executables "
+               "(default : a new\n"
+               "                         directory in /tmp, removed "
+               "afterwards)\n";
+}
+
+int main(int argc, char **argv) {
+  std::vector<uint64_t> numSections = {64}, numLoads = {4},
+                        sectionSizes = {4096}, fatbinSizes = {1 << 20},
+                        numWrappers = {1};
+  std::vector<std::string> strategies = {"clone", "mmap", "append"};
+  unsigned numRuns = 3;
+  std::string dir;
+
+  for (int i = 1; i < argc; ++i) {
+    bool ok = true;
+    if (!strcmp(argv[i], "--help")) {
+      showBenchHelp(argv[0]);
+      return 0;
+    } else if (!strncmp(argv[i], "--sections=", 11)) {
+      ok = parseList(argv[i] + 11, numSections);
+    } else if (!strncmp(argv[i], "--segments=", 11)) {
+      ok = parseList(argv[i] + 11, numLoads);
+      for (uint64_t loads : numLoads)
+        ok = ok && loads >= 2;
+    } else if (!strncmp(argv[i], "--section-size=", 15)) {
+      ok = parseList(argv[i] + 15, sectionSizes);
+    } else if (!strncmp(argv[i], "--fatbin-size=", 14)) {
+      ok = parseList(argv[i] + 14, fatbinSizes);
+    } else if (!strncmp(argv[i], "--wrappers=", 11)) {
+      ok = parseList(argv[i] + 11, numWrappers);
+    } else if (!strncmp(argv[i], "--strategy=", 11)) {
+      strategies.clear();
+      std::stringstream list(argv[i] + 11);
+      std::string strategy;
+      while (std::getline(list, strategy, ',')) {
+        ok = ok && (strategy == "clone" || strategy == "mmap" ||
+                    strategy == "append");
+        strategies.push_back(strategy);
+      }
+    } else if (!strncmp(argv[i], "--runs=", 7)) {
+      numRuns = atoi(argv[i] + 7);
+    } else if (!strncmp(argv[i], "--dir=", 6)) {
+      dir = argv[i] + 6;
+    } else {
+      ok = false;
+    }
+
+    if (!ok) {
+      std::cout << "invalid option " << argv[i] << '\n';
+      showBenchHelp(argv[0]);
+      exit(1);
+    }
+  }
+
+  bool removeDir = dir.empty();
+  if (removeDir) {
+    char dirTemplate[] = "/tmp/bench-rw-XXXXXX";
+    if (!mkdtemp(dirTemplate)) {
+      std::cout << "can't create a directory in /tmp\n";
+      exit(1);
+    }
+    dir = dirTemplate;
+  }
+
+  const std::string execPath = dir + "/bench-exec";
+  const std::string fatbinPath = dir + "/bench-fatbin";
+  const std::string rwExecPath = dir + "/bench-exec.rw";
+  bool allOk = true;
+
+  for (uint64_t sections : numSections)
+    for (uint64_t loads : numLoads)
+      for (uint64_t sectionSize : sectionSizes)
+        for (uint64_t fatbinSize : fatbinSizes)
+          for (uint64_t wrappers : numWrappers) {
+            CorpusSpec spec;
+            spec.numSections = sections;
+            spec.numLoads = loads;
+            spec.sectionSize = sectionSize;
+            spec.fatbinSize = fatbinSize;
+            spec.numWrappers = wrappers;
+
+            if (!generateExec(execPath.c_str(), spec) ||
+                !generateFatbin(fatbinPath.c_str(), spec)) {
+              std::cout << "can't generate the executable in " << dir << '\n';
+              exit(1);
+            }
+
+            for (const std::string &strategy : strategies)
+              for (unsigned run = 0; run < numRuns; ++run) {
+                unlink(rwExecPath.c_str());
+                RunResult result =
+                    runRewrite(strategy, execPath.c_str(), fatbinPath.c_str(),
+                               rwExecPath.c_str());
+                allOk = allOk && result.ok;
+
+                std::cout << "{\"strategy\":\"" << strategy
+                          << "\",\"sections\":" << sections
+                          << ",\"segments\":" << loads
+                          << ",\"section_size\":" << sectionSize
+                          << ",\"fatbin_size\":" << fatbinSize
+                          << ",\"wrappers\":" << wrappers
+                          << ",\"run\":" << run << ",\"input_bytes\":"
+                          << fileSize(execPath.c_str())
+                          << ",\"output_bytes\":"
+                          << fileSize(rwExecPath.c_str())
+                          << ",\"ok\":" << (result.ok ? "true" : "false")
+                          << ",\"phases\":"
+                          << (result.phases.empty() ? "{}" : result.phases)
+                          << ",\"wall_ms\":" << result.wallMs
+                          << ",\"peak_rss_kb\":" << result.peakRssKb << "}"
+                          << std::endl;
+              }
+          }
+
+  if (removeDir) {
+    unlink(execPath.c_str());
+    unlink(fatbinPath.c_str());
+    unlink(rwExecPath.c_str());
+    rmdir(dir.c_str());
+  }
+  return allOk ? 0 : 1;
+}
@@ -1,5 +1,23 @@
 #!/bin/bash
 
-clang++ -g exec-rw.cpp -lelf -o exec-rw -I `pwd`/ELFIO 2>&1 | cat
-clang++ -g exec-rw2.cpp -lelf -o exec-rw2 -I `pwd`/ELFIO 2>&1 | cat
+# zlib is required for --compress, zstd is used as well where it's installed.
+COMPRESS_DEFS=""
+COMPRESS_LIBS="-lz"
+if pkg-config --exists libzstd 2>/dev/null; then
+  COMPRESS_DEFS="-DEXEC_RW_HAVE_ZSTD"
+  COMPRESS_LIBS="$COMPRESS_LIBS `pkg-config --libs libzstd`"
+fi
+
+# libexecrw, the rewrite pipeline the tools are front ends of.
+clang++ -g -O2 -c execrw.cpp $COMPRESS_DEFS -o execrw.o -I `pwd`/ELFIO 2>&1 | cat
+clang++ -g -O2 -c tool-options.cpp $COMPRESS_DEFS -o tool-options.o -I `pwd`/ELFIO 2>&1 | cat
+ar rcs libexecrw.a execrw.o tool-options.o
+
+clang++ -g exec-rw.cpp libexecrw.a -pthread -lelf $COMPRESS_DEFS $COMPRESS_LIBS -o exec-rw -I `pwd`/ELFIO 2>&1 | cat
+clang++ -g exec-rw2.cpp libexecrw.a -pthread -lelf $COMPRESS_DEFS $COMPRESS_LIBS -o exec-rw2 -I `pwd`/ELFIO 2>&1 | cat
+clang++ -g -O2 bench-rw.cpp libexecrw.a -pthread -lelf $COMPRESS_DEFS $COMPRESS_LIBS -o bench-rw -I `pwd`/ELFIO 2>&1 | cat
+# The LD_PRELOAD library that swaps fatbins at load time.
+clang++ -g -O2 -shared -fPIC fatbin-preload.cpp -ldl -o libexecrw-preload.so -I `pwd`/ELFIO 2>&1 | cat
+# A stand-in for the HIP runtime that logs the fatbins registered with it.
+clang++ -g -O2 -shared -fPIC fatbin-register-stub.cpp -o libexecrw-register-stub.so -I `pwd`/ELFIO 2>&1 | cat
 # clang++ -g fix-symtab-rw.cpp -lelf -o fix-symtab -I `pwd`/ELFIO 2>&1 | bat
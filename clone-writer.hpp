@@ -0,0 +1,298 @@
+#ifndef EXEC_RW_CLONE_WRITER_HPP
+#define EXEC_RW_CLONE_WRITER_HPP
+
+#include "elfio/elfio.hpp"
+#include "file-copy.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Writes the clone of the clone layout with many threads. ELFIO saves a file
+// through one std::ostream, section after section; here it saves into a
+// WriteRecorder instead, which lays the file out without writing anything: it
+// notes where each write goes, and keeps a reference to the writes of section
+// payloads rather than a copy.
+//
+// The output is then created at its final size and mapped, and the payloads
+// are copied into the mapping by a pool of threads, in chunks of up to
+// chunkSize bytes. Payloads that are still in the original file (with --mmap)
+// are copied from it instead, with copyFileRange(), so they are reflinked
+// where the filesystem can. Zeroes, from ELFIO's padding or in payloads, are
+// skipped, the file is created sparse. The recorder marks every write that
+// isn't a section payload as a header: the ELF header, the program and section
+// header tables. Those go in once the payloads are synced to disk, and the
+// ELF header once the other headers are, so a clone left behind by a crash
+// doesn't look like an executable until it's complete.
+//
+// The I/O of the pool threads isn't in the statistics of the rewrite, which
+// count the calling thread's.
+
+static bool isZero(const char *data, size_t size) {
+  return size == 0 || (data[0] == 0 && memcmp(data, data + 1, size - 1) == 0);
+}
+
+// Records what an std::ostream writes, and where.
+class WriteRecorder : public std::streambuf {
+public:
+  struct Write {
+    uint64_t offset;
+    uint64_t size;
+    // The bytes, when they belong to a section payload, which outlives the
+    // recorder. Others are copied.
+    const char *data;
+    std::string copy;
+    // Not a section payload, written once the payloads are on disk.
+    bool header;
+
+    const char *bytes() const { return data ? data : copy.data(); }
+  };
+
+  // The payloads of the sections of exec, which are referenced, not copied.
+  explicit WriteRecorder(const ELFIO::elfio &exec) {
+    auto sections = exec.sections;
+    for (size_t i = 0; i < sections.size(); ++i) {
+      const char *data = sections[i]->get_data();
+      if (data && sections[i]->get_size())
+        payloads_.push_back({data, data + sections[i]->get_size()});
+    }
+    std::sort(payloads_.begin(), payloads_.end());
+  }
+
+  const std::vector<Write> &writes() const { return writes_; }
+
+  // The size of the file as written.
+  uint64_t size() const { return end_; }
+
+protected:
+  std::streamsize xsputn(const char *s, std::streamsize n) override {
+    if (n <= 0)
+      return 0;
+    if (isPayload(s, n)) {
+      writes_.push_back({pos_, (uint64_t)n, s, std::string(), false});
+    } else if (s && !isZero(s, n)) {
+      // A section without data is a hole.
+      writes_.push_back({pos_, (uint64_t)n, nullptr, std::string(s, n), true});
+    }
+    pos_ += n;
+    end_ = std::max(end_, pos_);
+    return n;
+  }
+
+  int_type overflow(int_type c) override {
+    if (traits_type::eq_int_type(c, traits_type::eof()))
+      return traits_type::not_eof(c);
+    char byte = traits_type::to_char_type(c);
+    xsputn(&byte, 1);
+    return c;
+  }
+
+  // Before writing at an offset past the end, ELFIO pads the stream up to it
+  // with a string of zeroes as long as the gap, which for a clone made of file
+  // ranges is about the size of the file. Seeking relative to the end lands
+  // past any offset instead, so that nothing is padded: gaps are holes.
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                   std::ios_base::openmode) override {
+    uint64_t base = dir == std::ios_base::beg   ? 0
+                    : dir == std::ios_base::cur ? pos_
+                                                : unboundedEnd;
+    pos_ = base + off;
+    return pos_;
+  }
+
+  pos_type seekpos(pos_type pos, std::ios_base::openmode) override {
+    pos_ = pos;
+    return pos_;
+  }
+
+private:
+  bool isPayload(const char *s, std::streamsize n) const {
+    auto next = std::upper_bound(
+        payloads_.begin(), payloads_.end(),
+        std::make_pair(s, (const char *)UINTPTR_MAX));
+    if (next == payloads_.begin())
+      return false;
+    --next;
+    return s >= next->first && s + n <= next->second;
+  }
+
+  static const uint64_t unboundedEnd = (uint64_t)1 << 62;
+
+  std::vector<std::pair<const char *, const char *>> payloads_;
+  std::vector<Write> writes_;
+  uint64_t pos_ = 0;
+  uint64_t end_ = 0;
+};
+
+class CloneWriter {
+public:
+  static const uint64_t chunkSize = 8 << 20;
+
+  // Lay out exec as ELFIO saves it.
+  bool layOut(ELFIO::elfio &exec) {
+    recorder_.reset(new WriteRecorder(exec));
+    std::ostream stream(recorder_.get());
+    return exec.save(stream) && stream.good();
+  }
+
+  // Also copy size bytes of srcFd at srcOffset into the output at dstOffset.
+  void addFileRange(int srcFd, uint64_t srcOffset, uint64_t dstOffset,
+                    uint64_t size) {
+    fileRanges_.push_back({srcFd, srcOffset, dstOffset, size});
+  }
+
+  // Write the clone laid out by layOut() to path, with up to numThreads
+  // threads, one per CPU if 0.
+  bool write(const char *path, unsigned numThreads, CopyStats &stats) {
+    uint64_t size = recorder_->size();
+    for (const FileRange &range : fileRanges_)
+      size = std::max(size, range.dstOffset + range.size);
+
+    // Split the payloads into chunks, and the rest into the headers.
+    std::vector<Chunk> chunks;
+    std::vector<const WriteRecorder::Write *> headers;
+    for (const WriteRecorder::Write &write : recorder_->writes()) {
+      if (write.header) {
+        headers.push_back(&write);
+        continue;
+      }
+      for (uint64_t offset = 0; offset < write.size;) {
+        uint64_t end = std::min(write.size,
+                                alignUp(write.offset + offset + 1, chunkSize) -
+                                    write.offset);
+        chunks.push_back({write.bytes() + offset, -1, 0, write.offset + offset,
+                          end - offset});
+        offset = end;
+      }
+    }
+    for (const FileRange &range : fileRanges_) {
+      for (uint64_t offset = 0; offset < range.size;) {
+        uint64_t end = std::min(
+            range.size,
+            alignUp(range.dstOffset + offset + 1, chunkSize) - range.dstOffset);
+        chunks.push_back({nullptr, range.srcFd, range.srcOffset + offset,
+                          range.dstOffset + offset, end - offset});
+        offset = end;
+      }
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0)
+      return false;
+    if (ftruncate(fd, size) != 0) {
+      close(fd);
+      return false;
+    }
+    char *out = nullptr;
+    if (size != 0) {
+      void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                        0);
+      if (addr == MAP_FAILED) {
+        close(fd);
+        return false;
+      }
+      out = (char *)addr;
+    }
+
+    if (numThreads == 0)
+      numThreads = std::thread::hardware_concurrency();
+    numThreads =
+        std::max<size_t>(1, std::min<size_t>(numThreads, chunks.size()));
+    numThreads_ = numThreads;
+
+    std::atomic<size_t> nextChunk(0);
+    std::atomic<bool> ok(true);
+    std::mutex statsMutex;
+    auto worker = [&]() {
+      CopyStats threadStats;
+      for (size_t i = nextChunk++; ok && i < chunks.size(); i = nextChunk++) {
+        const Chunk &chunk = chunks[i];
+        if (chunk.data) {
+          if (!isZero(chunk.data, chunk.size))
+            memcpy(out + chunk.dstOffset, chunk.data, chunk.size);
+        } else if (!copyFileRange(chunk.srcFd, chunk.srcOffset, fd,
+                                  chunk.dstOffset, chunk.size, &threadStats)) {
+          ok = false;
+        }
+      }
+      std::lock_guard<std::mutex> lock(statsMutex);
+      stats.cloned += threadStats.cloned;
+      stats.copied += threadStats.copied;
+      stats.buffered += threadStats.buffered;
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < numThreads; ++i)
+      workers.emplace_back(worker);
+    worker();
+    for (std::thread &thread : workers)
+      thread.join();
+
+    // The headers, in the order ELFIO wrote them, but the ELF header last,
+    // each group once the writes before it are on disk.
+    ok = ok && sync(fd, out, size);
+    if (ok) {
+      for (const WriteRecorder::Write *header : headers)
+        if (header->offset != 0)
+          memcpy(out + header->offset, header->bytes(), header->size);
+    }
+    ok = ok && sync(fd, out, size);
+    if (ok) {
+      for (const WriteRecorder::Write *header : headers)
+        if (header->offset == 0)
+          memcpy(out + header->offset, header->bytes(), header->size);
+    }
+
+    if (out)
+      munmap(out, size);
+    return close(fd) == 0 && ok;
+  }
+
+  // The number of threads the last write() used.
+  unsigned numThreads() const { return numThreads_; }
+
+private:
+  struct FileRange {
+    int srcFd;
+    uint64_t srcOffset;
+    uint64_t dstOffset;
+    uint64_t size;
+  };
+
+  // A piece of a payload, from memory if data is set, from srcFd otherwise.
+  struct Chunk {
+    const char *data;
+    int srcFd;
+    uint64_t srcOffset;
+    uint64_t dstOffset;
+    uint64_t size;
+  };
+
+  // Write back what went through the mapping and through fd.
+  static bool sync(int fd, char *out, uint64_t size) {
+    return (!out || msync(out, size, MS_SYNC) == 0) && fdatasync(fd) == 0;
+  }
+
+  static uint64_t alignUp(uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+  }
+
+  std::unique_ptr<WriteRecorder> recorder_;
+  std::vector<FileRange> fileRanges_;
+  unsigned numThreads_ = 0;
+};
+
+#endif // EXEC_RW_CLONE_WRITER_HPP
@@ -0,0 +1,392 @@
+#ifndef EXEC_RW_COMPRESSED_BUNDLE_HPP
+#define EXEC_RW_COMPRESSED_BUNDLE_HPP
+
+#include "offload-bundle.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+#ifdef EXEC_RW_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// Compressed clang offload bundles, as written by clang-offload-bundler
+// -compress and understood by the HIP runtime (ROCm 6.2 and later for version
+// 2). A compressed bundle wraps a whole uncompressed bundle:
+//
+//   "CCOB"                                  4 bytes
+//   version                                 uint16_t, 1, 2 or 3
+//   compression method                      uint16_t, 0 zlib, 1 zstd
+//   total size of the compressed bundle     uint32_t (v2), uint64_t (v3)
+//   size of the uncompressed bundle         uint32_t (v1, v2), uint64_t (v3)
+//   first 8 bytes of the MD5 of the
+//   uncompressed bundle                     uint64_t
+//   compressed bundle
+//
+// Version 1 has no total size, the compressed data runs to the end of the
+// buffer it's in. Bundles are written as version 2, which every runtime that
+// takes compressed bundles understands.
+//
+// zstd is only available if exec-rw is built with EXEC_RW_HAVE_ZSTD (build.sh
+// defines it where pkg-config finds libzstd), zlib always is.
+
+enum class BundleCompression { Zlib = 0, Zstd = 1 };
+
+static const char compressedBundleMagic[] = "CCOB";
+static const size_t compressedBundleMagicSize =
+    sizeof(compressedBundleMagic) - 1;
+
+static const char *bundleCompressionName(BundleCompression method) {
+  return method == BundleCompression::Zstd ? "zstd" : "zlib";
+}
+
+// The best method exec-rw was built with.
+static BundleCompression defaultBundleCompression() {
+#ifdef EXEC_RW_HAVE_ZSTD
+  return BundleCompression::Zstd;
+#else
+  return BundleCompression::Zlib;
+#endif
+}
+
+// Parse the argument of --compress. An empty name picks the default method.
+static bool parseBundleCompression(const std::string &name,
+                                   BundleCompression &method) {
+  if (name.empty())
+    method = defaultBundleCompression();
+  else if (name == "zlib")
+    method = BundleCompression::Zlib;
+#ifdef EXEC_RW_HAVE_ZSTD
+  else if (name == "zstd")
+    method = BundleCompression::Zstd;
+#endif
+  else
+    return false;
+  return true;
+}
+
+static bool isCompressedBundle(const char *data, size_t size) {
+  return size >= compressedBundleMagicSize &&
+         memcmp(data, compressedBundleMagic, compressedBundleMagicSize) == 0;
+}
+
+struct CompressedBundleHeader {
+  uint16_t version;
+  uint16_t method;
+  // Size of the header, and of the whole compressed bundle. The total size is
+  // 0 for version 1.
+  uint64_t headerSize;
+  uint64_t totalSize;
+  uint64_t uncompressedSize;
+  uint64_t hash;
+};
+
+static bool parseCompressedBundleHeader(const char *data, size_t size,
+                                        CompressedBundleHeader &header) {
+  if (!isCompressedBundle(data, size) || size < 8)
+    return false;
+  memcpy(&header.version, data + 4, sizeof(uint16_t));
+  memcpy(&header.method, data + 6, sizeof(uint16_t));
+
+  uint32_t size32;
+  header.totalSize = 0;
+  switch (header.version) {
+  case 1:
+    header.headerSize = 20;
+    if (size < header.headerSize)
+      return false;
+    memcpy(&size32, data + 8, sizeof(size32));
+    header.uncompressedSize = size32;
+    break;
+  case 2:
+    header.headerSize = 24;
+    if (size < header.headerSize)
+      return false;
+    memcpy(&size32, data + 8, sizeof(size32));
+    header.totalSize = size32;
+    memcpy(&size32, data + 12, sizeof(size32));
+    header.uncompressedSize = size32;
+    break;
+  case 3:
+    header.headerSize = 32;
+    if (size < header.headerSize)
+      return false;
+    memcpy(&header.totalSize, data + 8, sizeof(uint64_t));
+    memcpy(&header.uncompressedSize, data + 16, sizeof(uint64_t));
+    break;
+  default:
+    return false;
+  }
+  memcpy(&header.hash, data + header.headerSize - 8, sizeof(uint64_t));
+
+  if (header.totalSize &&
+      (header.totalSize < header.headerSize || header.totalSize > size))
+    return false;
+  return true;
+}
+
+// The first 8 bytes of the MD5 digest of data, read as a little-endian
+// integer. This is the hash clang stores in compressed bundles.
+static uint64_t md5Prefix(const char *data, size_t size) {
+  static const uint32_t k[64] = {
+      0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
+      0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+      0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340,
+      0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+      0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+      0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+      0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+      0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+      0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
+      0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+      0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
+  static const uint8_t r[64] = {
+      7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+      5, 9,  14, 20, 5, 9,  14, 20, 5, 9,  14, 20, 5, 9,  14, 20,
+      4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+      6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21};
+
+  uint32_t h[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+  auto block = [&](const unsigned char *p) {
+    uint32_t m[16];
+    memcpy(m, p, sizeof(m));
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+    for (unsigned i = 0; i < 64; ++i) {
+      uint32_t f, g;
+      if (i < 16) {
+        f = (b & c) | (~b & d);
+        g = i;
+      } else if (i < 32) {
+        f = (d & b) | (~d & c);
+        g = (5 * i + 1) % 16;
+      } else if (i < 48) {
+        f = b ^ c ^ d;
+        g = (3 * i + 5) % 16;
+      } else {
+        f = c ^ (b | ~d);
+        g = (7 * i) % 16;
+      }
+      uint32_t rotated = a + f + k[i] + m[g];
+      a = d;
+      d = c;
+      c = b;
+      b += (rotated << r[i]) | (rotated >> (32 - r[i]));
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+  };
+
+  const unsigned char *p = (const unsigned char *)data;
+  size_t numBlocks = size / 64;
+  for (size_t i = 0; i < numBlocks; ++i)
+    block(p + i * 64);
+
+  // The tail, 0x80, zeroes, and the size in bits.
+  unsigned char tail[128] = {};
+  size_t tailSize = size % 64;
+  memcpy(tail, p + numBlocks * 64, tailSize);
+  tail[tailSize] = 0x80;
+  size_t padded = tailSize < 56 ? 64 : 128;
+  uint64_t bits = (uint64_t)size * 8;
+  memcpy(tail + padded - 8, &bits, sizeof(bits));
+  for (size_t i = 0; i < padded; i += 64)
+    block(tail + i);
+
+  return (uint64_t)h[1] << 32 | h[0];
+}
+
+// Append [data, data + size) compressed with method to out, as a zlib or
+// zstd stream.
+static bool compressBuffer(const char *data, size_t size,
+                           BundleCompression method, std::vector<char> &out) {
+  size_t start = out.size();
+  size_t bound;
+#ifdef EXEC_RW_HAVE_ZSTD
+  if (method == BundleCompression::Zstd)
+    bound = ZSTD_compressBound(size);
+  else
+#else
+  // Only zlib is built in, parseBundleCompression() accepts nothing else.
+  (void)method;
+#endif
+    bound = compressBound(size);
+  out.resize(start + bound);
+
+  char *compressed = out.data() + start;
+  size_t compressedSize;
+#ifdef EXEC_RW_HAVE_ZSTD
+  if (method == BundleCompression::Zstd) {
+    compressedSize = ZSTD_compress(compressed, bound, data, size,
+                                   ZSTD_CLEVEL_DEFAULT);
+    if (ZSTD_isError(compressedSize))
+      return false;
+  } else
+#endif
+  {
+    uLongf zlibSize = bound;
+    if (compress2((Bytef *)compressed, &zlibSize, (const Bytef *)data, size,
+                  Z_DEFAULT_COMPRESSION) != Z_OK)
+      return false;
+    compressedSize = zlibSize;
+  }
+  out.resize(start + compressedSize);
+  return true;
+}
+
+// Append the compressed bundle of [data, data + size) to out.
+static bool compressBundle(const char *data, size_t size,
+                           BundleCompression method, std::vector<char> &out) {
+  if (size > UINT32_MAX)
+    return false;
+
+  size_t headerPos = out.size();
+  out.resize(headerPos + 24);
+  if (!compressBuffer(data, size, method, out))
+    return false;
+  size_t compressedSize = out.size() - headerPos - 24;
+
+  uint64_t totalSize = 24 + compressedSize;
+  if (totalSize > UINT32_MAX)
+    return false;
+
+  char *header = out.data() + headerPos;
+  uint16_t version = 2, methodId = (uint16_t)method;
+  uint32_t totalSize32 = totalSize, size32 = size;
+  uint64_t hash = md5Prefix(data, size);
+  memcpy(header, compressedBundleMagic, compressedBundleMagicSize);
+  memcpy(header + 4, &version, sizeof(version));
+  memcpy(header + 6, &methodId, sizeof(methodId));
+  memcpy(header + 8, &totalSize32, sizeof(totalSize32));
+  memcpy(header + 12, &size32, sizeof(size32));
+  memcpy(header + 16, &hash, sizeof(hash));
+  return true;
+}
+
+// Decompress the compressed bundle at the start of [data, data + size) into
+// out, and check it against the hash in its header.
+static bool decompressBundle(const char *data, size_t size,
+                             std::vector<char> &out) {
+  CompressedBundleHeader header;
+  if (!parseCompressedBundleHeader(data, size, header))
+    return false;
+
+  const char *compressed = data + header.headerSize;
+  size_t compressedSize =
+      (header.totalSize ? header.totalSize : size) - header.headerSize;
+  out.resize(header.uncompressedSize);
+
+  if (header.method == (uint16_t)BundleCompression::Zlib) {
+    uLongf zlibSize = out.size();
+    if (uncompress((Bytef *)out.data(), &zlibSize, (const Bytef *)compressed,
+                   compressedSize) != Z_OK ||
+        zlibSize != out.size())
+      return false;
+#ifdef EXEC_RW_HAVE_ZSTD
+  } else if (header.method == (uint16_t)BundleCompression::Zstd) {
+    size_t zstdSize =
+        ZSTD_decompress(out.data(), out.size(), compressed, compressedSize);
+    if (ZSTD_isError(zstdSize) || zstdSize != out.size())
+      return false;
+#endif
+  } else {
+    return false;
+  }
+  return md5Prefix(out.data(), out.size()) == header.hash;
+}
+
+struct FatbinCompressionStats {
+  uint64_t originalSize = 0;
+  uint64_t compressedSize = 0;
+  // Bundles that were compressed already, and were copied as they are.
+  uint64_t numPrecompressed = 0;
+  double compressMs = 0;
+  double verifyMs = 0;
+};
+
+// Re-encode the fatbin as compressed bundles, one per bundle of the original,
+// each aligned to 8 bytes. offsets are the offsets of the bundles the
+// .hipFatBinSegment wrappers point to, and are updated to point into the
+// compressed fatbin. Every compressed bundle is decompressed again and
+// compared to the original before this returns.
+static bool compressFatbin(const char *fatbin, size_t fatbinSize,
+                           BundleCompression method,
+                           std::vector<uint64_t> &offsets,
+                           std::vector<char> &compressedFatbin,
+                           FatbinCompressionStats &stats) {
+  using Clock = std::chrono::steady_clock;
+  auto start = Clock::now();
+
+  std::vector<uint64_t> bundleOffsets = offsets;
+  std::sort(bundleOffsets.begin(), bundleOffsets.end());
+  bundleOffsets.erase(std::unique(bundleOffsets.begin(), bundleOffsets.end()),
+                      bundleOffsets.end());
+
+  // Where each bundle starts in the compressed fatbin, and how long its
+  // original is (0 for the ones that were copied as they are).
+  std::vector<uint64_t> newOffsets, originalSizes;
+  compressedFatbin.clear();
+  stats = FatbinCompressionStats();
+  for (size_t i = 0; i < bundleOffsets.size(); ++i) {
+    uint64_t offset = bundleOffsets[i];
+    if (offset >= fatbinSize)
+      return false;
+    const char *bundle = fatbin + offset;
+    uint64_t end = i + 1 < bundleOffsets.size() ? bundleOffsets[i + 1]
+                                                : fatbinSize;
+
+    compressedFatbin.resize((compressedFatbin.size() + 7) & ~(size_t)7);
+    newOffsets.push_back(compressedFatbin.size());
+
+    CompressedBundleHeader header;
+    if (parseCompressedBundleHeader(bundle, end - offset, header)) {
+      uint64_t size = header.totalSize ? header.totalSize : end - offset;
+      compressedFatbin.insert(compressedFatbin.end(), bundle, bundle + size);
+      originalSizes.push_back(0);
+      ++stats.numPrecompressed;
+      continue;
+    }
+
+    OffloadBundle parsed;
+    if (!parseOffloadBundle(bundle, end - offset, parsed) ||
+        !compressBundle(bundle, parsed.size, method, compressedFatbin))
+      return false;
+    originalSizes.push_back(parsed.size);
+  }
+
+  stats.originalSize = fatbinSize;
+  stats.compressedSize = compressedFatbin.size();
+  auto compressed = Clock::now();
+  stats.compressMs =
+      std::chrono::duration<double, std::milli>(compressed - start).count();
+
+  std::vector<char> roundTrip;
+  for (size_t i = 0; i < bundleOffsets.size(); ++i) {
+    if (!originalSizes[i])
+      continue;
+    if (!decompressBundle(compressedFatbin.data() + newOffsets[i],
+                          compressedFatbin.size() - newOffsets[i], roundTrip) ||
+        roundTrip.size() != originalSizes[i] ||
+        memcmp(roundTrip.data(), fatbin + bundleOffsets[i], roundTrip.size()))
+      return false;
+  }
+  stats.verifyMs = std::chrono::duration<double, std::milli>(Clock::now() -
+                                                             compressed)
+                       .count();
+
+  for (uint64_t &offset : offsets) {
+    size_t i = std::lower_bound(bundleOffsets.begin(), bundleOffsets.end(),
+                                offset) -
+               bundleOffsets.begin();
+    offset = newOffsets[i];
+  }
+  return true;
+}
+
+#endif // EXEC_RW_COMPRESSED_BUNDLE_HPP
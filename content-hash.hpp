@@ -0,0 +1,179 @@
+#ifndef EXEC_RW_CONTENT_HASH_HPP
+#define EXEC_RW_CONTENT_HASH_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Streaming XXH64, a non-cryptographic hash that runs at memory bandwidth.
+// It is used to recognize inputs that have been seen before, not to protect
+// against tampering.
+class ContentHash {
+public:
+  explicit ContentHash(uint64_t seed = 0) {
+    acc_[0] = seed + prime1 + prime2;
+    acc_[1] = seed + prime2;
+    acc_[2] = seed;
+    acc_[3] = seed - prime1;
+    seed_ = seed;
+  }
+
+  void update(const void *data, size_t size) {
+    const char *bytes = (const char *)data;
+    totalSize_ += size;
+
+    if (bufferSize_ != 0) {
+      size_t toCopy = 32 - bufferSize_ < size ? 32 - bufferSize_ : size;
+      memcpy(buffer_ + bufferSize_, bytes, toCopy);
+      bufferSize_ += toCopy;
+      bytes += toCopy;
+      size -= toCopy;
+      if (bufferSize_ < 32)
+        return;
+      consumeStripe(buffer_);
+      bufferSize_ = 0;
+    }
+
+    for (; size >= 32; bytes += 32, size -= 32)
+      consumeStripe(bytes);
+
+    memcpy(buffer_, bytes, size);
+    bufferSize_ = size;
+  }
+
+  uint64_t digest() const {
+    uint64_t hash;
+    if (totalSize_ >= 32) {
+      hash = rotl(acc_[0], 1) + rotl(acc_[1], 7) + rotl(acc_[2], 12) +
+             rotl(acc_[3], 18);
+      for (uint64_t acc : acc_) {
+        hash ^= round(0, acc);
+        hash = hash * prime1 + prime4;
+      }
+    } else {
+      hash = seed_ + prime5;
+    }
+    hash += totalSize_;
+
+    const char *bytes = buffer_;
+    size_t size = bufferSize_;
+    for (; size >= 8; bytes += 8, size -= 8) {
+      hash ^= round(0, read64(bytes));
+      hash = rotl(hash, 27) * prime1 + prime4;
+    }
+    if (size >= 4) {
+      hash ^= (uint64_t)read32(bytes) * prime1;
+      hash = rotl(hash, 23) * prime2 + prime3;
+      bytes += 4;
+      size -= 4;
+    }
+    for (; size != 0; ++bytes, --size) {
+      hash ^= (uint8_t)*bytes * prime5;
+      hash = rotl(hash, 11) * prime1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    hash *= prime3;
+    hash ^= hash >> 32;
+    return hash;
+  }
+
+private:
+  static constexpr uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+  static constexpr uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+  static constexpr uint64_t prime3 = 0x165667B19E3779F9ULL;
+  static constexpr uint64_t prime4 = 0x85EBCA77C2B2AE63ULL;
+  static constexpr uint64_t prime5 = 0x27D4EB2F165667C5ULL;
+
+  static uint64_t rotl(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+  }
+
+  static uint64_t read64(const char *bytes) {
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+  }
+
+  static uint32_t read32(const char *bytes) {
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+  }
+
+  static uint64_t round(uint64_t acc, uint64_t input) {
+    acc += input * prime2;
+    return rotl(acc, 31) * prime1;
+  }
+
+  void consumeStripe(const char *bytes) {
+    for (int i = 0; i < 4; ++i)
+      acc_[i] = round(acc_[i], read64(bytes + i * 8));
+  }
+
+  uint64_t acc_[4];
+  uint64_t seed_;
+  uint64_t totalSize_ = 0;
+  char buffer_[32];
+  size_t bufferSize_ = 0;
+};
+
+static uint64_t hashBuffer(const void *data, size_t size) {
+  ContentHash hash;
+  hash.update(data, size);
+  return hash.digest();
+}
+
+// Hash the contents of a file through an mmap of it. The mapping is read
+// sequentially and dropped from the resident set chunk by chunk, so memory
+// use doesn't grow with the size of the file.
+static bool hashFile(const char *path, uint64_t &digest) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return false;
+  }
+
+  ContentHash hash;
+  size_t size = st.st_size;
+  if (size != 0) {
+    void *addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+    madvise(addr, size, MADV_SEQUENTIAL);
+
+    const size_t chunkSize = 64 << 20;
+    for (size_t offset = 0; offset < size; offset += chunkSize) {
+      size_t toHash = size - offset < chunkSize ? size - offset : chunkSize;
+      hash.update((const char *)addr + offset, toHash);
+      madvise((char *)addr + offset, toHash, MADV_DONTNEED);
+    }
+    munmap(addr, size);
+  }
+
+  close(fd);
+  digest = hash.digest();
+  return true;
+}
+
+static std::string toHex(uint64_t value) {
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)value);
+  return hex;
+}
+
+#endif // EXEC_RW_CONTENT_HASH_HPP
@@ -0,0 +1,116 @@
+#ifndef EXEC_RW_DEBUG_COMPRESSION_HPP
+#define EXEC_RW_DEBUG_COMPRESSION_HPP
+
+#include "elfio/elfio.hpp"
+#include "compressed-bundle.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Compression of the debug sections of the clone, as ld --compress-debug-
+// sections does it: the payload of a compressed section is an Elf64_Chdr,
+// with the method, size and alignment of the uncompressed payload, followed
+// by the zlib or zstd stream, and the section has SHF_COMPRESSED set. gdb,
+// lldb, binutils and elfutils read such sections directly.
+//
+// Only .debug_* sections that aren't loaded are compressed, and only if that
+// makes them smaller. Sections that are compressed already are left alone.
+// Sections are compressed concurrently, each by one thread.
+
+struct Elf64Chdr {
+  uint32_t ch_type;
+  uint32_t ch_reserved;
+  uint64_t ch_size;
+  uint64_t ch_addralign;
+};
+
+// ch_type, the values of ELFCOMPRESS_ZLIB and ELFCOMPRESS_ZSTD.
+static uint32_t elfCompressionType(BundleCompression method) {
+  return method == BundleCompression::Zstd ? 2 : 1;
+}
+
+static bool isCompressibleDebugSection(const std::string &name,
+                                       ELFIO::Elf_Word type,
+                                       ELFIO::Elf_Xword flags) {
+  return name.compare(0, 7, ".debug_") == 0 && type != ELFIO::SHT_NOBITS &&
+         !(flags & ELFIO::SHF_ALLOC) && !(flags & ELFIO::SHF_COMPRESSED);
+}
+
+// A debug section of the clone, and the payload to compress into it.
+struct DebugSection {
+  ELFIO::section *section;
+  const char *data;
+  uint64_t size;
+  // Set if the section now holds the compressed payload. Others are left as
+  // they were, for the caller to fill in.
+  bool compressed = false;
+};
+
+struct DebugCompressionStats {
+  uint64_t numCompressed = 0;
+  uint64_t originalSize = 0;
+  uint64_t compressedSize = 0;
+};
+
+// Compress sections with up to numThreads threads, one per CPU if 0.
+static bool compressDebugSections(std::vector<DebugSection> &sections,
+                                  BundleCompression method,
+                                  unsigned numThreads,
+                                  DebugCompressionStats &stats) {
+  std::vector<std::vector<char>> payloads(sections.size());
+  std::atomic<size_t> nextSection(0);
+  std::atomic<bool> ok(true);
+  auto worker = [&]() {
+    for (size_t i = nextSection++; ok && i < sections.size();
+         i = nextSection++) {
+      const DebugSection &debugSection = sections[i];
+      Elf64Chdr chdr = {elfCompressionType(method), 0, debugSection.size,
+                        debugSection.section->get_addr_align()};
+      std::vector<char> &payload = payloads[i];
+      payload.assign((const char *)&chdr, (const char *)&chdr + sizeof(chdr));
+      if (!compressBuffer(debugSection.data, debugSection.size, method,
+                          payload))
+        ok = false;
+    }
+  };
+
+  if (numThreads == 0)
+    numThreads = std::thread::hardware_concurrency();
+  numThreads =
+      std::max<size_t>(1, std::min<size_t>(numThreads, sections.size()));
+  std::vector<std::thread> workers;
+  for (unsigned i = 1; i < numThreads; ++i)
+    workers.emplace_back(worker);
+  worker();
+  for (std::thread &thread : workers)
+    thread.join();
+  if (!ok)
+    return false;
+
+  stats = DebugCompressionStats();
+  for (size_t i = 0; i < sections.size(); ++i) {
+    DebugSection &debugSection = sections[i];
+    ELFIO::section *section = debugSection.section;
+    stats.originalSize += debugSection.size;
+    if (payloads[i].size() >= debugSection.size) {
+      stats.compressedSize += debugSection.size;
+      continue;
+    }
+
+    section->set_data(payloads[i].data(), payloads[i].size());
+    section->set_flags(section->get_flags() | ELFIO::SHF_COMPRESSED);
+    section->set_addr_align(alignof(Elf64Chdr));
+    stats.compressedSize += payloads[i].size();
+    std::vector<char>().swap(payloads[i]);
+    debugSection.compressed = true;
+    ++stats.numCompressed;
+  }
+  return true;
+}
+
+#endif // EXEC_RW_DEBUG_COMPRESSION_HPP
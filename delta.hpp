@@ -0,0 +1,349 @@
+#ifndef EXEC_RW_DELTA_HPP
+#define EXEC_RW_DELTA_HPP
+
+#include "content-hash.hpp"
+#include "file-copy.hpp"
+#include "log.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Deltas of rewritten executables, for distributing them to machines that
+// already have the original: the output of a rewrite is the original with a
+// few headers and wrappers patched and the new fatbin added, so it can be
+// shipped as those edits and rebuilt from the original on arrival.
+//
+// A delta is a header followed by operations, which build the output from
+// start to end:
+//
+//   Copy  <size> bytes of the original at <source>
+//   Data  <size> bytes that follow the operation in the delta
+//   Zero  <size> zero bytes
+//
+// The header holds the size and XXH64 hash of the original and of the output,
+// so that a delta is only applied to the original it was made from, and the
+// rebuilt output is checked. Copies are reflinked where the filesystem can.
+//
+// Deltas are made by comparing the output with the original at the same
+// offsets, which is what the append and note layouts and in-place rewrites
+// keep, except in the ranges the caller knows were moved: the clone layout
+// moves sections around, and those are compared with the original at their
+// old offsets.
+
+static const char deltaMagic[8] = {'E', 'X', 'R', 'W', 'D', 'L', 'T', '1'};
+
+enum class DeltaOpKind : uint32_t { Copy = 1, Data = 2, Zero = 3 };
+
+struct DeltaHeader {
+  char magic[8];
+  uint64_t originalSize;
+  uint64_t originalHash;
+  uint64_t outputSize;
+  uint64_t outputHash;
+  uint32_t outputMode;
+  uint32_t numOps;
+};
+
+struct DeltaOp {
+  DeltaOpKind kind;
+  uint32_t reserved;
+  uint64_t size;
+  // The offset in the original of a Copy.
+  uint64_t source;
+};
+
+// size bytes at offset in the output that may be the bytes at source in the
+// original.
+struct DeltaMove {
+  uint64_t source;
+  uint64_t offset;
+  uint64_t size;
+};
+
+// A read-only mapping of a whole file.
+class DeltaFile {
+public:
+  DeltaFile() = default;
+  DeltaFile(const DeltaFile &) = delete;
+  DeltaFile &operator=(const DeltaFile &) = delete;
+
+  ~DeltaFile() {
+    if (data_)
+      munmap((void *)data_, size_);
+    if (fd_ >= 0)
+      close(fd_);
+  }
+
+  bool open(const char *path) {
+    fd_ = ::open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd_ < 0 || fstat(fd_, &st) != 0)
+      return false;
+    size_ = st.st_size;
+    mode_ = st.st_mode & 07777;
+    if (size_ == 0)
+      return true;
+    void *addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (addr == MAP_FAILED)
+      return false;
+    data_ = (const char *)addr;
+    return true;
+  }
+
+  const char *data() const { return data_; }
+  uint64_t size() const { return size_; }
+  uint32_t mode() const { return mode_; }
+  int fd() const { return fd_; }
+
+private:
+  int fd_ = -1;
+  const char *data_ = nullptr;
+  uint64_t size_ = 0;
+  uint32_t mode_ = 0;
+};
+
+// The operations that build output from original. The bytes of output are
+// compared with the original at the same offsets, or at their source inside
+// moves, which must not overlap. Copies of consecutive bytes of the original
+// are merged.
+static std::vector<DeltaOp> diffOutput(const char *original,
+                                       uint64_t originalSize,
+                                       const char *output, uint64_t outputSize,
+                                       std::vector<DeltaMove> moves) {
+  // Equal bytes between two differences are sent as data rather than as a
+  // copy of their own below this.
+  const uint64_t minCopySize = 2 * sizeof(DeltaOp);
+  const uint64_t blockSize = 4096;
+  static const char zeroBlock[blockSize] = {};
+
+  std::vector<DeltaOp> ops;
+  auto add = [&](DeltaOpKind kind, uint64_t source, uint64_t size) {
+    if (!ops.empty() && ops.back().kind == kind &&
+        (kind != DeltaOpKind::Copy ||
+         ops.back().source + ops.back().size == source)) {
+      ops.back().size += size;
+      return;
+    }
+    // A short copy between data is folded into it.
+    if (kind == DeltaOpKind::Data && ops.size() >= 2 &&
+        ops.back().kind == DeltaOpKind::Copy &&
+        ops.back().size < minCopySize &&
+        ops[ops.size() - 2].kind == DeltaOpKind::Data) {
+      uint64_t copySize = ops.back().size;
+      ops.pop_back();
+      ops.back().size += copySize + size;
+      return;
+    }
+    ops.push_back({kind, 0, size, kind == DeltaOpKind::Copy ? source : 0});
+  };
+
+  // Compare [begin, end) of output with the original from source on.
+  auto diffRange = [&](uint64_t begin, uint64_t end, uint64_t source) {
+    for (uint64_t block = begin; block < end; block += blockSize) {
+      uint64_t blockEnd = block + blockSize < end ? block + blockSize : end;
+      uint64_t src = source + (block - begin);
+      // The bytes of the block that have a counterpart in the original.
+      uint64_t common = src >= originalSize ? 0
+                        : originalSize - src < blockEnd - block
+                            ? originalSize - src
+                            : blockEnd - block;
+      if (common == blockEnd - block &&
+          memcmp(original + src, output + block, common) == 0) {
+        add(DeltaOpKind::Copy, src, common);
+        continue;
+      }
+      if (memcmp(zeroBlock, output + block, blockEnd - block) == 0) {
+        add(DeltaOpKind::Zero, 0, blockEnd - block);
+        continue;
+      }
+
+      // Split the block into runs of equal and different bytes.
+      for (uint64_t offset = block; offset < blockEnd;) {
+        auto same = [&](uint64_t i) {
+          return i - block < common &&
+                 original[src + (i - block)] == output[i];
+        };
+        bool runSame = same(offset);
+        uint64_t runEnd = offset + 1;
+        while (runEnd < blockEnd && same(runEnd) == runSame)
+          ++runEnd;
+        add(runSame ? DeltaOpKind::Copy : DeltaOpKind::Data,
+            src + (offset - block), runEnd - offset);
+        offset = runEnd;
+      }
+    }
+  };
+
+  std::sort(moves.begin(), moves.end(),
+            [](const DeltaMove &a, const DeltaMove &b) {
+              return a.offset < b.offset;
+            });
+  uint64_t offset = 0;
+  for (const DeltaMove &move : moves) {
+    if (move.offset < offset || move.offset > outputSize ||
+        move.size > outputSize - move.offset)
+      continue;
+    diffRange(offset, move.offset, offset);
+    diffRange(move.offset, move.offset + move.size, move.source);
+    offset = move.offset + move.size;
+  }
+  diffRange(offset, outputSize, offset);
+  return ops;
+}
+
+// Write to deltaPath the delta that rebuilds the output at outputPath from
+// the original at originalPath, with the ranges the original has at other
+// offsets in moves. deltaSize is set to the size of the delta.
+static bool writeDelta(const char *originalPath, const char *outputPath,
+                       const char *deltaPath,
+                       const std::vector<DeltaMove> &moves,
+                       uint64_t &deltaSize) {
+  DeltaFile original, output;
+  if (!original.open(originalPath)) {
+    logError() << "can't map " << originalPath << '\n';
+    return false;
+  }
+  if (!output.open(outputPath)) {
+    logError() << "can't map " << outputPath << '\n';
+    return false;
+  }
+
+  DeltaHeader header;
+  memcpy(header.magic, deltaMagic, sizeof(deltaMagic));
+  header.originalSize = original.size();
+  header.originalHash = hashBuffer(original.data(), original.size());
+  header.outputSize = output.size();
+  header.outputHash = hashBuffer(output.data(), output.size());
+  header.outputMode = output.mode();
+
+  std::vector<DeltaOp> ops = diffOutput(original.data(), original.size(),
+                                        output.data(), output.size(), moves);
+  header.numOps = ops.size();
+
+  int fd = open(deltaPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    logError() << "can't create delta " << deltaPath << '\n';
+    return false;
+  }
+
+  bool ok = pwriteAll(fd, &header, sizeof(header), 0);
+  deltaSize = sizeof(header);
+  uint64_t offset = 0, dataSize = 0;
+  for (const DeltaOp &op : ops) {
+    ok = ok && pwriteAll(fd, &op, sizeof(op), deltaSize);
+    deltaSize += sizeof(op);
+    if (op.kind == DeltaOpKind::Data) {
+      ok = ok && pwriteAll(fd, output.data() + offset, op.size, deltaSize);
+      deltaSize += op.size;
+      dataSize += op.size;
+    }
+    offset += op.size;
+  }
+  close(fd);
+  if (!ok) {
+    logError() << "can't write delta " << deltaPath << '\n';
+    return false;
+  }
+
+  logOut() << "delta of " << outputPath << " : " << ops.size()
+           << " operations, " << dataSize << " bytes of data\n";
+  return true;
+}
+
+// Rebuild at outputPath the output the delta at deltaPath was made from,
+// from the original at originalPath.
+static bool applyDelta(const char *originalPath, const char *deltaPath,
+                       const char *outputPath) {
+  DeltaFile original, delta;
+  if (!delta.open(deltaPath)) {
+    logError() << "can't map delta " << deltaPath << '\n';
+    return false;
+  }
+  DeltaHeader header;
+  if (delta.size() < sizeof(header) ||
+      memcmp(delta.data(), deltaMagic, sizeof(deltaMagic)) != 0) {
+    logError() << deltaPath << " isn't a delta\n";
+    return false;
+  }
+  memcpy(&header, delta.data(), sizeof(header));
+
+  if (!original.open(originalPath)) {
+    logError() << "can't map " << originalPath << '\n';
+    return false;
+  }
+  if (original.size() != header.originalSize ||
+      hashBuffer(original.data(), original.size()) != header.originalHash) {
+    logError() << deltaPath << " wasn't made from " << originalPath << '\n';
+    return false;
+  }
+
+  int fd = open(outputPath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                header.outputMode);
+  if (fd < 0) {
+    logError() << "can't create " << outputPath << '\n';
+    return false;
+  }
+
+  // Zeroes are left to the file being extended to its size.
+  CopyStats stats;
+  bool ok = ftruncate(fd, header.outputSize) == 0;
+  uint64_t deltaOffset = sizeof(header), offset = 0;
+  for (uint32_t i = 0; ok && i < header.numOps; ++i) {
+    DeltaOp op;
+    if (delta.size() - deltaOffset < sizeof(op)) {
+      ok = false;
+      break;
+    }
+    memcpy(&op, delta.data() + deltaOffset, sizeof(op));
+    deltaOffset += sizeof(op);
+    if (op.size > header.outputSize - offset) {
+      ok = false;
+      break;
+    }
+
+    switch (op.kind) {
+    case DeltaOpKind::Copy:
+      ok = op.source <= original.size() &&
+           op.size <= original.size() - op.source &&
+           copyFileRange(original.fd(), op.source, fd, offset, op.size,
+                         &stats);
+      break;
+    case DeltaOpKind::Data:
+      ok = op.size <= delta.size() - deltaOffset &&
+           pwriteAll(fd, delta.data() + deltaOffset, op.size, offset);
+      deltaOffset += op.size;
+      break;
+    case DeltaOpKind::Zero:
+      break;
+    default:
+      ok = false;
+    }
+    offset += op.size;
+  }
+  ok = ok && offset == header.outputSize && fchmod(fd, header.outputMode) == 0;
+  close(fd);
+
+  uint64_t outputHash;
+  if (!ok || !hashFile(outputPath, outputHash) ||
+      outputHash != header.outputHash) {
+    logError() << "can't rebuild " << outputPath << " from delta " << deltaPath
+               << '\n';
+    unlink(outputPath);
+    return false;
+  }
+
+  logOut() << "rebuilt " << outputPath << " from " << originalPath << " and "
+           << header.numOps << " operations : " << stats.cloned
+           << " bytes reflinked, " << stats.copied << " copied by the kernel, "
+           << stats.buffered << " copied through a buffer\n";
+  return true;
+}
+
+#endif // EXEC_RW_DELTA_HPP
@@ -1,448 +1,375 @@
-#include "elfio/elfio.hpp"
-
-#include <cassert>
-#include <cstdio>
-#include <iomanip>
+#include "execrw.hpp"
+#include "batch.hpp"
+#include "fatbin-map.hpp"
+#include "fatbin-prune.hpp"
+#include "fatbin-splice.hpp"
+#include "fatbin-variants.hpp"
+#include "kernel-patch.hpp"
+#include "log.hpp"
+#include "original-cache.hpp"
+#include "rewrite-daemon.hpp"
+#include "tool-options.hpp"
+
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
-#include <unordered_map>
+#include <string>
+#include <thread>
 #include <vector>
 
-// This tool creates a clone of the original executable, adds the new fatbin
-// to the clone, and later patches the clone so that the Linux kernel loader can
-// see the program headers.
+// exec-rw2 embeds a new fatbin into an executable, and points every
+// .hipFatBinSegment wrapper at its code object bundle in the new fatbin. The
+// rewrite itself is done by libexecrw, see execrw.hpp.
 //
 // usage:
-// exec-rw <og-exec> <fatbin> <new-exec>
-
-// These maps are for correcting the section links in the clone.
-std::unordered_map<ELFIO::section *, ELFIO::section *> ogToNewSectionMap;
-std::unordered_map<ELFIO::section *, ELFIO::section *> newToOgSectionMap;
+// exec-rw2 <og-exec> <fatbin> <new-exec> [<co_offsets>]
+// exec-rw2 --replace=<entry-id>=<code-object> ... <og-exec> <new-exec>
+// exec-rw2 --patch-kernels=<entry-id>=<object> ... <og-exec> <new-exec>
+// exec-rw2 --variant=<name>=<fatbin> ... <og-exec> <new-exec>
+// exec-rw2 --serve=<socket>
+// exec-rw2 --connect=<socket> <og-exec> <fatbin> <new-exec> [<co_offsets>]
+// exec-rw2 --fatbin-hash <exec> ...
+// exec-rw2 --apply-delta <og-exec> <delta> <new-exec>
 
-using std::vector;
 static void showHelp(const char *toolName) {
   std::cout << "usage : \n";
   std::cout << "  ";
   std::cout << toolName
-            << " <path-to-exe> <path-to-fatbin> <path-to-new-exe> \n\n";
+            << " [options] <path-to-exe> <path-to-fatbin> <path-to-new-exe>"
+               " [<path-to-co-offsets>] \n";
+  std::cout << "  " << toolName
+            << " [options] --replace=<entry-id>[@<n>]=<path-to-code-object> "
+               "... <path-to-exe>\n"
+               "      <path-to-new-exe>\n";
+  std::cout << "  " << toolName
+            << " [options] --patch-kernels=<entry-id>[@<n>]=<path-to-object> "
+               "... <path-to-exe>\n"
+               "      <path-to-new-exe>\n";
+  std::cout << "  " << toolName
+            << " [options] --variant=<name>=<path-to-fatbin> ... "
+               "<path-to-exe> <path-to-new-exe>\n\n";
   std::cout
       << toolName
-      << " will emit a new executable containing the fatbin passed via CLI\n";
-}
-
-static void dumpSection(const ELFIO::section *section,
-                        bool printContents = true) {
-  assert(section && "section must be non-null");
-
-  std::cout << "section : " << section->get_name() << ", ";
-  std::cout << "size : " << section->get_size() << ", ";
-  std::cout << "offset : " << section->get_offset() << ", ";
-  std::cout << "addr-align : " << section->get_addr_align() << ", ";
-  std::cout << "entry-size : " << section->get_entry_size() << '\n';
-
-  if (!printContents)
-    return;
-
-  std::cout << "section contents :\n";
-
-  std::cout << std::hex;
-  for (int i = 0; i < section->get_size(); ++i) {
-    std::cout << (unsigned)section->get_data()[i] << ' ';
-  }
-  std::cout << std::dec << '\n';
-}
-
-// === SECTION-GETTING HELPERS BEGIN ===
-//
-ELFIO::section *getSection(const std::string &sectionName,
-                           const ELFIO::elfio &file) {
-  for (int i = 0; i < file.sections.size(); ++i) {
-    if (file.sections[i]->get_name() == sectionName)
-      return file.sections[i];
-  }
-  return nullptr;
-}
-
-ELFIO::section *getFatbinSection(const ELFIO::elfio &file) {
-  return getSection(".hip_fatbin", file);
-}
-
-ELFIO::section *getFatbinWrapperSection(const ELFIO::elfio &file) {
-  return getSection(".hipFatBinSegment", file);
-}
-//
-// === SECTION-GETTING HELPERS END ===
-
-static size_t getFileSizeAndReset(std::ifstream &file) {
-  assert(file.is_open());
-
-  file.seekg(0, std::ifstream::end);
-  size_t size = file.tellg();
-  file.seekg(0, std::ifstream::beg);
-  return size;
-}
-
-ELFIO::segment *getPtLoad1(const ELFIO::elfio &file) {
-  for (int i = 0; i < file.sections.size(); ++i) {
-    auto segment = file.segments[i];
-    if (segment->get_type() == ELFIO::PT_LOAD)
-      return segment;
-  }
-  return nullptr;
+      << " will emit a new executable containing the fatbin passed via CLI\n"
+         "(<path-to-fatbin> can be - to read it from stdin, or a pipe)\n\n";
+  std::cout << "options : \n";
+  showRewriteOptionsHelp(std::cout);
+  std::cout << "  --replace=<id>[@<n>]=<file>  put the code object in <file> in "
+               "place of the\n"
+               "                   entry <id> (of bundle <n>) of .hip_fatbin, "
+               "reusing the\n"
+               "                   other code objects of the executable; "
+               "repeatable, replaces\n"
+               "                   the fatbin argument\n";
+  std::cout << "  --patch-kernels=<id>[@<n>]=<file>  patch the kernels of "
+               "the relocatable\n"
+               "                   object <file> into the entry <id> (of "
+               "bundle <n>) of\n"
+               "                   .hip_fatbin, appending the code of those "
+               "that grew;\n"
+               "                   repeatable, replaces the fatbin argument\n";
+  std::cout << "  --kernels=<list> patch only these kernels (default : every "
+               "kernel of the\n"
+               "                   objects)\n";
+  std::cout << "  --variant=<name>=<file>  embed the fatbin <file> as the "
+               "variant <name>, run\n"
+               "                   when EXECRW_FATBIN_VARIANT=<name>; "
+               "repeatable, the first\n"
+               "                   one is the default, replaces the fatbin "
+               "argument (x86-64\n"
+               "                   executables)\n";
+  std::cout << "  --batch=<file>   rewrite every executable listed in <file>, "
+               "one line of\n"
+               "                   <path-to-exe> <path-to-fatbin> "
+               "<path-to-new-exe> [<path-to-co-offsets>]\n"
+               "                   per executable\n";
+  std::cout << "  --jobs=<n>       number of executables rewritten "
+               "concurrently in batch mode\n"
+               "                   (default : number of CPUs)\n";
+  std::cout << "  --serve=<socket> run as a daemon that keeps originals mapped "
+               "and rewrites\n"
+               "                   executables on request from --connect, "
+               "--jobs at a time\n";
+  std::cout << "  --connect=<socket>  have the daemon listening on <socket> "
+               "do the rewrite,\n"
+               "                      with the options it was started with\n";
+  std::cout << "  --fatbin-hash    print the hash of .hip_fatbin of each "
+               "executable given, as\n"
+               "                   fatbin maps of the preload library key "
+               "them\n";
+  showToolOptionsHelp(std::cout);
 }
 
-ELFIO::segment *getPhdrSegment(const ELFIO::elfio &file) {
-  size_t entryPoint = file.get_entry();
-  for (int i = 0; i < file.sections.size(); ++i) {
-    auto segment = file.segments[i];
-    if (segment->get_type() == ELFIO::PT_PHDR)
-      return segment;
-  }
-  return nullptr;
-}
-
-ELFIO::segment *getLastSegment(const ELFIO::elfio &execFile) {
-  const size_t numSegments = execFile.segments.size();
-  assert(numSegments != 0);
-
-  ELFIO::segment *lastSegment = execFile.segments[0];
-  for (size_t i = 0; i < numSegments; ++i) {
-    ELFIO::segment *currSegment = execFile.segments[i];
-    size_t currSegmentBegin = currSegment->get_virtual_address();
-    size_t currSegmentSize = currSegment->get_memory_size();
-    size_t currSegmentEnd = currSegmentBegin + currSegmentSize;
-
-    size_t lastSegmentBegin = lastSegment->get_virtual_address();
-    size_t lastSegmentSize = lastSegment->get_memory_size();
-    size_t lastSegmentEnd = lastSegmentBegin + lastSegmentSize;
-
-    if (currSegmentEnd > lastSegmentEnd) {
-      lastSegment = currSegment;
-    }
-  }
-
-  return lastSegment;
-}
-
-void cloneHeader(const ELFIO::elfio &ogExec, ELFIO::elfio &newExec) {
-  newExec.create(ogExec.get_class(), ogExec.get_encoding());
-  newExec.set_os_abi(ogExec.get_os_abi());
-  newExec.set_abi_version(ogExec.get_abi_version());
-  newExec.set_type(ogExec.get_type());
-  newExec.set_machine(ogExec.get_machine());
-  newExec.set_entry(ogExec.get_entry());
-}
-
-bool shouldClone(const ELFIO::section *section) {
-  switch (section->get_type()) {
-  case ELFIO::SHT_NULL:
-    return false;
-
-  case ELFIO::SHT_STRTAB:
-    // Don't clone section header string table, ELFIO will create a new one
-    if (section->get_name() == ".shstrtab")
-      return false;
-    return true;
-
-  default:
-    return true;
-  }
-}
-
-void cloneSections(const ELFIO::elfio &ogExec, ELFIO::elfio &newExec) {
-  auto ogSections = ogExec.sections;
-  for (size_t i = 0; i < ogSections.size(); ++i) {
-    ELFIO::section *ogSection = ogSections[i];
-
-    if (!shouldClone(ogSection))
-      continue;
-
-    std::cout << "cloning\n";
-    dumpSection(ogSection, false);
-    std::cout << '\n';
-
-    const std::string &name = ogSection->get_name();
-    ELFIO::section *newSection = newExec.sections.add(name);
-    newSection->set_type(ogSection->get_type());
-    newSection->set_flags(ogSection->get_flags());
-    newSection->set_info(ogSection->get_info());
-
-    // NOTE: This can be incorrect link, and will be corrected later, after all
-    // sections are cloned.
-    newSection->set_link(ogSection->get_link());
-
-    newSection->set_addr_align(ogSection->get_addr_align());
-    newSection->set_entry_size(ogSection->get_entry_size());
-    newSection->set_address(ogSection->get_address());
-    newSection->set_size(ogSection->get_size());
-
-    if (const char *contents = ogSection->get_data())
-      newSection->set_data(contents, ogSection->get_size());
-
-    ogToNewSectionMap[ogSection] = newSection;
-    newToOgSectionMap[newSection] = ogSection;
-  }
-}
-
-void correctSectionLinks(const ELFIO::elfio &ogExec, ELFIO::elfio &newExec) {
-  auto ogSections = ogExec.sections;
-  auto newSections = newExec.sections;
-
-  // If ogSection's sh_link holds index in ogExec's section header table, we
-  // must update newSection's sh_link hold corresponding index in newExec's
-  // section header table.
-  for (size_t i = 0; i < newSections.size(); ++i) {
-    auto *currentNewSection = newSections[i];
-
-    auto iter1 = newToOgSectionMap.find(currentNewSection);
-    if (iter1 == newToOgSectionMap.end())
-      continue;
-
-    auto *ogSection = iter1->second;
-    auto ogLinkSectionIdx = ogSection->get_link();
-    auto *ogLinkSection = ogSections[ogLinkSectionIdx];
-
-    auto iter2 = ogToNewSectionMap.find(ogLinkSection);
-    if (iter2 == ogToNewSectionMap.end())
+int main(int argc, char **argv) {
+  std::ios::sync_with_stdio(false);
+
+  ToolOptions tool;
+  RewriteOptions &options = tool.rewrite;
+  const char *batchManifestPath = nullptr;
+  const char *serveSocketPath = nullptr;
+  const char *connectSocketPath = nullptr;
+  bool printFatbinHash = false;
+  unsigned numJobs = std::thread::hardware_concurrency();
+  std::vector<CodeObjectReplacement> replacements;
+  std::vector<KernelPatch> kernelPatches;
+  std::vector<std::string> kernels;
+  std::vector<FatbinVariant> variants;
+  std::vector<const char *> args;
+  for (int i = 1; i < argc; ++i) {
+    ToolOptionStatus status = parseToolOption(argv[i], tool);
+    if (status == ToolOptionStatus::Invalid) {
+      showHelp(argv[0]);
+      exit(1);
+    } else if (status == ToolOptionStatus::Parsed) {
       continue;
-
-    auto *newLinkSection = iter2->second;
-    auto newLinkSectionIdx = newLinkSection->get_index();
-    currentNewSection->set_link(newLinkSectionIdx);
-  }
-}
-
-void cloneSegments(const ELFIO::elfio &ogExec, ELFIO::elfio &newExec) {
-  auto ogSegments = ogExec.segments;
-  for (size_t i = 0; i < ogSegments.size(); ++i) {
-    ELFIO::segment *ogSegment = ogSegments[i];
-    ELFIO::segment *newSegment = newExec.segments.add();
-    newSegment->set_type(ogSegment->get_type());
-    newSegment->set_flags(ogSegment->get_flags());
-    newSegment->set_align(ogSegment->get_align());
-    newSegment->set_virtual_address(ogSegment->get_virtual_address());
-    newSegment->set_physical_address(ogSegment->get_physical_address());
-
-    newSegment->set_file_size(ogSegment->get_file_size());
-    newSegment->set_memory_size(ogSegment->get_memory_size());
-  }
-
-  auto newSegments = newExec.segments;
-  auto newSections = newExec.sections;
-
-  // Now map new sections into new segments
-  for (size_t i = 0; i < newSections.size(); ++i) {
-    auto currSection = newSections[i];
-    auto currSectionBegin = currSection->get_address();
-    auto currSectionSize = currSection->get_size();
-    auto currSectionEnd = currSectionBegin + currSectionSize;
-
-    for (size_t j = 0; j < newSegments.size(); ++j) {
-      auto newSegmentBegin = newSegments[j]->get_virtual_address();
-      auto newSegmentSize = newSegments[j]->get_memory_size();
-      auto newSegmentEnd = newSegmentBegin + newSegmentSize;
-      bool c1 = currSectionBegin >= newSegmentBegin &&
-                currSectionBegin < newSegmentEnd;
-      bool c2 = currSectionEnd <= newSegmentEnd;
-      if (c1 && c2) {
-        newSegments[j]->add_section(currSection, 1);
+    } else if (!strncmp(argv[i], "--replace=", 10)) {
+      replacements.emplace_back();
+      if (!readCodeObjectReplacement(argv[i] + 10, replacements.back())) {
+        std::cout << "invalid or unreadable replacement " << argv[i] + 10
+                  << '\n';
+        showHelp(argv[0]);
+        exit(1);
+      }
+    } else if (!strncmp(argv[i], "--patch-kernels=", 16)) {
+      kernelPatches.emplace_back();
+      if (!readKernelPatch(argv[i] + 16, kernelPatches.back())) {
+        std::cout << "invalid or unreadable kernel patch " << argv[i] + 16
+                  << '\n';
+        showHelp(argv[0]);
+        exit(1);
+      }
+    } else if (!strncmp(argv[i], "--variant=", 10)) {
+      variants.emplace_back();
+      if (!parseFatbinVariant(argv[i] + 10, variants.back())) {
+        std::cout << "invalid variant " << argv[i] + 10 << '\n';
+        showHelp(argv[0]);
+        exit(1);
+      }
+    } else if (!strncmp(argv[i], "--kernels=", 10)) {
+      if (!parseTargets(argv[i] + 10, kernels)) {
+        std::cout << "invalid kernels " << argv[i] + 10 << '\n';
+        showHelp(argv[0]);
+        exit(1);
       }
+    } else if (!strncmp(argv[i], "--batch=", 8)) {
+      batchManifestPath = argv[i] + 8;
+    } else if (!strncmp(argv[i], "--serve=", 8)) {
+      serveSocketPath = argv[i] + 8;
+    } else if (!strncmp(argv[i], "--connect=", 10)) {
+      connectSocketPath = argv[i] + 10;
+    } else if (!strcmp(argv[i], "--fatbin-hash")) {
+      printFatbinHash = true;
+    } else if (!strncmp(argv[i], "--jobs=", 7)) {
+      if (!parseJobs(argv[i] + 7, numJobs)) {
+        std::cout << "invalid number of jobs " << argv[i] + 7 << '\n';
+        showHelp(argv[0]);
+        exit(1);
+      }
+    } else if (!strncmp(argv[i], "--", 2)) {
+      std::cout << "unknown option " << argv[i] << '\n';
+      showHelp(argv[0]);
+      exit(1);
+    } else {
+      args.push_back(argv[i]);
     }
   }
-}
-
-void cloneExec(const ELFIO::elfio &ogExec, ELFIO::elfio &newExec) {
-  cloneHeader(ogExec, newExec);
-  cloneSections(ogExec, newExec);
-  correctSectionLinks(ogExec, newExec);
-  cloneSegments(ogExec, newExec);
-}
 
-void updateFatbinAddr(ELFIO::elfio &execFile, uint64_t newAddr, vector<uint32_t> & co_offsets) {
-  ELFIO::section *fatbinWrapperSection = getFatbinWrapperSection(execFile);
-
-  for (uint32_t xx = 0 ; xx< co_offsets.size(); xx++){
-     uint64_t *addrPtr = (uint64_t *)(fatbinWrapperSection->get_data() + xx*24 +  8);
-    *addrPtr = newAddr+co_offsets[xx];
-  
+  // Lines of a fatbin map, to be completed with the replacements.
+  if (printFatbinHash) {
+    bool ok = true;
+    for (const char *path : args) {
+      MappedElf exec;
+      uint64_t hash;
+      if (!exec.open(path) || !hashHipFatbin(exec, hash)) {
+        std::cout << "can't find .hip_fatbin in " << path << '\n';
+        ok = false;
+        continue;
+      }
+      std::cout << toHex(hash) << ' ' << path << '\n';
+    }
+    return ok ? 0 : 1;
   }
-  // address is at offset 8.
- }
-
-// Create a .new_fatbin section, map it to a new PT_LOAD segment, update the
-// fatbin wrapper.
-void addNewFatbin(ELFIO::elfio &newExec, const char *newFatbinContent,
-                  size_t newFatbinSize, vector<uint32_t> & co_offsets) {
 
-  ELFIO::section *fatbinSection = getFatbinSection(newExec);
-  assert(fatbinSection);
-
-  // Calculate next virtual address for loading the new fatbin.
-  ELFIO::segment *lastSegment = getLastSegment(newExec);
-  size_t nextAddr =
-      lastSegment->get_virtual_address() + lastSegment->get_memory_size();
-
-  size_t alignment = fatbinSection->get_addr_align();
-  assert(alignment != 0);
-
-  while (nextAddr % alignment != 0) {
-    ++nextAddr;
+  // The daemon does the rewrite, with its own options.
+  if (connectSocketPath) {
+    if (args.size() != 3 && args.size() != 4) {
+      std::cout << "3 or 4 arguments to " << argv[0] << " expected\n";
+      showHelp(argv[0]);
+      exit(1);
+    }
+    if (!strcmp(args[1], "-")) {
+      std::cout << "the daemon can't read the fatbin from stdin\n";
+      exit(1);
+    }
+    if (options.deltaPath || tool.applyDelta) {
+      std::cout << "the daemon doesn't handle deltas\n";
+      exit(1);
+    }
+    if (!replacements.empty() || !kernelPatches.empty() || !variants.empty()) {
+      std::cout << "the daemon doesn't replace code objects, patch kernels "
+                   "or embed variants\n";
+      exit(1);
+    }
+    std::vector<std::string> request(args.begin(), args.end());
+    return requestRewrite(connectSocketPath, request) ? 0 : 1;
   }
 
-  ELFIO::section *newFatbinSection = newExec.sections.add(".new_fatbin");
-  newFatbinSection->set_type(fatbinSection->get_type());
-  newFatbinSection->set_flags(fatbinSection->get_flags());
-  newFatbinSection->set_info(fatbinSection->get_info());
-  newFatbinSection->set_addr_align(fatbinSection->get_addr_align());
-  newFatbinSection->set_entry_size(fatbinSection->get_entry_size());
-  newFatbinSection->set_size(newFatbinSize);
-  newFatbinSection->set_data(newFatbinContent, newFatbinSize);
-  newFatbinSection->set_address(nextAddr);
-
-  ELFIO::segment *newSegment = newExec.segments.add();
-  newSegment->set_type(ELFIO::PT_LOAD);
-  newSegment->set_flags(ELFIO::PF_R);
-  newSegment->set_align(fatbinSection->get_addr_align());
-  newSegment->set_virtual_address(nextAddr);
-  newSegment->set_physical_address(nextAddr);
-
-  newSegment->add_section(newFatbinSection, 1);
-  updateFatbinAddr(newExec, nextAddr, co_offsets);
-}
-
-// This is for patching the clone at last. For some reason, editing raw segments
-// doesn't work with ELFIO. The macros in elf.h conflict with ELFIO's constants,
-// hence keeping the include here.
-#include <elf.h>
-
-void patchExec(const char *rwExecPath) {
-  ELFIO::elfio newExecFile;
-  FILE *rawNewElf = fopen(rwExecPath, "rb+");
+  if (!setUpToolOptions(tool))
+    exit(1);
 
-  if (!rawNewElf || !newExecFile.load(rwExecPath)) {
-    std::cout << "can't find or process new ELF file " << rwExecPath << '\n';
+  if (!kernels.empty() && kernelPatches.empty()) {
+    std::cout << "--kernels needs --patch-kernels\n";
+    showHelp(argv[0]);
     exit(1);
   }
 
-  ELFIO::segment *ptLoad1 = getPtLoad1(newExecFile);
-  uint64_t ptLoad1Offset = ptLoad1->get_offset();
-  ELFIO::segment *phdrSeg = getPhdrSegment(newExecFile);
-
-  char *ptLoad1Data = (char *)ptLoad1->get_data();
-  char *pHdrs = (char *)phdrSeg->get_data();
+  // Kernel patches end up as code objects to replace, as with --replace.
+  if (!kernelPatches.empty()) {
+    if (serveSocketPath || batchManifestPath || !replacements.empty() ||
+        !variants.empty() || tool.applyDelta) {
+      std::cout << "--serve, --batch, --replace, --variant and --apply-delta "
+                   "can't be used with --patch-kernels\n";
+      showHelp(argv[0]);
+      exit(1);
+    }
+    if (args.size() != 2) {
+      std::cout << "2 arguments to " << argv[0]
+                << " expected with --patch-kernels\n";
+      showHelp(argv[0]);
+      exit(1);
+    }
+    for (KernelPatch &patch : kernelPatches)
+      patch.kernels = kernels;
+    RewriteContext context(options);
+    if (!context.patchKernels(args[0], kernelPatches, args[1]))
+      exit(1);
+    return 0;
+  }
 
-  size_t numZeroes = 0;
-  for (size_t i = 0; i < ptLoad1->get_memory_size() && ptLoad1Data[i] == 0;
-       ++i) {
-    ++numZeroes;
+  if (!variants.empty()) {
+    if (serveSocketPath || batchManifestPath || !replacements.empty() ||
+        tool.applyDelta) {
+      std::cout << "--serve, --batch, --replace and --apply-delta can't be "
+                   "used with --variant\n";
+      showHelp(argv[0]);
+      exit(1);
+    }
+    if (args.size() != 2) {
+      std::cout << "2 arguments to " << argv[0]
+                << " expected with --variant\n";
+      showHelp(argv[0]);
+      exit(1);
+    }
+    RewriteContext context(options);
+    if (!context.rewriteVariants(args[0], variants, args[1]))
+      exit(1);
+    return 0;
   }
 
-  if (numZeroes < phdrSeg->get_memory_size()) {
-    std::cout
-        << "can't patch final executable, please explicitly use ld to run it\n";
-    exit(1);
+  if (tool.applyDelta) {
+    if (serveSocketPath || batchManifestPath || !replacements.empty() ||
+        options.deltaPath) {
+      std::cout << "--serve, --batch, --replace and --delta can't be used "
+                   "with --apply-delta\n";
+      showHelp(argv[0]);
+      exit(1);
+    }
+    if (args.size() != 3) {
+      std::cout << "3 arguments to " << argv[0]
+                << " expected with --apply-delta\n";
+      showHelp(argv[0]);
+      exit(1);
+    }
+    RewriteContext context(options);
+    if (!context.applyDelta(args[0], args[1], args[2]))
+      exit(1);
+    return 0;
   }
 
-  // Step 1. Copy program header table to beginning of PT_LOAD1.
-  std::cout << "Copying program header table to beginning of PT_LOAD1...\n";
-  if (fseek(rawNewElf, ptLoad1Offset, SEEK_SET)) {
-    std::cout << "error going to " << ptLoad1Offset << '\n';
+  // A delta is one file, written by one rewrite.
+  if (options.deltaPath && (serveSocketPath || batchManifestPath)) {
+    std::cout << "--delta can't be used with --serve or --batch\n";
+    showHelp(argv[0]);
     exit(1);
   }
-  std::cout << fwrite(pHdrs, sizeof(char), phdrSeg->get_file_size(), rawNewElf)
-            << " bytes written to PT_LOAD1\n";
-  std::cout << '\n';
-
-  // Step 2. Update PT_LOAD1's program header (the one present in PT_LOAD1).
-  // Update p_vaddr to hold the address of PT_LOAD1
-  assert(fseek(rawNewElf, ptLoad1Offset, SEEK_SET) == 0);
-  Elf64_Phdr progHeader;
-  std::cout << "Updating PT_LOAD1's program header in PT_LOAD1...\n";
-  std::cout << fread(&progHeader, sizeof(Elf64_Phdr), 1, rawNewElf)
-            << " Elf64_Phdrs read from beginning of PT_LOAD1\n";
 
-  progHeader.p_vaddr = ptLoad1->get_virtual_address();
-  progHeader.p_paddr = ptLoad1->get_physical_address();
-  assert(fseek(rawNewElf, ptLoad1Offset, SEEK_SET) == 0);
-  std::cout << fwrite(&progHeader, sizeof(Elf64_Phdr), 1, rawNewElf)
-            << " Elf64_Phdrs written to beginning of PT_LOAD1\n";
-  std::cout << '\n';
-
-  // Step 3. Update ELF header on disk.
-  // The offset of program header table should be offset of PT_LOAD1.
-  std::cout << "Updating ELF header's e_phoff to PT_LOAD1's offset...\n";
-  Elf64_Ehdr elfHeader;
-  assert(fseek(rawNewElf, 0, SEEK_SET) == 0);
-  std::cout << (fread(&elfHeader, sizeof(Elf64_Ehdr), 1, rawNewElf))
-            << " Elf64_Ehdrs read from beginning of " << rwExecPath << '\n';
+  // The daemon keeps the originals mapped between requests, and clones from
+  // the mapping in the clone layout.
+  if (serveSocketPath) {
+    if (!args.empty() || batchManifestPath || !replacements.empty()) {
+      std::cout << "no arguments, --batch or --replace expected with --serve\n";
+      showHelp(argv[0]);
+      exit(1);
+    }
 
-  std::cout << "old e_phoff : " << elfHeader.e_phoff << '\n';
-  elfHeader.e_phoff = ptLoad1->get_offset();
-  std::cout << "new e_phoff : " << elfHeader.e_phoff << '\n';
+    OriginalCache originals;
+    options.originals = &originals;
+    // Requests are already served --jobs at a time.
+    if (numJobs > 1)
+      options.saveThreads = 1;
+    options.useMmap = true;
+    bool ok = serveRewrites(serveSocketPath, 3, 4, numJobs,
+                            [&](const std::vector<std::string> &request) {
+                              RewriteContext context(options);
+                              return context.rewrite(
+                                  request[0].c_str(), request[1].c_str(),
+                                  request[2].c_str(),
+                                  request.size() == 4 ? request[3].c_str()
+                                                      : nullptr);
+                            });
+    return ok ? 0 : 1;
+  }
 
-  assert(fseek(rawNewElf, 0, SEEK_SET) == 0);
-  std::cout << fwrite(&elfHeader, sizeof(Elf64_Ehdr), 1, rawNewElf)
-            << " Elf64_Ehdrs written to beginning of " << rwExecPath << '\n';
+  if (batchManifestPath) {
+    if (!replacements.empty()) {
+      std::cout << "--replace can't be used with --batch\n";
+      showHelp(argv[0]);
+      exit(1);
+    }
+    if (!args.empty()) {
+      std::cout << "no arguments expected with --batch\n";
+      showHelp(argv[0]);
+      exit(1);
+    }
 
-  fclose(rawNewElf);
-}
+    // Jobs already run --jobs at a time.
+    if (numJobs > 1)
+      options.saveThreads = 1;
 
-int main(int argc, char **argv) {
-  if (argc != 5) {
-    std::cout << "exactly 4 arguments to " << argv[0] << " expected\n";
-    showHelp(argv[0]);
-    exit(1);
-  }
+    std::vector<BatchJob> jobs;
+    if (!readBatchManifest(batchManifestPath, 3, 4, jobs)) {
+      std::cout << "can't read batch manifest " << batchManifestPath << '\n';
+      exit(1);
+    }
 
-  const char *execFilePath = argv[1];
-  const char *newFatbinPath = argv[2];
-  const char *rwExecPath = argv[3];
-  const char *coOffsetPath = argv[4];
-  FILE * ffp = fopen(coOffsetPath,"r");
-  uint32_t co_offset ,num_cos ;
-  vector<uint32_t> co_offsets;
-  fscanf(ffp,"%d",&num_cos);
-  for ( uint32_t xx = 0 ; xx< num_cos; xx++){
-    fscanf(ffp,"%d",&co_offset);
-    co_offsets.push_back(co_offset);
+    bool ok = runBatch(jobs, numJobs, [&](const std::vector<std::string> &job) {
+      RewriteContext context(options);
+      return context.rewrite(job[0].c_str(), job[1].c_str(), job[2].c_str(),
+                             job.size() == 4 ? job[3].c_str() : nullptr);
+    });
+    return ok ? 0 : 1;
   }
-  
-  ELFIO::elfio execFile;
-  ELFIO::elfio newExecFile;
-  std::ifstream newFatbin;
 
-  if (!execFile.load(execFilePath)) {
-    std::cout << "can't find or process ELF file " << execFilePath << '\n';
-    exit(1);
+  if (!replacements.empty()) {
+    if (args.size() != 2) {
+      std::cout << "2 arguments to " << argv[0] << " expected with --replace\n";
+      showHelp(argv[0]);
+      exit(1);
+    }
+    RewriteContext context(options);
+    if (!context.replaceCodeObjects(args[0], replacements, args[1]))
+      exit(1);
+    return 0;
   }
 
-  ELFIO::section *fatbinSection = getFatbinSection(execFile);
-  if (!fatbinSection) {
-    std::cout << ".hip_fatbin section not found in " << execFilePath << "\n";
+  if (args.size() != 3 && args.size() != 4) {
+    std::cout << "3 or 4 arguments to " << argv[0] << " expected\n";
+    showHelp(argv[0]);
     exit(1);
   }
 
-  ELFIO::section *fatbinWrapperSection = getFatbinWrapperSection(execFile);
-  if (!fatbinWrapperSection) {
-    std::cout << ".hipFatBinSegment section not found in " << execFilePath
-              << "\n";
+  const char *coOffsetPath = args.size() == 4 ? args[3] : nullptr;
+  RewriteContext context(options);
+  if (!context.rewrite(args[0], args[1], args[2], coOffsetPath))
     exit(1);
-  }
-
-  cloneExec(execFile, newExecFile);
-
-  newFatbin.open(newFatbinPath, std::ios::in);
-  size_t newFatbinSize = getFileSizeAndReset(newFatbin);
-  char *newFatbinContent = new char[newFatbinSize];
-
-  newFatbin.read(newFatbinContent, newFatbinSize);
-  addNewFatbin(newExecFile, newFatbinContent, newFatbinSize, co_offsets);
-
-  delete[] newFatbinContent;
-  newFatbin.close();
-
-  std::cout << newExecFile.validate() << '\n';
-  newExecFile.save(rwExecPath);
-
-  // To ensure that the linux kernel loader picks up the program headers.
-  patchExec(rwExecPath);
 }
@@ -0,0 +1,1331 @@
+#include "execrw.hpp"
+
+#include "elfio/elfio.hpp"
+#include "append-rewrite.hpp"
+#include "clone-writer.hpp"
+#include "debug-compression.hpp"
+#include "delta.hpp"
+#include "fatbin-prune.hpp"
+#include "fatbin-slot.hpp"
+#include "fatbin-splice.hpp"
+#include "fatbin-input.hpp"
+#include "fatbin-variants.hpp"
+#include "file-copy.hpp"
+#include "inplace-rewrite.hpp"
+#include "kernel-patch.hpp"
+#include "layout-index.hpp"
+#include "log.hpp"
+#include "mapped-elf.hpp"
+#include "note-rewrite.hpp"
+#include "offload-bundle.hpp"
+#include "original-cache.hpp"
+
+#include <cassert>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The rewrite pipeline of libexecrw, see execrw.hpp. The clone layout creates
+// a clone of the original executable, adds the new fatbin to the clone, and
+// later patches the clone so that the Linux kernel loader can see the program
+// headers. The append and note layouts patch a copy of the original instead.
+
+// A payload that still has to be copied from the original to the clone.
+struct ClonedRange {
+  ELFIO::section *newSection;
+  uint64_t ogOffset;
+  uint64_t size;
+};
+
+// The slot reserved by addNewFatbin(). The fatbin and its note are written
+// into it once the clone is saved and .new_fatbin has a file offset.
+struct PendingFatbinSlot {
+  ELFIO::section *fatbinSection = nullptr;
+  ELFIO::section *noteSection = nullptr;
+  size_t fatbinSize = 0;
+};
+
+// What the phases of one clone-layout rewrite pass on to the later ones. Each
+// RewriteContext has its own, and resets it before every rewrite.
+struct CloneState {
+  // The section at index i in the original is clonedSections[i] in the clone.
+  // This is for correcting the section links in the clone.
+  std::vector<ELFIO::section *> clonedSections;
+  // With --mmap, the payloads saveClone() copies from the original.
+  std::vector<ClonedRange> pendingClonedRanges;
+  PendingFatbinSlot pendingFatbinSlot;
+};
+
+using std::vector;
+
+static void dumpSection(const ELFIO::section *section,
+                        bool printContents = true) {
+  assert(section && "section must be non-null");
+
+  logDebug() << "section : " << section->get_name() << ", ";
+  logDebug() << "size : " << section->get_size() << ", ";
+  logDebug() << "offset : " << section->get_offset() << ", ";
+  logDebug() << "addr-align : " << section->get_addr_align() << ", ";
+  logDebug() << "entry-size : " << section->get_entry_size() << '\n';
+
+  if (!printContents)
+    return;
+
+  logDebug() << "section contents :\n";
+
+  logDebug() << std::hex;
+  for (int i = 0; i < section->get_size(); ++i) {
+    logDebug() << (unsigned)section->get_data()[i] << ' ';
+  }
+  logDebug() << std::dec << '\n';
+}
+
+// === SECTION-GETTING HELPERS BEGIN ===
+//
+// The original fatbin, as it's called in the clone.
+static ELFIO::section *getFatbinSection(const LayoutIndex &index,
+                                 const FatbinSectionOptions &sections =
+                                     FatbinSectionOptions()) {
+  return index.getSection(sections.oldFatbinName());
+}
+
+static ELFIO::section *getFatbinWrapperSection(const LayoutIndex &index) {
+  return index.getSection(".hipFatBinSegment");
+}
+//
+// === SECTION-GETTING HELPERS END ===
+
+static const ELFIO::Elf64_Phdr *getPtLoad1(const MappedElf &file) {
+  for (size_t i = 0; i < file.numSegments(); ++i) {
+    const ELFIO::Elf64_Phdr &segment = file.segmentHeader(i);
+    if (segment.p_type == ELFIO::PT_LOAD)
+      return &segment;
+  }
+  return nullptr;
+}
+
+static const ELFIO::Elf64_Phdr *getPhdrSegment(const MappedElf &file) {
+  for (size_t i = 0; i < file.numSegments(); ++i) {
+    const ELFIO::Elf64_Phdr &segment = file.segmentHeader(i);
+    if (segment.p_type == ELFIO::PT_PHDR)
+      return &segment;
+  }
+  return nullptr;
+}
+
+// The segment that ends last in memory, or nullptr if there are none.
+static ELFIO::segment *getLastSegment(const ELFIO::elfio &execFile) {
+  const size_t numSegments = execFile.segments.size();
+  if (numSegments == 0)
+    return nullptr;
+
+  ELFIO::segment *lastSegment = execFile.segments[0];
+  for (size_t i = 0; i < numSegments; ++i) {
+    ELFIO::segment *currSegment = execFile.segments[i];
+    size_t currSegmentBegin = currSegment->get_virtual_address();
+    size_t currSegmentSize = currSegment->get_memory_size();
+    size_t currSegmentEnd = currSegmentBegin + currSegmentSize;
+
+    size_t lastSegmentBegin = lastSegment->get_virtual_address();
+    size_t lastSegmentSize = lastSegment->get_memory_size();
+    size_t lastSegmentEnd = lastSegmentBegin + lastSegmentSize;
+
+    if (currSegmentEnd > lastSegmentEnd) {
+      lastSegment = currSegment;
+    }
+  }
+
+  return lastSegment;
+}
+
+static void cloneHeader(const ELFIO::elfio &ogExec, ELFIO::elfio &newExec) {
+  newExec.create(ogExec.get_class(), ogExec.get_encoding());
+  newExec.set_os_abi(ogExec.get_os_abi());
+  newExec.set_abi_version(ogExec.get_abi_version());
+  newExec.set_type(ogExec.get_type());
+  newExec.set_machine(ogExec.get_machine());
+  newExec.set_entry(ogExec.get_entry());
+}
+
+static bool shouldClone(ELFIO::Elf_Word type, const std::string &name) {
+  switch (type) {
+  case ELFIO::SHT_NULL:
+    return false;
+
+  case ELFIO::SHT_STRTAB:
+    // Don't clone section header string table, ELFIO will create a new one
+    if (name == ".shstrtab")
+      return false;
+    return true;
+
+  case ELFIO::SHT_NOTE:
+    // The slot of an earlier rewrite no longer holds the fatbin in use.
+    return name != ".note.execrw";
+
+  default:
+    return true;
+  }
+}
+
+static bool shouldClone(const ELFIO::section *section) {
+  return shouldClone(section->get_type(), section->get_name());
+}
+
+static void cloneSections(CloneState &state, const ELFIO::elfio &ogExec,
+                          ELFIO::elfio &newExec,
+                          const FatbinSectionOptions &sections) {
+  auto ogSections = ogExec.sections;
+  state.clonedSections.assign(ogSections.size(), nullptr);
+
+  for (size_t i = 0; i < ogSections.size(); ++i) {
+    ELFIO::section *ogSection = ogSections[i];
+
+    if (!shouldClone(ogSection))
+      continue;
+
+    if (logEnabled(LogLevel::Debug)) {
+      logDebug() << "cloning\n";
+      dumpSection(ogSection, false);
+      logDebug() << '\n';
+    }
+
+    const std::string &name = ogSection->get_name();
+    ELFIO::section *newSection =
+        newExec.sections.add(sections.clonedName(name));
+    newSection->set_type(ogSection->get_type());
+    newSection->set_flags(ogSection->get_flags());
+    newSection->set_info(ogSection->get_info());
+
+    // NOTE: This can be incorrect link, and will be corrected later, after all
+    // sections are cloned.
+    newSection->set_link(ogSection->get_link());
+
+    newSection->set_addr_align(ogSection->get_addr_align());
+    newSection->set_entry_size(ogSection->get_entry_size());
+    newSection->set_address(ogSection->get_address());
+    newSection->set_size(ogSection->get_size());
+
+    const char *contents = ogSection->get_data();
+    if (contents && !sections.dropsContents(name))
+      newSection->set_data(contents, ogSection->get_size());
+
+    state.clonedSections[i] = newSection;
+  }
+}
+
+static void correctSectionLinks(CloneState &state) {
+  // If ogSection's sh_link holds index in ogExec's section header table, we
+  // must update newSection's sh_link hold corresponding index in newExec's
+  // section header table. Until then, newSection's sh_link still holds the
+  // index in ogExec's section header table.
+  for (ELFIO::section *newSection : state.clonedSections) {
+    if (!newSection)
+      continue;
+
+    auto ogLinkSectionIdx = newSection->get_link();
+    if (ogLinkSectionIdx >= state.clonedSections.size() ||
+        !state.clonedSections[ogLinkSectionIdx])
+      continue;
+
+    auto *newLinkSection = state.clonedSections[ogLinkSectionIdx];
+    newSection->set_link(newLinkSection->get_index());
+  }
+}
+
+static void cloneSegments(const ELFIO::elfio &ogExec, ELFIO::elfio &newExec,
+                   const LayoutIndex &newIndex) {
+  auto ogSegments = ogExec.segments;
+  for (size_t i = 0; i < ogSegments.size(); ++i) {
+    ELFIO::segment *ogSegment = ogSegments[i];
+    ELFIO::segment *newSegment = newExec.segments.add();
+    newSegment->set_type(ogSegment->get_type());
+    newSegment->set_flags(ogSegment->get_flags());
+    newSegment->set_align(ogSegment->get_align());
+    newSegment->set_virtual_address(ogSegment->get_virtual_address());
+    newSegment->set_physical_address(ogSegment->get_physical_address());
+
+    newSegment->set_file_size(ogSegment->get_file_size());
+    newSegment->set_memory_size(ogSegment->get_memory_size());
+  }
+
+  newIndex.mapSectionsToSegments(newExec);
+}
+
+// newIndex is built over the clone once its sections are in place, and is
+// used from then on to look sections up.
+static void cloneExec(CloneState &state, const ELFIO::elfio &ogExec,
+                      ELFIO::elfio &newExec, LayoutIndex &newIndex,
+                      const FatbinSectionOptions &sections) {
+  cloneHeader(ogExec, newExec);
+  cloneSections(state, ogExec, newExec, sections);
+  correctSectionLinks(state);
+  newIndex.build(newExec);
+  cloneSegments(ogExec, newExec, newIndex);
+}
+
+// === MMAP-BACKED CLONING BEGIN ===
+//
+// With --mmap the original executable is mmapped instead of being loaded by
+// ELFIO, and the cloned sections carry only their headers. ELFIO leaves holes
+// for these sections when laying out the clone, and saveClone() fills them
+// from the original file. No section payload is copied to the heap, except
+// for the fatbin wrapper which is patched in place.
+
+static void cloneHeader(const MappedElf &ogExec, ELFIO::elfio &newExec) {
+  const ELFIO::Elf64_Ehdr &ehdr = ogExec.header();
+  newExec.create(ehdr.e_ident[4], ehdr.e_ident[5]);
+  newExec.set_os_abi(ehdr.e_ident[7]);
+  newExec.set_abi_version(ehdr.e_ident[8]);
+  newExec.set_type(ehdr.e_type);
+  newExec.set_machine(ehdr.e_machine);
+  newExec.set_entry(ehdr.e_entry);
+}
+
+static bool cloneSections(CloneState &state, const MappedElf &ogExec,
+                          ELFIO::elfio &newExec,
+                          const FatbinSectionOptions &sections) {
+  state.clonedSections.assign(ogExec.numSections(), nullptr);
+
+  for (size_t i = 0; i < ogExec.numSections(); ++i) {
+    const ELFIO::Elf64_Shdr &ogSection = ogExec.sectionHeader(i);
+    const std::string name = ogExec.sectionName(i);
+
+    if (!shouldClone(ogSection.sh_type, name))
+      continue;
+
+    ELFIO::section *newSection =
+        newExec.sections.add(sections.clonedName(name));
+    newSection->set_type(ogSection.sh_type);
+    newSection->set_flags(ogSection.sh_flags);
+    newSection->set_info(ogSection.sh_info);
+
+    // NOTE: This can be incorrect link, and will be corrected later, after all
+    // sections are cloned.
+    newSection->set_link(ogSection.sh_link);
+
+    newSection->set_addr_align(ogSection.sh_addralign);
+    newSection->set_entry_size(ogSection.sh_entsize);
+    newSection->set_address(ogSection.sh_addr);
+    newSection->set_size(ogSection.sh_size);
+
+    if (logEnabled(LogLevel::Debug)) {
+      logDebug() << "cloning\n";
+      dumpSection(newSection, false);
+      logDebug() << '\n';
+    }
+
+    if (ogSection.sh_type != ELFIO::SHT_NOBITS && ogSection.sh_size != 0 &&
+        !sections.dropsContents(name)) {
+      if (ogSection.sh_offset > ogExec.size() ||
+          ogSection.sh_size > ogExec.size() - ogSection.sh_offset) {
+        logError() << "section " << name << " lies outside of the file\n";
+        return false;
+      }
+
+      // The wrapper is the only cloned section that gets modified.
+      if (name == ".hipFatBinSegment")
+        newSection->set_data(ogExec.data() + ogSection.sh_offset,
+                             ogSection.sh_size);
+      else
+        state.pendingClonedRanges.push_back(
+            {newSection, ogSection.sh_offset, ogSection.sh_size});
+    }
+
+    state.clonedSections[i] = newSection;
+  }
+  return true;
+}
+
+static void cloneSegments(const MappedElf &ogExec, ELFIO::elfio &newExec,
+                   const LayoutIndex &newIndex) {
+  for (size_t i = 0; i < ogExec.numSegments(); ++i) {
+    const ELFIO::Elf64_Phdr &ogSegment = ogExec.segmentHeader(i);
+    ELFIO::segment *newSegment = newExec.segments.add();
+    newSegment->set_type(ogSegment.p_type);
+    newSegment->set_flags(ogSegment.p_flags);
+    newSegment->set_align(ogSegment.p_align);
+    newSegment->set_virtual_address(ogSegment.p_vaddr);
+    newSegment->set_physical_address(ogSegment.p_paddr);
+
+    newSegment->set_file_size(ogSegment.p_filesz);
+    newSegment->set_memory_size(ogSegment.p_memsz);
+  }
+
+  newIndex.mapSectionsToSegments(newExec);
+}
+
+static bool cloneExec(CloneState &state, const MappedElf &ogExec,
+                      ELFIO::elfio &newExec, LayoutIndex &newIndex,
+                      const FatbinSectionOptions &sections) {
+  cloneHeader(ogExec, newExec);
+  if (!cloneSections(state, ogExec, newExec, sections))
+    return false;
+  correctSectionLinks(state);
+  newIndex.build(newExec);
+  cloneSegments(ogExec, newExec, newIndex);
+  return true;
+}
+
+// Compress the debug sections of the clone. With --mmap, their payloads are
+// compressed straight from the mapping of the original, and the ones that
+// don't get smaller are left to saveClone() to copy.
+static bool compressClonedDebugSections(CloneState &state,
+                                        const MappedElf &ogExec,
+                                        BundleCompression method,
+                                        unsigned numThreads) {
+  std::vector<DebugSection> debugSections;
+  std::vector<ClonedRange> debugRanges, otherRanges;
+  for (const ClonedRange &range : state.pendingClonedRanges) {
+    ELFIO::section *section = range.newSection;
+    if (isCompressibleDebugSection(section->get_name(), section->get_type(),
+                                   section->get_flags())) {
+      debugSections.push_back(
+          {section, ogExec.data() + range.ogOffset, range.size});
+      debugRanges.push_back(range);
+    } else {
+      otherRanges.push_back(range);
+    }
+  }
+  for (ELFIO::section *section : state.clonedSections) {
+    if (section && section->get_data() && section->get_size() &&
+        isCompressibleDebugSection(section->get_name(), section->get_type(),
+                                   section->get_flags()))
+      debugSections.push_back(
+          {section, section->get_data(), section->get_size()});
+  }
+
+  DebugCompressionStats stats;
+  if (!compressDebugSections(debugSections, method, numThreads, stats))
+    return false;
+  for (size_t i = 0; i < debugRanges.size(); ++i)
+    if (!debugSections[i].compressed)
+      otherRanges.push_back(debugRanges[i]);
+  state.pendingClonedRanges = otherRanges;
+
+  logOut() << "compressed " << stats.numCompressed << " of "
+           << debugSections.size() << " debug sections, "
+           << stats.originalSize << " bytes to " << stats.compressedSize
+           << '\n';
+  if (currentStats) {
+    currentStats->set("debug_sections_compressed", stats.numCompressed);
+    currentStats->set("debug_bytes", stats.originalSize);
+    currentStats->set("compressed_debug_bytes", stats.compressedSize);
+  }
+  return true;
+}
+
+// Write the clone. With --mmap, the payloads of the cloned sections are
+// copied from the original at the offsets ELFIO assigned to them, as reflinks
+// or in-kernel copies where the filesystem allows, so the bytes don't pass
+// through this process.
+static bool saveClone(CloneState &state, ELFIO::elfio &newExec,
+                      const MappedElf &ogExec, const char *rwExecPath,
+                      unsigned numThreads) {
+  CloneWriter writer;
+  if (!writer.layOut(newExec))
+    return false;
+  for (const ClonedRange &range : state.pendingClonedRanges)
+    writer.addFileRange(ogExec.fd(), range.ogOffset,
+                        range.newSection->get_offset(), range.size);
+
+  CopyStats stats;
+  if (!writer.write(rwExecPath, numThreads, stats))
+    return false;
+  logOut() << "saved with " << writer.numThreads() << " threads, "
+           << stats.cloned << " bytes of cloned sections reflinked, "
+           << stats.copied << " copied by the kernel, " << stats.buffered
+           << " copied through a buffer\n";
+  if (currentStats)
+    currentStats->set("save_threads", writer.numThreads());
+
+  state.pendingClonedRanges.clear();
+  return true;
+}
+//
+// === MMAP-BACKED CLONING END ===
+
+static bool updateFatbinAddr(const LayoutIndex &index, uint64_t newAddr,
+                             const std::vector<uint64_t> &co_offsets) {
+  ELFIO::section *fatbinWrapperSection = getFatbinWrapperSection(index);
+  if (!fatbinWrapperSection) {
+    logError() << "can't find .hipFatBinSegment in the clone\n";
+    return false;
+  }
+  if (co_offsets.size() * 24 > fatbinWrapperSection->get_size()) {
+    logError() << ".hipFatBinSegment holds fewer than " << co_offsets.size()
+               << " wrappers\n";
+    return false;
+  }
+
+  for (uint32_t xx = 0 ; xx< co_offsets.size(); xx++){
+     uint64_t *addrPtr = (uint64_t *)(fatbinWrapperSection->get_data() + xx*24 +  8);
+    *addrPtr = newAddr+co_offsets[xx];
+  
+  }
+  // address is at offset 8.
+  return true;
+ }
+
+// Create a .new_fatbin section (.hip_fatbin with --rename-sections), map it to
+// a new PT_LOAD segment, update the fatbin wrapper. With slack, that many
+// bytes are reserved after the new fatbin and a .note.execrw section records
+// them, see fatbin-slot.hpp. The section then has no data: ELFIO lays it out at
+// the size of the slot, writeFatbinSlot() fills in the fatbin, and the slack
+// stays a hole.
+static bool addNewFatbin(CloneState &state, ELFIO::elfio &newExec,
+                         LayoutIndex &newIndex, const char *newFatbinContent,
+                         size_t newFatbinSize,
+                         const std::vector<uint64_t> &co_offsets, size_t slack,
+                         FatbinAlign align,
+                         const FatbinSectionOptions &sections) {
+
+  ELFIO::section *fatbinSection = getFatbinSection(newIndex, sections);
+  if (!fatbinSection) {
+    logError() << "can't find " << sections.oldFatbinName()
+               << " in the clone\n";
+    return false;
+  }
+
+  // Calculate next virtual address for loading the new fatbin.
+  ELFIO::segment *lastSegment = getLastSegment(newExec);
+  if (!lastSegment) {
+    logError() << "the clone has no segments to add the new fatbin after\n";
+    return false;
+  }
+  size_t nextAddr =
+      lastSegment->get_virtual_address() + lastSegment->get_memory_size();
+
+  // ELFIO puts a new segment at a file offset congruent to its address modulo
+  // its alignment, so this aligns both, see fatbin-align.hpp.
+  size_t alignment = fatbinAlignment(align, fatbinSection->get_addr_align(),
+                                     newFatbinSize + slack);
+  nextAddr = alignUp(nextAddr, alignment);
+
+  ELFIO::section *newFatbinSection =
+      newExec.sections.add(sections.newFatbinName());
+  newFatbinSection->set_type(fatbinSection->get_type());
+  newFatbinSection->set_flags(fatbinSection->get_flags());
+  newFatbinSection->set_info(fatbinSection->get_info());
+  newFatbinSection->set_addr_align(fatbinSection->get_addr_align());
+  newFatbinSection->set_entry_size(fatbinSection->get_entry_size());
+  newFatbinSection->set_address(nextAddr);
+  newIndex.addSection(newFatbinSection);
+
+  if (!slack) {
+    newFatbinSection->set_size(newFatbinSize);
+    newFatbinSection->set_data(newFatbinContent, newFatbinSize);
+  } else {
+    newFatbinSection->set_size(newFatbinSize + slack);
+
+    ELFIO::section *noteSection = newExec.sections.add(".note.execrw");
+    noteSection->set_type(ELFIO::SHT_NOTE);
+    noteSection->set_addr_align(4);
+    std::vector<char> note = makeFatbinSlotNote(FatbinSlot());
+    noteSection->set_data(note.data(), note.size());
+    newIndex.addSection(noteSection);
+
+    state.pendingFatbinSlot.fatbinSection = newFatbinSection;
+    state.pendingFatbinSlot.noteSection = noteSection;
+    state.pendingFatbinSlot.fatbinSize = newFatbinSize;
+  }
+
+  ELFIO::segment *newSegment = newExec.segments.add();
+  newSegment->set_type(ELFIO::PT_LOAD);
+  newSegment->set_flags(ELFIO::PF_R);
+  newSegment->set_align(alignment);
+  newSegment->set_virtual_address(nextAddr);
+  newSegment->set_physical_address(nextAddr);
+
+  newSegment->add_section(newFatbinSection, 1);
+  return updateFatbinAddr(newIndex, nextAddr, co_offsets);
+}
+
+// Write the fatbin and the slot note reserved by addNewFatbin() into the saved
+// clone. The ranges of fatbin are in srcFd.
+static bool writeFatbinSlot(const CloneState &state, const char *rwExecPath,
+                            const FatbinPieces &fatbin, int srcFd) {
+  const PendingFatbinSlot &pendingFatbinSlot = state.pendingFatbinSlot;
+  if (!pendingFatbinSlot.noteSection)
+    return true;
+
+  FatbinSlot slot;
+  slot.offset = pendingFatbinSlot.fatbinSection->get_offset();
+  slot.addr = pendingFatbinSlot.fatbinSection->get_address();
+  slot.capacity = pendingFatbinSlot.fatbinSection->get_size();
+  slot.size = pendingFatbinSlot.fatbinSize;
+  std::vector<char> note = makeFatbinSlotNote(slot);
+
+  int fd = open(rwExecPath, O_WRONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  bool ok = fatbin.write(srcFd, fd, slot.offset) &&
+            pwriteAll(fd, note.data(), note.size(),
+                      pendingFatbinSlot.noteSection->get_offset());
+  return close(fd) == 0 && ok;
+}
+
+// This is for patching the clone at last. For some reason, editing raw segments
+// doesn't work with ELFIO. The clone is mapped rather than loaded, only its
+// headers and the start of PT_LOAD1 are read, and only those are written.
+static bool patchExec(const char *rwExecPath) {
+  MappedElf newExecFile;
+  if (!newExecFile.open(rwExecPath)) {
+    logError() << "can't find or process new ELF file " << rwExecPath << '\n';
+    return false;
+  }
+
+  // Static executables and libraries have no PT_PHDR to move.
+  const ELFIO::Elf64_Phdr *ptLoad1 = getPtLoad1(newExecFile);
+  const ELFIO::Elf64_Phdr *phdrSeg = getPhdrSegment(newExecFile);
+  if (!ptLoad1 || !phdrSeg) {
+    logError() << "can't patch final executable, it has no "
+               << (ptLoad1 ? "PT_PHDR" : "PT_LOAD") << " segment\n";
+    return false;
+  }
+  const uint64_t ptLoad1Offset = ptLoad1->p_offset;
+
+  // The program header table goes over the zeroes at the start of PT_LOAD1.
+  const uint64_t phdrSize = phdrSeg->p_filesz;
+  if (phdrSize > ptLoad1->p_filesz || ptLoad1Offset > newExecFile.size() ||
+      phdrSize > newExecFile.size() - ptLoad1Offset ||
+      phdrSeg->p_offset > newExecFile.size() ||
+      phdrSize > newExecFile.size() - phdrSeg->p_offset ||
+      phdrSize < sizeof(ELFIO::Elf64_Phdr)) {
+    logError()
+        << "can't patch final executable, please explicitly use ld to run it\n";
+    return false;
+  }
+  const char *ptLoad1Data = newExecFile.data() + ptLoad1Offset;
+  for (size_t i = 0; i < phdrSize; ++i) {
+    if (ptLoad1Data[i] != 0) {
+      logError() << "can't patch final executable, please explicitly use ld "
+                    "to run it\n";
+      return false;
+    }
+  }
+
+  // Step 1. Copy program header table to beginning of PT_LOAD1.
+  // Step 2. Update PT_LOAD1's program header (the one present in PT_LOAD1).
+  // Update p_vaddr to hold the address of PT_LOAD1
+  std::vector<char> pHdrs(newExecFile.data() + phdrSeg->p_offset,
+                          newExecFile.data() + phdrSeg->p_offset + phdrSize);
+  ELFIO::Elf64_Phdr progHeader;
+  memcpy(&progHeader, pHdrs.data(), sizeof(progHeader));
+  progHeader.p_vaddr = ptLoad1->p_vaddr;
+  progHeader.p_paddr = ptLoad1->p_paddr;
+  memcpy(pHdrs.data(), &progHeader, sizeof(progHeader));
+
+  // Step 3. Update ELF header on disk.
+  // The offset of program header table should be offset of PT_LOAD1.
+  ELFIO::Elf64_Ehdr elfHeader = newExecFile.header();
+  logOut() << "old e_phoff : " << elfHeader.e_phoff << '\n';
+  elfHeader.e_phoff = ptLoad1Offset;
+  logOut() << "new e_phoff : " << elfHeader.e_phoff << '\n';
+  newExecFile.close();
+
+  int fd = open(rwExecPath, O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    logError() << "can't open new ELF file " << rwExecPath << '\n';
+    return false;
+  }
+  logOut() << "Copying program header table to beginning of PT_LOAD1...\n";
+  bool ok = pwriteAll(fd, pHdrs.data(), pHdrs.size(), ptLoad1Offset);
+  logOut() << "Updating ELF header's e_phoff to PT_LOAD1's offset...\n";
+  ok = ok && pwriteAll(fd, &elfHeader, sizeof(elfHeader), 0);
+  if (close(fd) != 0 || !ok) {
+    logError() << "can't write " << rwExecPath << '\n';
+    return false;
+  }
+  return true;
+}
+
+// === IN-MEMORY FILES BEGIN ===
+//
+// The buffer entry points run the same pipeline as the file ones, on memfds
+// reached through /proc/self/fd. Opening that path opens the memfd itself, so
+// ELFIO, the mappings and the copies work on it as on any file.
+
+class MemFile {
+public:
+  MemFile() = default;
+  MemFile(const MemFile &) = delete;
+  MemFile &operator=(const MemFile &) = delete;
+
+  ~MemFile() {
+    if (fd_ >= 0)
+      close(fd_);
+  }
+
+  bool create(const char *name, const char *data, size_t size) {
+    fd_ = memfd_create(name, MFD_CLOEXEC);
+    if (fd_ < 0)
+      return false;
+    path_ = "/proc/self/fd/" + std::to_string(fd_);
+    return size == 0 || pwriteAll(fd_, data, size, 0);
+  }
+
+  const char *path() const { return path_.c_str(); }
+
+  bool read(std::vector<char> &contents) const {
+    struct stat st;
+    if (fstat(fd_, &st) != 0)
+      return false;
+    contents.resize(st.st_size);
+    for (size_t done = 0; done < contents.size();) {
+      ssize_t n = pread(fd_, contents.data() + done, contents.size() - done,
+                        done);
+      if (n <= 0)
+        return false;
+      done += n;
+    }
+    return true;
+  }
+
+private:
+  int fd_ = -1;
+  std::string path_;
+};
+//
+// === IN-MEMORY FILES END ===
+
+RewriteContext::RewriteContext(const RewriteOptions &options)
+    : options_(options), state_(new CloneState()) {}
+
+RewriteContext::~RewriteContext() = default;
+
+// Every entry point goes through here. The thread's log and statistics point
+// at this context for the duration of the rewrite, and are restored after.
+template <typename RewriteFn>
+bool RewriteContext::run(const char *execName, const char *fatbinName,
+                         const char *rwExecPath, RewriteFn rewrite) {
+  *state_ = CloneState();
+  stats_ = RewriteStats();
+
+  std::ostream *previousLog = logStream;
+  RewriteStats *previousStats = currentStats;
+  if (options_.log)
+    logStream = options_.log;
+
+  const bool collectStats = options_.statsPath || options_.collectStats;
+  if (collectStats) {
+    stats_.set("exec", execName);
+    stats_.set("fatbin", fatbinName);
+    stats_.set("output", rwExecPath);
+    stats_.set("layout", options_.layout);
+    currentStats = &stats_;
+  }
+
+  // The delta is made by comparing the output with the original, which a
+  // rewrite in place overwrites.
+  bool ok = true;
+  if (options_.deltaPath && isSameFile(execName, rwExecPath)) {
+    logError() << "can't write a delta of " << rwExecPath
+               << ", it is rewritten in place\n";
+    ok = false;
+  }
+  ok = ok && rewrite();
+  currentStats = previousStats;
+
+  if (collectStats) {
+    MappedElf rwExecFile;
+    if (ok && rwExecFile.open(rwExecPath)) {
+      stats_.set("output_bytes", rwExecFile.size());
+      stats_.set("output_sections", rwExecFile.numSections());
+      stats_.set("output_segments", rwExecFile.numSegments());
+    }
+    stats_.setFlag("ok", ok);
+  }
+
+  if (options_.statsPath && !appendStats(options_.statsPath, stats_))
+    logError() << "can't write statistics to " << options_.statsPath << '\n';
+
+  logStream = previousLog;
+  return ok;
+}
+
+bool RewriteContext::rewrite(const char *execPath, const char *fatbinPath,
+                             const char *rwExecPath,
+                             const char *coOffsetPath) {
+  return run(execPath, fatbinPath, rwExecPath, [&]() {
+    // A fatbin from a pipe is spooled first, and read from the spool from
+    // then on, by the cache as well.
+    FatbinInput spooledFatbin;
+    if (FatbinInput::needsSpool(fatbinPath)) {
+      StatsPhase spoolPhase("spool");
+      if (!spooledFatbin.open(fatbinPath, rwExecPath))
+        return false;
+      spoolPhase.end();
+      return rewriteCached(execPath, spooledFatbin.path(), rwExecPath,
+                           coOffsetPath) &&
+             emitDelta(execPath, rwExecPath);
+    }
+    return rewriteCached(execPath, fatbinPath, rwExecPath, coOffsetPath) &&
+           emitDelta(execPath, rwExecPath);
+  });
+}
+
+bool RewriteContext::rewrite(const char *execPath, const char *fatbin,
+                             size_t fatbinSize, const char *rwExecPath,
+                             const std::vector<uint64_t> *coOffsets) {
+  return run(execPath, "(memory)", rwExecPath, [&]() {
+    return rewriteUncached(execPath, fatbin, fatbinSize, -1, rwExecPath,
+                           coOffsets, nullptr) &&
+           emitDelta(execPath, rwExecPath);
+  });
+}
+
+bool RewriteContext::replaceCodeObjects(
+    const char *execPath,
+    const std::vector<CodeObjectReplacement> &replacements,
+    const char *rwExecPath) {
+  return run(execPath, "(spliced)", rwExecPath, [&]() {
+    return rewriteUncached(execPath, nullptr, 0, -1, rwExecPath, nullptr,
+                           &replacements) &&
+           emitDelta(execPath, rwExecPath);
+  });
+}
+
+bool RewriteContext::patchKernels(const char *execPath,
+                                  const std::vector<KernelPatch> &patches,
+                                  const char *rwExecPath) {
+  return run(execPath, "(patched)", rwExecPath, [&]() {
+    StatsPhase patchPhase("patch_kernels");
+    MappedElf exec;
+    if (!exec.open(execPath)) {
+      logError() << "can't find or process ELF file " << execPath << '\n';
+      return false;
+    }
+    std::vector<CodeObjectReplacement> replacements;
+    if (!::patchKernels(exec, patches, replacements))
+      return false;
+    exec.close();
+    patchPhase.end();
+
+    return rewriteUncached(execPath, nullptr, 0, -1, rwExecPath, nullptr,
+                           &replacements) &&
+           emitDelta(execPath, rwExecPath);
+  });
+}
+
+bool RewriteContext::rewriteVariants(
+    const char *execPath, const std::vector<FatbinVariant> &variants,
+    const char *rwExecPath) {
+  return run(execPath, "(variants)", rwExecPath, [&]() {
+    for (size_t i = 0; i < variants.size(); ++i) {
+      for (size_t j = 0; j < i; ++j) {
+        if (variants[i].name == variants[j].name) {
+          logError() << "variant " << variants[i].name << " given twice\n";
+          return false;
+        }
+      }
+    }
+    if (variants.empty()) {
+      logError() << "no variants to embed\n";
+      return false;
+    }
+
+    StatsPhase loadPhase("load");
+    MappedElf exec;
+    if (!exec.open(execPath)) {
+      logError() << "can't find or process ELF file " << execPath << '\n';
+      return false;
+    }
+    loadPhase.end();
+
+    // Every variant must have a bundle for every wrapper the first one
+    // fills.
+    StatsPhase readFatbinPhase("read_fatbin");
+    std::vector<std::unique_ptr<FatbinInput>> inputs;
+    std::vector<std::string> names;
+    std::vector<FatbinPieces> fatbins;
+    std::vector<std::vector<uint64_t>> bundleOffsets;
+    for (const FatbinVariant &variant : variants) {
+      inputs.push_back(std::make_unique<FatbinInput>());
+      FatbinInput &input = *inputs.back();
+      if (!input.open(variant.fatbinPath.c_str(), rwExecPath))
+        return false;
+
+      std::vector<OffloadBundle> bundles;
+      if (!parseOffloadBundles(input.data(), input.size(), bundles)) {
+        logError() << "can't find offload bundles in "
+                   << variant.fatbinPath << '\n';
+        return false;
+      }
+      bundleOffsets.push_back(getCodeObjectOffsets(bundles));
+      if (bundleOffsets.back().size() != bundleOffsets[0].size()) {
+        logError() << variant.fatbinPath << " has "
+                   << bundleOffsets.back().size()
+                   << " code object bundles, " << variants[0].fatbinPath
+                   << " has " << bundleOffsets[0].size() << '\n';
+        return false;
+      }
+      names.push_back(variant.name);
+      fatbins.emplace_back();
+      fatbins.back().addFile(input.fd(), input.data(), input.size());
+    }
+    readFatbinPhase.end();
+
+    StatsPhase variantsPhase("variants");
+    if (!variantRewrite(exec, rwExecPath, names, fatbins, bundleOffsets,
+                        options_.align))
+      return false;
+    variantsPhase.end();
+    if (currentStats) {
+      currentStats->set("input_bytes", exec.size());
+      currentStats->set("fatbin_variants", variants.size());
+      currentStats->set("code_objects", bundleOffsets[0].size());
+    }
+    exec.close();
+
+    return emitDelta(execPath, rwExecPath);
+  });
+}
+
+bool RewriteContext::applyDelta(const char *execPath, const char *deltaPath,
+                                const char *rwExecPath) {
+  return run(execPath, deltaPath, rwExecPath, [&]() {
+    StatsPhase applyPhase("apply_delta");
+    return ::applyDelta(execPath, deltaPath, rwExecPath);
+  });
+}
+
+bool RewriteContext::rewrite(const char *exec, size_t execSize,
+                             const char *fatbin, size_t fatbinSize,
+                             std::vector<char> &rwExec,
+                             const std::vector<uint64_t> *coOffsets) {
+  MemFile execFile, rwExecFile;
+  if (!execFile.create("execrw-exec", exec, execSize) ||
+      !rwExecFile.create("execrw-output", nullptr, 0)) {
+    logError() << "can't create in-memory files for the rewrite\n";
+    return false;
+  }
+
+  bool ok = run("(memory)", "(memory)", rwExecFile.path(), [&]() {
+    return rewriteUncached(execFile.path(), fatbin, fatbinSize, -1,
+                           rwExecFile.path(), coOffsets, nullptr);
+  });
+  return ok && rwExecFile.read(rwExec);
+}
+
+// The sections of the original that output has at other offsets, going by
+// their names (as the clone layout renames them) and sizes. Their bytes are
+// compared by writeDelta() like the others.
+static std::vector<DeltaMove>
+findMovedSections(const MappedElf &original, const MappedElf &output,
+                  const FatbinSectionOptions &sections) {
+  std::vector<DeltaMove> moves;
+  std::vector<bool> matched(output.numSections(), false);
+  for (size_t i = 1; i < original.numSections(); ++i) {
+    const ELFIO::Elf64_Shdr &ogSection = original.sectionHeader(i);
+    if (ogSection.sh_type == ELFIO::SHT_NOBITS || ogSection.sh_size == 0)
+      continue;
+    const std::string name = sections.clonedName(original.sectionName(i));
+    for (size_t j = 1; j < output.numSections(); ++j) {
+      const ELFIO::Elf64_Shdr &section = output.sectionHeader(j);
+      if (matched[j] || section.sh_type == ELFIO::SHT_NOBITS ||
+          section.sh_size != ogSection.sh_size ||
+          output.sectionName(j) != name)
+        continue;
+      matched[j] = true;
+      if (section.sh_offset != ogSection.sh_offset)
+        moves.push_back(
+            {ogSection.sh_offset, section.sh_offset, section.sh_size});
+      break;
+    }
+  }
+  return moves;
+}
+
+bool RewriteContext::emitDelta(const char *execPath, const char *rwExecPath) {
+  if (!options_.deltaPath)
+    return true;
+
+  StatsPhase deltaPhase("delta");
+  std::vector<DeltaMove> moves;
+  MappedElf original, output;
+  if (original.open(execPath) && output.open(rwExecPath))
+    moves = findMovedSections(original, output, options_.sections);
+  original.close();
+  output.close();
+
+  uint64_t deltaSize;
+  if (!writeDelta(execPath, rwExecPath, options_.deltaPath, moves, deltaSize))
+    return false;
+  if (currentStats)
+    currentStats->set("delta_bytes", deltaSize);
+  return true;
+}
+
+bool RewriteContext::rewriteCached(const char *execFilePath,
+                                   const char *newFatbinPath,
+                                   const char *rwExecPath,
+                                   const char *coOffsetPath) {
+  const RewriteCache *cache = options_.cache;
+  if (!cache)
+    return rewriteFiles(execFilePath, newFatbinPath, rwExecPath, coOffsetPath);
+
+  std::vector<const char *> inputPaths = {execFilePath, newFatbinPath};
+  if (coOffsetPath)
+    inputPaths.push_back(coOffsetPath);
+
+  std::string cacheTag = options_.toolName + "-" + options_.layout;
+  if (options_.firstWrapperOnly)
+    cacheTag += "-first";
+  if (options_.useMmap)
+    cacheTag += "-mmap";
+  if (options_.slack)
+    cacheTag += "-slack" + std::to_string(options_.slack);
+  cacheTag += std::string("-align") + fatbinAlignName(options_.align);
+  if (options_.sections.rename)
+    cacheTag += "-rename";
+  if (options_.sections.dropOld)
+    cacheTag += "-drop";
+  if (options_.compress)
+    cacheTag += std::string("-") + bundleCompressionName(options_.compression);
+  for (const std::string &target : options_.targets)
+    cacheTag += "-" + target;
+  if (options_.compressDebugSections)
+    cacheTag += std::string("-debug-") +
+                bundleCompressionName(options_.debugCompression);
+
+  StatsPhase fetchPhase("cache_fetch");
+  std::string cacheKey;
+  if (!RewriteCache::makeKey(cacheTag, inputPaths, cacheKey)) {
+    logError() << "can't hash the inputs of " << rwExecPath << '\n';
+    return false;
+  }
+
+  bool hit = cache->fetch(cacheKey, rwExecPath);
+  fetchPhase.end();
+  if (currentStats)
+    currentStats->set("cache", hit ? "hit" : "miss");
+
+  if (hit) {
+    logOut() << "copied " << rwExecPath << " from cache entry " << cacheKey
+             << '\n';
+    return true;
+  }
+
+  if (!rewriteFiles(execFilePath, newFatbinPath, rwExecPath, coOffsetPath))
+    return false;
+
+  // A cache that can't be written to only costs the next run its hit.
+  StatsPhase insertPhase("cache_insert");
+  if (!cache->insert(cacheKey, rwExecPath))
+    logError() << "can't add " << rwExecPath << " to cache " << cache->dir()
+               << '\n';
+  return true;
+}
+
+// Read a co_offsets file, as gen_co_offsets.py writes it: the number of code
+// object bundles, then the offset of each in the new fatbin. There can't be
+// more than the executable has wrappers.
+static bool readCoOffsets(const char *coOffsetPath, const char *execFilePath,
+                          uint64_t fatbinSize, vector<uint64_t> &co_offsets) {
+  MappedElf exec;
+  size_t wrapperIdx = 0;
+  if (!exec.open(execFilePath) ||
+      !(wrapperIdx = exec.findSection(".hipFatBinSegment"))) {
+    logError() << ".hipFatBinSegment section not found in " << execFilePath
+               << '\n';
+    return false;
+  }
+  const uint64_t maxCos = exec.sectionHeader(wrapperIdx).sh_size / 24;
+
+  FILE *ffp = fopen(coOffsetPath, "r");
+  if (!ffp) {
+    logError() << "can't open " << coOffsetPath << '\n';
+    return false;
+  }
+  uint32_t num_cos;
+  bool ok = fscanf(ffp, "%" SCNu32, &num_cos) == 1 && num_cos <= maxCos;
+  for (uint32_t xx = 0; ok && xx < num_cos; xx++) {
+    uint64_t co_offset;
+    ok = fscanf(ffp, "%" SCNu64, &co_offset) == 1 && co_offset < fatbinSize;
+    co_offsets.push_back(co_offset);
+  }
+  fclose(ffp);
+  if (!ok) {
+    logError() << "invalid co_offsets file " << coOffsetPath
+               << ", expected a count of at most " << maxCos
+               << " followed by as many offsets into the fatbin\n";
+    return false;
+  }
+  return true;
+}
+
+bool RewriteContext::rewriteFiles(const char *execFilePath,
+                                  const char *newFatbinPath,
+                                  const char *rwExecPath,
+                                  const char *coOffsetPath) {
+  StatsPhase readFatbinPhase("read_fatbin");
+  FatbinInput newFatbin;
+  if (!newFatbin.open(newFatbinPath, rwExecPath))
+    return false;
+
+  vector<uint64_t> co_offsets;
+  if (coOffsetPath && !readCoOffsets(coOffsetPath, execFilePath,
+                                     newFatbin.size(), co_offsets))
+    return false;
+  readFatbinPhase.end();
+
+  return rewriteUncached(execFilePath, newFatbin.data(), newFatbin.size(),
+                         newFatbin.fd(), rwExecPath,
+                         coOffsetPath ? &co_offsets : nullptr, nullptr);
+}
+
+// Rewrite one executable. Progress and errors go to logOut(), and nothing in
+// here exits the process, so that a failing rewrite doesn't take the others
+// down with it.
+bool RewriteContext::rewriteUncached(const char *execFilePath,
+                                     const char *newFatbin,
+                                     size_t newFatbinSize, int newFatbinFd,
+                                     const char *rwExecPath,
+                                     const vector<uint64_t> *coOffsets,
+                                     const vector<CodeObjectReplacement>
+                                         *replacements) {
+  CloneState &state = *state_;
+  ELFIO::elfio execFile;
+  ELFIO::elfio newExecFile;
+  LayoutIndex newIndex;
+
+  // The original is always mapped, to look for a slot left by an earlier
+  // rewrite, or taken from the cache of originals. Only the ELFIO clone loads
+  // it as well.
+  StatsPhase loadPhase("load");
+  std::shared_ptr<const MappedElf> mappedExec;
+  bool originalCached = false;
+  if (options_.originals) {
+    mappedExec = options_.originals->open(execFilePath, originalCached);
+  } else {
+    auto exec = std::make_shared<MappedElf>();
+    if (exec->open(execFilePath))
+      mappedExec = exec;
+  }
+  if (!mappedExec) {
+    logError() << "can't find or process ELF file " << execFilePath << '\n';
+    return false;
+  }
+  const MappedElf &mappedExecFile = *mappedExec;
+
+  if (!mappedExecFile.findSection(".hip_fatbin")) {
+    logError() << ".hip_fatbin section not found in " << execFilePath << "\n";
+    return false;
+  }
+
+  if (!mappedExecFile.findSection(".hipFatBinSegment")) {
+    logError() << ".hipFatBinSegment section not found in " << execFilePath
+               << "\n";
+    return false;
+  }
+
+  if (!options_.useMmap && options_.layout == "clone" &&
+      !execFile.load(execFilePath)) {
+    logError() << "can't find or process ELF file " << execFilePath << '\n';
+    return false;
+  }
+  loadPhase.end();
+
+  if (currentStats) {
+    currentStats->set("input_bytes", mappedExecFile.size());
+    currentStats->set("input_sections", mappedExecFile.numSections());
+    currentStats->set("input_segments", mappedExecFile.numSegments());
+    if (options_.originals)
+      currentStats->setFlag("original_cached", originalCached);
+  }
+
+  // With replacements, the new fatbin is spliced from the original one and
+  // the offsets of its bundles are known from the splice. Otherwise they are
+  // computed from its bundle headers, unless they are passed explicitly. Only
+  // the bundles to compress are needed with firstWrapperOnly.
+  FatbinPieces fatbinPieces;
+  if (newFatbinFd >= 0)
+    fatbinPieces.addFile(newFatbinFd, newFatbin, newFatbinSize);
+  else
+    fatbinPieces.addBytes(newFatbin, newFatbinSize);
+  vector<uint64_t> co_offsets;
+  if (replacements) {
+    StatsPhase splicePhase("splice");
+    if (!spliceFatbin(mappedExecFile, *replacements, fatbinPieces,
+                      co_offsets))
+      return false;
+    splicePhase.end();
+    newFatbinSize = fatbinPieces.size();
+    if (currentStats)
+      currentStats->set("replaced_code_objects", replacements->size());
+  } else {
+    StatsPhase parsePhase("parse_bundles");
+    if (coOffsets) {
+      co_offsets = *coOffsets;
+    } else if (!options_.firstWrapperOnly || options_.compress) {
+      std::vector<OffloadBundle> bundles;
+      if (!parseOffloadBundles(newFatbin, newFatbinSize, bundles)) {
+        logError() << "can't find offload bundles in the new fatbin\n";
+        return false;
+      }
+      co_offsets = getCodeObjectOffsets(bundles);
+      logOut() << co_offsets.size()
+               << " code object bundles in the new fatbin\n";
+    }
+    parsePhase.end();
+  }
+
+  if (currentStats) {
+    currentStats->set("fatbin_bytes", newFatbinSize);
+    currentStats->set("code_objects", co_offsets.size());
+  }
+
+  // Pruning works on the fatbin in memory, a spliced one is assembled first.
+  std::vector<char> unprunedFatbin;
+  if (!options_.targets.empty()) {
+    StatsPhase prunePhase("prune");
+    const char *fatbin =
+        fatbinPieces.contents(mappedExecFile.data(), unprunedFatbin);
+    FatbinPieces prunedFatbin;
+    if (!pruneFatbin(fatbin, newFatbinSize, options_.targets, prunedFatbin,
+                     co_offsets))
+      return false;
+    fatbinPieces = prunedFatbin;
+    newFatbinSize = fatbinPieces.size();
+  }
+
+  // The layouts that build the fatbin in memory need the pieces assembled.
+  std::vector<char> assembledFatbin;
+  if (options_.compress) {
+    StatsPhase compressPhase("compress");
+    FatbinCompressionStats compression;
+    std::vector<char> compressedFatbin;
+    if (!compressFatbin(
+            fatbinPieces.contents(mappedExecFile.data(), assembledFatbin),
+            newFatbinSize, options_.compression, co_offsets, compressedFatbin,
+            compression)) {
+      logError() << "can't compress the bundles of the new fatbin\n";
+      return false;
+    }
+    compressPhase.end();
+
+    logOut() << "compressed the new fatbin with "
+             << bundleCompressionName(options_.compression) << " from "
+             << compression.originalSize << " to "
+             << compression.compressedSize << " bytes in "
+             << compression.compressMs << " ms, verified in "
+             << compression.verifyMs << " ms\n";
+    if (currentStats) {
+      currentStats->set("compression",
+                        bundleCompressionName(options_.compression));
+      currentStats->set("compressed_fatbin_bytes", compression.compressedSize);
+    }
+
+    newFatbinSize = compressedFatbin.size();
+    fatbinPieces = FatbinPieces();
+    fatbinPieces.addBytes(std::move(compressedFatbin));
+  }
+
+  // The first bundle stays at the start of the fatbin when compressed.
+  if (options_.firstWrapperOnly)
+    co_offsets = {0};
+
+  // A new fatbin that fits in the slot of an earlier rewrite replaces the old
+  // one, whatever the layout.
+  FatbinSlot slot;
+  uint64_t slotDescOffset;
+  if (findFatbinSlot(mappedExecFile, slot, slotDescOffset)) {
+    if (newFatbinSize <= slot.capacity) {
+      StatsPhase inPlacePhase("in_place");
+      return inPlaceRewrite(mappedExecFile, slot, slotDescOffset, rwExecPath,
+                            fatbinPieces, co_offsets);
+    }
+    logOut() << "new fatbin doesn't fit in the " << slot.capacity
+             << " bytes reserved in " << execFilePath << '\n';
+  }
+
+  // The append and note layouts patch a copy of the original in place, there
+  // is nothing to clone, save or patch afterwards.
+  if (options_.layout == "append") {
+    StatsPhase appendPhase("append");
+    return appendRewrite(mappedExecFile, rwExecPath, fatbinPieces, co_offsets,
+                         options_.slack, options_.align);
+  }
+
+  if (options_.layout == "note") {
+    StatsPhase notePhase("note");
+    return noteRewrite(mappedExecFile, rwExecPath, fatbinPieces, co_offsets,
+                       options_.slack, options_.align);
+  }
+
+  // A wrapper left pointing into a dropped fatbin would register zeroes.
+  if (options_.sections.dropOld) {
+    const uint64_t numWrappers =
+        mappedExecFile
+            .sectionHeader(mappedExecFile.findSection(".hipFatBinSegment"))
+            .sh_size /
+        24;
+    if (co_offsets.size() < numWrappers) {
+      logError() << "--drop-old-fatbin needs every wrapper pointed at the new "
+                    "fatbin, only "
+                 << co_offsets.size() << " of the " << numWrappers
+                 << " wrappers of " << execFilePath << " would be\n";
+      return false;
+    }
+  }
+
+  StatsPhase clonePhase("clone");
+  if (options_.useMmap) {
+    if (!cloneExec(state, mappedExecFile, newExecFile, newIndex,
+                   options_.sections))
+      return false;
+  } else {
+    cloneExec(state, execFile, newExecFile, newIndex, options_.sections);
+  }
+  clonePhase.end();
+
+  if (options_.compressDebugSections) {
+    StatsPhase compressDebugPhase("compress_debug");
+    if (!compressClonedDebugSections(state, mappedExecFile,
+                                     options_.debugCompression,
+                                     options_.saveThreads)) {
+      logError() << "can't compress the debug sections of " << rwExecPath
+                 << '\n';
+      return false;
+    }
+  }
+
+  StatsPhase addFatbinPhase("add_fatbin");
+  const char *newFatbinContent =
+      fatbinPieces.contents(mappedExecFile.data(), assembledFatbin);
+  if (!addNewFatbin(state, newExecFile, newIndex, newFatbinContent,
+                    newFatbinSize, co_offsets, options_.slack, options_.align,
+                    options_.sections))
+    return false;
+  addFatbinPhase.end();
+
+  StatsPhase savePhase("save");
+  logOut() << newExecFile.validate() << '\n';
+  if (!saveClone(state, newExecFile, mappedExecFile, rwExecPath,
+                 options_.saveThreads)) {
+    logError() << "can't save " << rwExecPath << '\n';
+    return false;
+  }
+  savePhase.end();
+
+  StatsPhase fillPhase("fill");
+  if (!writeFatbinSlot(state, rwExecPath, fatbinPieces,
+                       mappedExecFile.fd())) {
+    logError() << "can't write the fatbin slot of " << rwExecPath << '\n';
+    return false;
+  }
+  fillPhase.end();
+
+  // To ensure that the linux kernel loader picks up the program headers.
+  StatsPhase patchPhase("patch");
+  return patchExec(rwExecPath);
+}
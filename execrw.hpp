@@ -0,0 +1,175 @@
+#ifndef EXEC_RW_EXECRW_HPP
+#define EXEC_RW_EXECRW_HPP
+
+#include "compressed-bundle.hpp"
+#include "fatbin-align.hpp"
+#include "fatbin-sections.hpp"
+#include "log.hpp"
+#include "rewrite-cache.hpp"
+#include "rewrite-stats.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// libexecrw, the rewrite pipeline behind exec-rw and exec-rw2: embed a new
+// fatbin into an executable and point its .hipFatBinSegment wrappers at it.
+//
+// A RewriteContext holds everything one rewrite needs besides its inputs: the
+// options, the cloning state and the statistics of the last rewrite. Nothing
+// in here is global, and nothing exits the process, so any number of contexts
+// can rewrite concurrently on different threads. A context runs one rewrite
+// at a time; contexts are cheap, make one per thread (or per job).
+//
+// The only process-wide setting is logLevel, see log.hpp. Progress and errors
+// go to the calling thread's logStream, or to RewriteOptions::log.
+
+// Mapped originals kept across rewrites, see original-cache.hpp.
+class OriginalCache;
+
+struct RewriteOptions {
+  bool useMmap = false;
+  std::string layout = "clone";
+  // Bytes reserved after the new fatbin for later in-place rewrites.
+  uint64_t slack = 0;
+  // Alignment of the new fatbin, see fatbin-align.hpp.
+  FatbinAlign align = FatbinAlign::Auto;
+  // Names and contents of the fatbin sections of the clone.
+  FatbinSectionOptions sections;
+  // Insert the fatbin as compressed offload bundles.
+  bool compress = false;
+  BundleCompression compression = defaultBundleCompression();
+  // Compress the .debug_* sections of the clone, see debug-compression.hpp.
+  // Clone layout only.
+  bool compressDebugSections = false;
+  BundleCompression debugCompression = defaultBundleCompression();
+  // Keep only the code objects of these GPU targets in the new fatbin, see
+  // fatbin-prune.hpp. All of them are kept if empty.
+  std::vector<std::string> targets;
+  // Point only the first wrapper at the start of the new fatbin, as exec-rw
+  // does, instead of every wrapper at its code object bundle.
+  bool firstWrapperOnly = false;
+  // Threads writing the clone of the clone layout and compressing its debug
+  // sections, one per CPU if 0, see clone-writer.hpp.
+  unsigned saveThreads = 0;
+  // Outputs are looked up in and added to this cache, if set. Cache keys
+  // start with the name of the tool.
+  const RewriteCache *cache = nullptr;
+  std::string toolName = "exec-rw2";
+  // Originals are mapped once and kept in this cache, if set, instead of
+  // being mapped by every rewrite.
+  OriginalCache *originals = nullptr;
+  // A delta that rebuilds the output from the original is written to this
+  // file after the rewrite, if set, see delta.hpp. Not made by the in-memory
+  // rewrite.
+  const char *deltaPath = nullptr;
+  // Statistics of every rewrite are appended to this file, if set. They are
+  // also kept for RewriteContext::stats() with collectStats.
+  const char *statsPath = nullptr;
+  bool collectStats = false;
+  // Where the progress and errors of the rewrites go, if set, instead of the
+  // calling thread's logStream.
+  std::ostream *log = nullptr;
+};
+
+// The state the rewrite phases share, see execrw.cpp.
+struct CloneState;
+
+// A code object to put in place of a bundle entry, see fatbin-splice.hpp.
+struct CodeObjectReplacement;
+
+// Kernels to patch into a bundle entry, see kernel-patch.hpp.
+struct KernelPatch;
+
+// A fatbin to select at startup, see fatbin-variants.hpp.
+struct FatbinVariant;
+
+class RewriteContext {
+public:
+  explicit RewriteContext(const RewriteOptions &options = RewriteOptions());
+  ~RewriteContext();
+
+  RewriteContext(const RewriteContext &) = delete;
+  RewriteContext &operator=(const RewriteContext &) = delete;
+
+  const RewriteOptions &options() const { return options_; }
+
+  // The statistics of the last rewrite, with statsPath or collectStats.
+  const RewriteStats &stats() const { return stats_; }
+
+  // Rewrite the executable at execPath with the fatbin at fatbinPath into
+  // rwExecPath. The code object offsets are read from coOffsetPath if given,
+  // and computed from the bundle headers of the fatbin otherwise. The fatbin
+  // is mapped, not read; it may be a pipe, or "-" for stdin, see
+  // fatbin-input.hpp. This is the only entry point that goes through the
+  // cache.
+  bool rewrite(const char *execPath, const char *fatbinPath,
+               const char *rwExecPath, const char *coOffsetPath = nullptr);
+
+  // The same with the fatbin in memory, and the offsets given as a vector.
+  bool rewrite(const char *execPath, const char *fatbin, size_t fatbinSize,
+               const char *rwExecPath,
+               const std::vector<uint64_t> *coOffsets = nullptr);
+
+  // The same with the executable in memory as well, and rwExec receiving the
+  // rewritten one. The files the pipeline works on are memfds, nothing is
+  // written to disk.
+  bool rewrite(const char *exec, size_t execSize, const char *fatbin,
+               size_t fatbinSize, std::vector<char> &rwExec,
+               const std::vector<uint64_t> *coOffsets = nullptr);
+
+  // Replace code objects of the .hip_fatbin of the executable at execPath,
+  // reusing the unchanged ones from the file, and point the wrappers at the
+  // resulting fatbin in rwExecPath. Replacements don't go through the cache.
+  bool replaceCodeObjects(
+      const char *execPath,
+      const std::vector<CodeObjectReplacement> &replacements,
+      const char *rwExecPath);
+
+  // Patch kernels of code objects of the .hip_fatbin of the executable at
+  // execPath with those of relocatable objects, and replace the code objects
+  // with the patched ones as replaceCodeObjects() does.
+  bool patchKernels(const char *execPath,
+                    const std::vector<KernelPatch> &patches,
+                    const char *rwExecPath);
+
+  // Append the fatbins of the variants to the executable at execPath, into
+  // rwExecPath, with an entry stub that points the wrappers at the one named
+  // by EXECRW_FATBIN_VARIANT, the first one by default. Only the alignment
+  // of the options applies, variants don't go through the cache.
+  bool rewriteVariants(const char *execPath,
+                       const std::vector<FatbinVariant> &variants,
+                       const char *rwExecPath);
+
+  // Rebuild at rwExecPath the output the delta at deltaPath was made from,
+  // from the executable at execPath, and check it against the hash in the
+  // delta.
+  bool applyDelta(const char *execPath, const char *deltaPath,
+                  const char *rwExecPath);
+
+private:
+  template <typename RewriteFn>
+  bool run(const char *execName, const char *fatbinName,
+           const char *rwExecPath, RewriteFn rewrite);
+
+  // Write the delta of options_.deltaPath, if set.
+  bool emitDelta(const char *execPath, const char *rwExecPath);
+
+  bool rewriteCached(const char *execPath, const char *fatbinPath,
+                     const char *rwExecPath, const char *coOffsetPath);
+  bool rewriteFiles(const char *execPath, const char *fatbinPath,
+                    const char *rwExecPath, const char *coOffsetPath);
+  // fatbinFd is the file the fatbin is mapped from, if any, -1 otherwise.
+  bool rewriteUncached(const char *execPath, const char *fatbin,
+                       size_t fatbinSize, int fatbinFd, const char *rwExecPath,
+                       const std::vector<uint64_t> *coOffsets,
+                       const std::vector<CodeObjectReplacement> *replacements);
+
+  RewriteOptions options_;
+  RewriteStats stats_;
+  std::unique_ptr<CloneState> state_;
+};
+
+#endif // EXEC_RW_EXECRW_HPP
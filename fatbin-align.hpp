@@ -0,0 +1,62 @@
+#ifndef EXEC_RW_FATBIN_ALIGN_HPP
+#define EXEC_RW_FATBIN_ALIGN_HPP
+
+#include <cstdint>
+#include <string>
+
+#include <unistd.h>
+
+// Where the new fatbin goes (--align=page|2m|auto). The fatbin is placed at a
+// file offset and a virtual address that are both multiples of the chosen
+// alignment, and its PT_LOAD gets that p_align, so that:
+//
+// - with page, the loader maps the fatbin straight from the file, and the
+//   runtime faults in exactly the pages of the code objects it reads,
+// - with 2m, the fatbin also starts on a huge page boundary in the file and in
+//   memory (the kernel aligns the load bias of a PIE to the largest p_align),
+//   which lets transparent huge pages back it, for file mappings where the
+//   kernel supports them (CONFIG_READ_ONLY_THP_FOR_FS).
+//
+// auto picks 2m for fatbins of at least 2 MiB, page otherwise. The alignment is
+// never lower than the sh_addralign of .hip_fatbin.
+
+enum class FatbinAlign { Page, Huge, Auto };
+
+static const uint64_t hugePageSize = 2 << 20;
+
+// Parse the argument of --align.
+static bool parseFatbinAlign(const std::string &name, FatbinAlign &align) {
+  if (name == "page")
+    align = FatbinAlign::Page;
+  else if (name == "2m")
+    align = FatbinAlign::Huge;
+  else if (name == "auto")
+    align = FatbinAlign::Auto;
+  else
+    return false;
+  return true;
+}
+
+static const char *fatbinAlignName(FatbinAlign align) {
+  switch (align) {
+  case FatbinAlign::Page:
+    return "page";
+  case FatbinAlign::Huge:
+    return "2m";
+  default:
+    return "auto";
+  }
+}
+
+// The alignment of a new fatbin of fatbinSize bytes, whose original section
+// was aligned to sectionAlign.
+static uint64_t fatbinAlignment(FatbinAlign align, uint64_t sectionAlign,
+                                uint64_t fatbinSize) {
+  uint64_t alignment = sysconf(_SC_PAGESIZE);
+  if (align == FatbinAlign::Huge ||
+      (align == FatbinAlign::Auto && fatbinSize >= hugePageSize))
+    alignment = hugePageSize;
+  return sectionAlign > alignment ? sectionAlign : alignment;
+}
+
+#endif // EXEC_RW_FATBIN_ALIGN_HPP
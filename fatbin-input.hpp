@@ -0,0 +1,182 @@
+#ifndef EXEC_RW_FATBIN_INPUT_HPP
+#define EXEC_RW_FATBIN_INPUT_HPP
+
+#include "file-copy.hpp"
+#include "log.hpp"
+
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The new fatbin as the tools read it: a read-only mapping of the fatbin
+// file, so that it is never copied into memory, and can be copied (or
+// reflinked) into the output from its file.
+//
+// A fatbin that can't be mapped, because it comes from a pipe or from stdin
+// ("-"), is first spooled into an unlinked file (O_TMPFILE) in the directory
+// of the output, spliced from the pipe in chunks so that memory use stays
+// bounded, and that file is mapped instead. Being on the filesystem of the
+// output, the spooled fatbin is reflinked into it where the filesystem can.
+class FatbinInput {
+public:
+  FatbinInput() = default;
+  FatbinInput(const FatbinInput &) = delete;
+  FatbinInput &operator=(const FatbinInput &) = delete;
+
+  ~FatbinInput() { close(); }
+
+  // Whether the fatbin at path has to be spooled before it can be mapped.
+  static bool needsSpool(const char *path) {
+    struct stat st;
+    return !strcmp(path, "-") || (stat(path, &st) == 0 && !S_ISREG(st.st_mode));
+  }
+
+  // Map the fatbin at path, spooling it first into the directory of
+  // outputPath if needed.
+  bool open(const char *path, const char *outputPath) {
+    close();
+
+    if (!needsSpool(path)) {
+      fd_ = ::open(path, O_RDONLY | O_CLOEXEC);
+      if (fd_ < 0) {
+        logError() << "can't open fatbin " << path << '\n';
+        return false;
+      }
+    } else if (!spool(path, outputPath)) {
+      return false;
+    }
+
+    struct stat st;
+    if (fstat(fd_, &st) != 0) {
+      close();
+      return false;
+    }
+    size_ = st.st_size;
+    path_ = "/proc/self/fd/" + std::to_string(fd_);
+    if (size_ == 0)
+      return true;
+
+    void *addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (addr == MAP_FAILED) {
+      logError() << "can't map fatbin " << path << '\n';
+      close();
+      return false;
+    }
+    data_ = (const char *)addr;
+    return true;
+  }
+
+  void close() {
+    if (data_)
+      munmap((void *)data_, size_);
+    if (fd_ >= 0)
+      ::close(fd_);
+    data_ = nullptr;
+    size_ = 0;
+    fd_ = -1;
+    spooled_ = false;
+    path_.clear();
+  }
+
+  const char *data() const { return data_; }
+  uint64_t size() const { return size_; }
+  int fd() const { return fd_; }
+  bool spooled() const { return spooled_; }
+
+  // A path the fatbin can be opened at again, for as long as this is open.
+  const char *path() const { return path_.c_str(); }
+
+private:
+  bool spool(const char *path, const char *outputPath) {
+    int inFd = strcmp(path, "-") ? ::open(path, O_RDONLY | O_CLOEXEC) : 0;
+    if (inFd < 0) {
+      logError() << "can't open fatbin " << path << '\n';
+      return false;
+    }
+
+    std::string dir = outputPath;
+    size_t slash = dir.rfind('/');
+    dir = slash == std::string::npos ? "." : dir.substr(0, slash + 1);
+
+    // Filesystems without O_TMPFILE get a named file, unlinked right away.
+    fd_ = ::open(dir.c_str(), O_RDWR | O_TMPFILE | O_CLOEXEC, 0600);
+    if (fd_ < 0) {
+      std::string name = dir + "/.exec-rw-fatbin-XXXXXX";
+      fd_ = mkostemp(&name[0], O_CLOEXEC);
+      if (fd_ >= 0)
+        unlink(name.c_str());
+    }
+    if (fd_ < 0) {
+      logError() << "can't create a file to spool the fatbin into in " << dir
+                 << '\n';
+      if (inFd != 0)
+        ::close(inFd);
+      return false;
+    }
+    spooled_ = true;
+
+    uint64_t spooledSize = 0;
+    bool ok = spliceAll(inFd, spooledSize);
+    if (inFd != 0)
+      ::close(inFd);
+    if (!ok) {
+      logError() << "can't spool fatbin " << path << " : " << strerror(errno)
+                 << '\n';
+      close();
+      return false;
+    }
+    logOut() << "spooled " << spooledSize << " bytes of fatbin from " << path
+             << '\n';
+    return true;
+  }
+
+  // Move everything inFd has into the spool file, with splice() from pipes,
+  // and through a bounded buffer from anything else.
+  bool spliceAll(int inFd, uint64_t &size) {
+    const size_t chunkSize = 1 << 20;
+    for (;;) {
+      ssize_t n = splice(inFd, nullptr, fd_, nullptr, chunkSize,
+                         SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0 && (errno == EINVAL || errno == ESPIPE) && size == 0)
+        break;
+      if (n < 0)
+        return false;
+      if (n == 0)
+        return true;
+      size += n;
+    }
+
+    std::vector<char> buffer(chunkSize);
+    for (;;) {
+      ssize_t n = read(inFd, buffer.data(), buffer.size());
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        return false;
+      if (n == 0)
+        return true;
+      if (!pwriteAll(fd_, buffer.data(), n, size))
+        return false;
+      size += n;
+    }
+  }
+
+  int fd_ = -1;
+  const char *data_ = nullptr;
+  uint64_t size_ = 0;
+  bool spooled_ = false;
+  std::string path_;
+};
+
+#endif // EXEC_RW_FATBIN_INPUT_HPP
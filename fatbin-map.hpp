@@ -0,0 +1,63 @@
+#ifndef EXEC_RW_FATBIN_MAP_HPP
+#define EXEC_RW_FATBIN_MAP_HPP
+
+#include "batch.hpp"
+#include "content-hash.hpp"
+#include "mapped-elf.hpp"
+
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+
+// The fatbin map of the preload library (see fatbin-preload.cpp): which
+// replacement fatbin to register instead of the .hip_fatbin of an executable
+// or shared library. Each line holds the XXH64 hash of a .hip_fatbin, as 16
+// hex digits, and the path of its replacement, separated by whitespace. Empty
+// lines and lines starting with '#' are skipped, as in batch manifests.
+//
+//   # <hip_fatbin-hash> <replacement-fatbin>
+//   2f0c3a4d5e6f7081 /work/app.instrumented.fatbin
+//
+// exec-rw2 --fatbin-hash prints the hash of an executable.
+
+using FatbinMap = std::unordered_map<uint64_t, std::string>;
+
+// The hash the fatbin map is keyed by: that of the contents of .hip_fatbin.
+static bool hashHipFatbin(const MappedElf &exec, uint64_t &hash) {
+  size_t fatbinIdx = exec.findSection(".hip_fatbin");
+  if (!fatbinIdx)
+    return false;
+  const ELFIO::Elf64_Shdr &fatbin = exec.sectionHeader(fatbinIdx);
+  if (fatbin.sh_type == ELFIO::SHT_NOBITS || fatbin.sh_offset > exec.size() ||
+      fatbin.sh_size > exec.size() - fatbin.sh_offset)
+    return false;
+  hash = hashBuffer(exec.data() + fatbin.sh_offset, fatbin.sh_size);
+  return true;
+}
+
+// Read the fatbin map at path. line is set to the first malformed line, if
+// any.
+static bool readFatbinMap(const char *path, FatbinMap &map, size_t &line) {
+  std::ifstream file(path);
+  if (!file.is_open())
+    return false;
+
+  std::string text;
+  for (line = 1; std::getline(file, text); ++line) {
+    std::vector<std::string> fields = splitBatchLine(text);
+    if (fields.empty() || fields[0][0] == '#')
+      continue;
+
+    char *end;
+    uint64_t hash = strtoull(fields[0].c_str(), &end, 16);
+    if (fields.size() != 2 || fields[0].size() != 16 || *end != '\0')
+      return false;
+    map[hash] = fields[1];
+  }
+  line = 0;
+  return true;
+}
+
+#endif // EXEC_RW_FATBIN_MAP_HPP
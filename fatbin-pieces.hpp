@@ -0,0 +1,127 @@
+#ifndef EXEC_RW_FATBIN_PIECES_HPP
+#define EXEC_RW_FATBIN_PIECES_HPP
+
+#include "file-copy.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+// A new fatbin, as the pieces it is written from: bytes in memory, zeroes,
+// and ranges of the original executable or of other files. The ranges are
+// copied with copyFileRange(), so they are reflinked where the filesystem can,
+// and never pass through this process otherwise. A fatbin read from a file is
+// a single range of that file (see fatbin-input.hpp), a spliced one (see
+// fatbin-splice.hpp) mostly ranges of the original.
+class FatbinPieces {
+public:
+  FatbinPieces() = default;
+
+  // A fatbin that is all in [data, data + size), which must outlive this.
+  FatbinPieces(const char *data, uint64_t size) { addBytes(data, size); }
+
+  uint64_t size() const { return size_; }
+
+  // Bytes that must outlive this.
+  void addBytes(const char *data, uint64_t size) {
+    add({Piece::Bytes, data, 0, size, -1});
+  }
+
+  // Bytes that this keeps.
+  void addBytes(std::vector<char> bytes) {
+    owned_.push_back(std::make_shared<std::vector<char>>(std::move(bytes)));
+    add({Piece::Bytes, owned_.back()->data(), 0, owned_.back()->size(), -1});
+  }
+
+  void addZeroes(uint64_t size) {
+    add({Piece::Zeroes, nullptr, 0, size, -1});
+  }
+
+  // [srcOffset, srcOffset + size) of the original executable.
+  void addFileRange(uint64_t srcOffset, uint64_t size) {
+    add({Piece::FileRange, nullptr, srcOffset, size, -1});
+  }
+
+  // The first size bytes of the file open at fd and mapped at data, which
+  // must outlive this.
+  void addFile(int fd, const char *data, uint64_t size) {
+    add({Piece::FileRange, data, 0, size, fd});
+  }
+
+  // The pieces of other, after these.
+  void append(const FatbinPieces &other) {
+    for (const Piece &piece : other.pieces_)
+      add(piece);
+    owned_.insert(owned_.end(), other.owned_.begin(), other.owned_.end());
+  }
+
+  // The whole fatbin in memory. src is the mapping of the original
+  // executable. A fatbin of a single piece of bytes or of another file is
+  // returned as it is, others are assembled in buffer.
+  const char *contents(const char *src, std::vector<char> &buffer) const {
+    if (pieces_.size() == 1 && pieces_[0].data)
+      return pieces_[0].data + pieces_[0].srcOffset;
+
+    buffer.assign(size_, 0);
+    uint64_t offset = 0;
+    for (const Piece &piece : pieces_) {
+      if (piece.kind == Piece::Bytes || piece.fd >= 0)
+        memcpy(buffer.data() + offset, piece.data + piece.srcOffset,
+               piece.size);
+      else if (piece.kind == Piece::FileRange)
+        memcpy(buffer.data() + offset, src + piece.srcOffset, piece.size);
+      offset += piece.size;
+    }
+    return buffer.data();
+  }
+
+  // Write the fatbin to dstFd at dstOffset, the ranges from srcFd.
+  bool write(int srcFd, int dstFd, uint64_t dstOffset,
+             CopyStats *stats = nullptr) const {
+    static const char zeroes[4096] = {};
+    for (const Piece &piece : pieces_) {
+      bool ok = true;
+      if (piece.kind == Piece::Bytes) {
+        ok = pwriteAll(dstFd, piece.data, piece.size, dstOffset);
+      } else if (piece.kind == Piece::FileRange) {
+        ok = copyFileRange(piece.fd >= 0 ? piece.fd : srcFd, piece.srcOffset,
+                           dstFd, dstOffset, piece.size, stats);
+      } else {
+        for (uint64_t done = 0; ok && done < piece.size;
+             done += sizeof(zeroes)) {
+          uint64_t n = piece.size - done < sizeof(zeroes) ? piece.size - done
+                                                          : sizeof(zeroes);
+          ok = pwriteAll(dstFd, zeroes, n, dstOffset + done);
+        }
+      }
+      if (!ok)
+        return false;
+      dstOffset += piece.size;
+    }
+    return true;
+  }
+
+private:
+  struct Piece {
+    enum Kind { Bytes, Zeroes, FileRange } kind;
+    const char *data;
+    uint64_t srcOffset;
+    uint64_t size;
+    // The file of a range, -1 for the original executable.
+    int fd;
+  };
+
+  void add(const Piece &piece) {
+    if (piece.size == 0)
+      return;
+    pieces_.push_back(piece);
+    size_ += piece.size;
+  }
+
+  std::vector<Piece> pieces_;
+  std::vector<std::shared_ptr<std::vector<char>>> owned_;
+  uint64_t size_ = 0;
+};
+
+#endif // EXEC_RW_FATBIN_PIECES_HPP
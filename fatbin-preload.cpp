@@ -0,0 +1,213 @@
+#include "fatbin-input.hpp"
+#include "fatbin-map.hpp"
+#include "log.hpp"
+#include "mapped-elf.hpp"
+#include "offload-bundle.hpp"
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <dlfcn.h>
+#include <link.h>
+
+// libexecrw-preload.so swaps fatbins at load time, without rewriting the
+// executable: preloaded into a HIP application, it intercepts
+// __hipRegisterFatBinary, and registers a wrapper pointing into a replacement
+// fatbin instead of the one the application was linked with.
+//
+// usage:
+// EXECRW_FATBIN_MAP=<map> LD_PRELOAD=libexecrw-preload.so <app>
+//
+// The replacement is looked up in the fatbin map (see fatbin-map.hpp) by the
+// hash of the .hip_fatbin of the executable or shared library the wrapper is
+// in, so one map can cover an application and its libraries. The replacement
+// is mapped, and each wrapper is pointed at its code object bundle, as
+// exec-rw2 does: the i-th wrapper in .hipFatBinSegment at the i-th bundle.
+// Objects without a replacement, and objects whose replacement can't be used,
+// register their own fatbin.
+//
+// The real __hipRegisterFatBinary is whichever library comes next in lookup
+// order, normally the HIP runtime. Without a GPU, preload
+// libexecrw-register-stub.so after this library to see what gets registered,
+// see fatbin-register-stub.cpp. EXECRW_LOG_LEVEL=info logs every substitution
+// to stderr.
+
+namespace {
+
+// The layout of the wrappers in .hipFatBinSegment.
+struct FatbinWrapper {
+  uint32_t magic;
+  uint32_t version;
+  const void *binary;
+  const void *unused;
+};
+
+// The replacement of the fatbin of one executable or shared library.
+struct ObjectReplacement {
+  // Whether there is a usable replacement. Objects without one are still
+  // recorded, so that they are only looked at once.
+  bool replaced = false;
+  uintptr_t wrappersAddr = 0;
+  size_t numWrappers = 0;
+  std::unique_ptr<FatbinInput> fatbin;
+  std::vector<uint64_t> bundleOffsets;
+  // The wrappers registered instead of the original ones, which the runtime
+  // may keep pointers to.
+  std::vector<FatbinWrapper> wrappers;
+};
+
+using RegisterFatBinaryFn = void **(*)(const void *);
+
+std::mutex preloadMutex;
+// Never destroyed: the runtime unregisters fatbins from exit handlers that
+// may run after static destructors.
+FatbinMap *fatbinMap = nullptr;
+std::map<std::string, ObjectReplacement> *objects = nullptr;
+
+void initPreload() {
+  if (const char *level = getenv("EXECRW_LOG_LEVEL"))
+    parseLogLevel(level, logLevel);
+
+  fatbinMap = new FatbinMap();
+  objects = new std::map<std::string, ObjectReplacement>();
+
+  const char *mapPath = getenv("EXECRW_FATBIN_MAP");
+  if (!mapPath) {
+    logError() << "exec-rw preload : EXECRW_FATBIN_MAP isn't set, no fatbin "
+                  "is replaced\n";
+    return;
+  }
+  size_t line;
+  if (!readFatbinMap(mapPath, *fatbinMap, line)) {
+    logError() << "exec-rw preload : can't read fatbin map " << mapPath;
+    if (line)
+      logError() << ", line " << line << " is malformed";
+    logError() << '\n';
+    fatbinMap->clear();
+  }
+}
+
+// Look up the replacement of the fatbin of the object at objectPath, loaded
+// at loadBias.
+void findReplacement(const std::string &objectPath, uintptr_t loadBias,
+                     ObjectReplacement &object) {
+  MappedElf exec;
+  uint64_t hash;
+  if (!exec.open(objectPath.c_str()) || !hashHipFatbin(exec, hash)) {
+    logError() << "exec-rw preload : can't find .hip_fatbin in " << objectPath
+               << '\n';
+    return;
+  }
+
+  auto entry = fatbinMap->find(hash);
+  if (entry == fatbinMap->end()) {
+    logOut() << "exec-rw preload : no replacement for " << objectPath << " ("
+             << toHex(hash) << ")\n";
+    return;
+  }
+  const std::string &fatbinPath = entry->second;
+
+  size_t wrapperIdx = exec.findSection(".hipFatBinSegment");
+  if (!wrapperIdx) {
+    logError() << "exec-rw preload : can't find .hipFatBinSegment in "
+               << objectPath << '\n';
+    return;
+  }
+  object.wrappersAddr = loadBias + exec.sectionHeader(wrapperIdx).sh_addr;
+  object.numWrappers =
+      exec.sectionHeader(wrapperIdx).sh_size / sizeof(FatbinWrapper);
+
+  object.fatbin.reset(new FatbinInput());
+  if (FatbinInput::needsSpool(fatbinPath.c_str()) ||
+      !object.fatbin->open(fatbinPath.c_str(), fatbinPath.c_str())) {
+    logError() << "exec-rw preload : can't map fatbin " << fatbinPath << '\n';
+    return;
+  }
+
+  std::vector<OffloadBundle> bundles;
+  if (!parseOffloadBundles(object.fatbin->data(), object.fatbin->size(),
+                           bundles)) {
+    logError() << "exec-rw preload : can't find offload bundles in "
+               << fatbinPath << '\n';
+    return;
+  }
+  object.bundleOffsets = getCodeObjectOffsets(bundles);
+  if (object.bundleOffsets.size() < object.numWrappers) {
+    logError() << "exec-rw preload : " << fatbinPath << " has "
+               << object.bundleOffsets.size() << " bundles for "
+               << object.numWrappers << " wrappers in " << objectPath << '\n';
+    return;
+  }
+
+  object.wrappers.resize(object.numWrappers);
+  object.replaced = true;
+  logOut() << "exec-rw preload : replacing the fatbin of " << objectPath
+           << " with " << fatbinPath << '\n';
+}
+
+// The wrapper to register instead of wrapper, or wrapper itself.
+const void *substituteWrapper(const void *wrapper) {
+  std::lock_guard<std::mutex> lock(preloadMutex);
+  // The application's stdout is left alone, whichever thread registers.
+  logStream = &std::cerr;
+  if (!objects)
+    initPreload();
+  if (fatbinMap->empty())
+    return wrapper;
+
+  Dl_info info;
+  struct link_map *linkMap = nullptr;
+  if (!dladdr1(wrapper, &info, (void **)&linkMap, RTLD_DL_LINKMAP) ||
+      !linkMap)
+    return wrapper;
+
+  // The executable itself has no name in its link map.
+  std::string objectPath = linkMap->l_name && linkMap->l_name[0]
+                               ? linkMap->l_name
+                               : "/proc/self/exe";
+  auto inserted = objects->emplace(objectPath, ObjectReplacement());
+  ObjectReplacement &object = inserted.first->second;
+  if (inserted.second)
+    findReplacement(objectPath, linkMap->l_addr, object);
+  if (!object.replaced)
+    return wrapper;
+
+  uintptr_t wrapperAddr = (uintptr_t)wrapper;
+  if (wrapperAddr < object.wrappersAddr ||
+      (wrapperAddr - object.wrappersAddr) % sizeof(FatbinWrapper) ||
+      (wrapperAddr - object.wrappersAddr) / sizeof(FatbinWrapper) >=
+          object.numWrappers) {
+    logError() << "exec-rw preload : wrapper " << wrapper
+               << " isn't in .hipFatBinSegment of " << objectPath << '\n';
+    return wrapper;
+  }
+
+  size_t i = (wrapperAddr - object.wrappersAddr) / sizeof(FatbinWrapper);
+  FatbinWrapper &substitute = object.wrappers[i];
+  substitute = *(const FatbinWrapper *)wrapper;
+  substitute.binary = object.fatbin->data() + object.bundleOffsets[i];
+  logOut() << "exec-rw preload : wrapper " << i << " of " << objectPath
+           << " -> bundle at " << object.bundleOffsets[i] << '\n';
+  return &substitute;
+}
+
+} // namespace
+
+extern "C" void **__hipRegisterFatBinary(const void *data) {
+  static RegisterFatBinaryFn realRegister =
+      (RegisterFatBinaryFn)dlsym(RTLD_NEXT, "__hipRegisterFatBinary");
+  if (!realRegister) {
+    std::lock_guard<std::mutex> lock(preloadMutex);
+    logStream = &std::cerr;
+    logError() << "exec-rw preload : no __hipRegisterFatBinary to forward "
+                  "to\n";
+    return nullptr;
+  }
+  return realRegister(substituteWrapper(data));
+}
@@ -0,0 +1,163 @@
+#ifndef EXEC_RW_FATBIN_PRUNE_HPP
+#define EXEC_RW_FATBIN_PRUNE_HPP
+
+#include "append-rewrite.hpp"
+#include "fatbin-pieces.hpp"
+#include "log.hpp"
+#include "offload-bundle.hpp"
+#include "rewrite-stats.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Pruning of the new fatbin to the GPU targets it will run on (--targets).
+// Fatbins usually carry a code object for every target the application was
+// built for; each bundle is rebuilt with only the host entry and the entries
+// of the allowed targets, which shrinks the file, the page cache and the work
+// the HIP runtime does to register the fatbin.
+//
+// An entry ID is <offload-kind>-<triple>-<target-id>, with a four component
+// triple, e.g. hipv4-amdgcn-amd-amdhsa--gfx942:sramecc+:xnack-. An allowed
+// target matches a target ID either exactly or by its processor, so gfx942
+// allows gfx942:sramecc+:xnack- and every other feature combination.
+
+// The code objects of the pruned fatbin are aligned as clang-offload-bundler
+// -bundle-align=4096 does for HIP, and so are its bundles.
+static const uint64_t prunedFatbinAlign = 4096;
+
+// Parse the argument of --targets, a comma-separated list.
+static bool parseTargets(const std::string &list,
+                         std::vector<std::string> &targets) {
+  targets.clear();
+  std::istringstream stream(list);
+  std::string target;
+  while (std::getline(stream, target, ','))
+    if (!target.empty())
+      targets.push_back(target);
+  return !targets.empty();
+}
+
+// The target ID of an entry ID, or an empty string for host entries.
+static std::string entryTargetId(const std::string &entryId) {
+  if (entryId.compare(0, 5, "host-") == 0)
+    return "";
+  size_t pos = 0;
+  for (int dashes = 0; dashes < 5 && pos != std::string::npos; ++dashes) {
+    pos = entryId.find('-', pos);
+    if (pos != std::string::npos)
+      ++pos;
+  }
+  return pos == std::string::npos ? entryId : entryId.substr(pos);
+}
+
+// The index of the target in targets that allows targetId, or -1.
+static long findAllowedTarget(const std::string &targetId,
+                              const std::vector<std::string> &targets) {
+  const std::string processor = targetId.substr(0, targetId.find(':'));
+  for (size_t i = 0; i < targets.size(); ++i)
+    if (targets[i] == targetId || targets[i] == processor)
+      return i;
+  return -1;
+}
+
+// Rebuild the bundles of [fatbin, fatbin + fatbinSize), which must outlive
+// prunedFatbin, with only the entries of the allowed targets. The wrapper
+// offsets in coOffsets, which must point at bundles, are moved along with
+// them.
+static bool pruneFatbin(const char *fatbin, uint64_t fatbinSize,
+                        const std::vector<std::string> &targets,
+                        FatbinPieces &prunedFatbin,
+                        std::vector<uint64_t> &coOffsets) {
+  std::vector<OffloadBundle> bundles;
+  if (!parseOffloadBundles(fatbin, fatbinSize, bundles)) {
+    logError() << "can't find offload bundles to prune in the new fatbin\n";
+    return false;
+  }
+
+  prunedFatbin = FatbinPieces();
+  std::vector<bool> targetUsed(targets.size(), false);
+  std::vector<uint64_t> bundleOffsets;
+  uint64_t numPruned = 0;
+  for (size_t i = 0; i < bundles.size(); ++i) {
+    const OffloadBundle &bundle = bundles[i];
+    const uint64_t bundleStart =
+        alignUp(prunedFatbin.size(), prunedFatbinAlign);
+    prunedFatbin.addZeroes(bundleStart - prunedFatbin.size());
+    bundleOffsets.push_back(bundleStart);
+
+    std::vector<OffloadBundleEntry> entries;
+    size_t numDeviceEntries = 0;
+    for (const OffloadBundleEntry &entry : bundle.entries) {
+      std::string targetId = entryTargetId(entry.id);
+      if (!targetId.empty()) {
+        long target = findAllowedTarget(targetId, targets);
+        if (target < 0) {
+          logDebug() << "pruning " << entry.id << " from bundle " << i << '\n';
+          ++numPruned;
+          continue;
+        }
+        targetUsed[target] = true;
+        ++numDeviceEntries;
+      }
+      entries.push_back(entry);
+    }
+    if (!numDeviceEntries)
+      logOut() << "bundle " << i << " has no code object for the targets\n";
+
+    std::sort(entries.begin(), entries.end(),
+              [](const OffloadBundleEntry &a, const OffloadBundleEntry &b) {
+                return a.offset < b.offset;
+              });
+
+    FatbinPieces codeObjects;
+    uint64_t pos = bundleStart + offloadBundleHeaderSize(entries);
+    for (OffloadBundleEntry &entry : entries) {
+      const char *codeObject = fatbin + bundle.offset + entry.offset;
+      uint64_t start = entry.size ? alignUp(pos, prunedFatbinAlign) : pos;
+      codeObjects.addZeroes(start - pos);
+      codeObjects.addBytes(codeObject, entry.size);
+      entry.offset = start - bundleStart;
+      pos = start + entry.size;
+    }
+
+    prunedFatbin.addBytes(writeOffloadBundleHeader(entries));
+    prunedFatbin.append(codeObjects);
+  }
+
+  for (size_t i = 0; i < targets.size(); ++i) {
+    if (!targetUsed[i]) {
+      logError() << "no code object for target " << targets[i]
+                 << " in the new fatbin\n";
+      return false;
+    }
+  }
+
+  for (uint64_t &offset : coOffsets) {
+    auto bundle = std::find_if(
+        bundles.begin(), bundles.end(),
+        [&](const OffloadBundle &bundle) { return bundle.offset == offset; });
+    if (bundle == bundles.end()) {
+      logError() << "co_offset " << offset
+                 << " doesn't point at a bundle of the new fatbin\n";
+      return false;
+    }
+    offset = bundleOffsets[bundle - bundles.begin()];
+  }
+
+  const uint64_t savedBytes = fatbinSize > prunedFatbin.size()
+                                  ? fatbinSize - prunedFatbin.size()
+                                  : 0;
+  logOut() << "pruned " << numPruned << " code objects from the new fatbin, "
+           << fatbinSize << " -> " << prunedFatbin.size() << " bytes, "
+           << savedBytes << " saved\n";
+  if (currentStats) {
+    currentStats->set("pruned_code_objects", numPruned);
+    currentStats->set("pruned_bytes", savedBytes);
+  }
+  return true;
+}
+
+#endif // EXEC_RW_FATBIN_PRUNE_HPP
@@ -0,0 +1,137 @@
+#include "content-hash.hpp"
+#include "offload-bundle.hpp"
+
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+#include <link.h>
+
+// libexecrw-register-stub.so stands in for the HIP runtime where there is no
+// GPU: it exports __hipRegisterFatBinary, and logs what each registration
+// points at to stderr instead of loading code objects. It checks the fatbins
+// an executable registers after a rewrite, a swap by libexecrw-preload.so,
+// or a variant selected at startup:
+//
+// LD_PRELOAD=libexecrw-register-stub.so <app>
+// EXECRW_FATBIN_MAP=<map> LD_PRELOAD="libexecrw-preload.so
+//     libexecrw-register-stub.so" <app>
+//
+// For each wrapper, it logs the binary pointer, the object mapping it and the
+// file offset there, the magic of the bundle and, for uncompressed bundles, the
+// ID, size and XXH64 hash of each code object. The other registration functions are
+// no-ops, so the kernels of the application can't be launched with the stub.
+
+namespace {
+
+// The layout of the wrappers in .hipFatBinSegment.
+struct FatbinWrapper {
+  uint32_t magic;
+  uint32_t version;
+  const void *binary;
+  const void *unused;
+};
+
+// The loaded segment holding an address, found with dl_iterate_phdr.
+struct SegmentLookup {
+  uintptr_t addr;
+  std::string object;
+  // The offset of addr in the file of object.
+  uint64_t offset = 0;
+  size_t remaining = 0;
+};
+
+int findSegment(struct dl_phdr_info *info, size_t, void *data) {
+  SegmentLookup &lookup = *(SegmentLookup *)data;
+  for (size_t i = 0; i < info->dlpi_phnum; ++i) {
+    const ElfW(Phdr) &phdr = info->dlpi_phdr[i];
+    uintptr_t begin = info->dlpi_addr + phdr.p_vaddr;
+    if (phdr.p_type != PT_LOAD || lookup.addr < begin ||
+        lookup.addr - begin >= phdr.p_filesz)
+      continue;
+    lookup.object = *info->dlpi_name ? info->dlpi_name : "(executable)";
+    lookup.offset = phdr.p_offset + (lookup.addr - begin);
+    lookup.remaining = begin + phdr.p_filesz - lookup.addr;
+    return 1;
+  }
+  return 0;
+}
+
+// The same for mappings outside loaded objects, such as the replacements
+// libexecrw-preload.so maps, from /proc/self/maps.
+bool findMapping(SegmentLookup &lookup) {
+  std::ifstream maps("/proc/self/maps");
+  std::string line;
+  while (std::getline(maps, line)) {
+    std::istringstream fields(line);
+    uintptr_t begin, end;
+    uint64_t offset;
+    char dash;
+    std::string perms, dev, inode, path;
+    if (!(fields >> std::hex >> begin >> dash >> end >> perms >> offset >>
+          dev >> inode) ||
+        lookup.addr < begin || lookup.addr >= end || perms[0] != 'r')
+      continue;
+    fields >> path;
+    lookup.object = path.empty() ? "(anonymous)" : path;
+    lookup.offset = offset + (lookup.addr - begin);
+    lookup.remaining = end - lookup.addr;
+    return true;
+  }
+  return false;
+}
+
+std::mutex stubMutex;
+
+} // namespace
+
+extern "C" void **__hipRegisterFatBinary(const void *data) {
+  const FatbinWrapper *wrapper = (const FatbinWrapper *)data;
+  std::lock_guard<std::mutex> lock(stubMutex);
+  std::cerr << "exec-rw stub : wrapper " << data << " binary "
+            << wrapper->binary;
+
+  // Only the bytes up to the end of the segment or mapping can be read.
+  SegmentLookup lookup;
+  lookup.addr = (uintptr_t)wrapper->binary;
+  if (!dl_iterate_phdr(findSegment, &lookup) && !findMapping(lookup)) {
+    std::cerr << ", not mapped\n";
+    return new void *((void *)data);
+  }
+  const char *binary = (const char *)wrapper->binary;
+  std::string magic(binary, lookup.remaining < offloadBundleMagicSize
+                                ? lookup.remaining
+                                : offloadBundleMagicSize);
+  for (char &c : magic) {
+    if (c < ' ' || c > '~')
+      c = '.';
+  }
+  std::cerr << " in " << lookup.object << " at " << lookup.offset
+            << ", magic " << magic << '\n';
+
+  OffloadBundle bundle;
+  if (parseOffloadBundle(binary, lookup.remaining, bundle)) {
+    for (const OffloadBundleEntry &entry : bundle.entries) {
+      std::cerr << "exec-rw stub :   " << entry.id << ", " << entry.size
+                << " bytes";
+      if (entry.size && entry.offset <= lookup.remaining &&
+          entry.size <= lookup.remaining - entry.offset)
+        std::cerr << ", hash "
+                  << toHex(hashBuffer(binary + entry.offset, entry.size));
+      std::cerr << '\n';
+    }
+  }
+  return new void *((void *)data);
+}
+
+extern "C" void __hipUnregisterFatBinary(void **modules) { delete modules; }
+
+extern "C" void __hipRegisterFunction(void **, const void *, char *,
+                                      const char *, unsigned int, void *,
+                                      void *, void *, void *, int *) {}
+
+extern "C" void __hipRegisterVar(void **, void *, char *, char *, int, size_t,
+                                 int, int) {}
@@ -0,0 +1,45 @@
+#ifndef EXEC_RW_FATBIN_SECTIONS_HPP
+#define EXEC_RW_FATBIN_SECTIONS_HPP
+
+#include <string>
+
+// What the clone layout does with the fatbin sections.
+//
+// By default the new fatbin goes into .new_fatbin and the original keeps its
+// name, and two llvm-objcopy --rename-section passes, each of which reads and
+// rewrites the whole executable, give the new fatbin the name tools look for.
+// With --rename-sections the clone is written with the final names right
+// away: the original .hip_fatbin becomes .hip_fatbin.orig, and the new fatbin
+// .hip_fatbin.
+//
+// With --drop-old-fatbin the fatbins of the original (.hip_fatbin, and the
+// .new_fatbin or .hip_fatbin.orig of an earlier rewrite), which nothing points
+// to anymore, keep their section headers and their place in the address
+// space, but their contents are neither read nor written. They are left as a
+// hole in the output, which reads as zeroes and takes no disk space; the file
+// size doesn't change. Every wrapper must be pointed at the new fatbin.
+struct FatbinSectionOptions {
+  bool rename = false;
+  bool dropOld = false;
+
+  const char *oldFatbinName() const {
+    return rename ? ".hip_fatbin.orig" : ".hip_fatbin";
+  }
+
+  const char *newFatbinName() const {
+    return rename ? ".hip_fatbin" : ".new_fatbin";
+  }
+
+  // The name of the clone of the section called name.
+  std::string clonedName(const std::string &name) const {
+    return rename && name == ".hip_fatbin" ? oldFatbinName() : name;
+  }
+
+  // Whether the contents of the section called name are left out.
+  bool dropsContents(const std::string &name) const {
+    return dropOld && (name == ".hip_fatbin" || name == ".new_fatbin" ||
+                       name == ".hip_fatbin.orig");
+  }
+};
+
+#endif // EXEC_RW_FATBIN_SECTIONS_HPP
@@ -0,0 +1,110 @@
+#ifndef EXEC_RW_FATBIN_SLOT_HPP
+#define EXEC_RW_FATBIN_SLOT_HPP
+
+#include "mapped-elf.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// A rewrite with --slack=<n> reserves n bytes of zeroes after the new fatbin,
+// and records where the fatbin and the reserved bytes (the slot) are in an
+// "execrw" ELF note:
+//
+// - the clone layout adds a non-allocated .note.execrw section,
+// - the append layout adds a PT_NOTE segment inside the appended PT_LOAD.
+//
+// A later rewrite of that executable whose fatbin fits in the slot overwrites
+// the old fatbin in place instead of adding another one (see
+// inplace-rewrite.hpp).
+
+struct FatbinSlot {
+  // File offset and address of the slot.
+  uint64_t offset = 0;
+  uint64_t addr = 0;
+  // Size of the slot, fatbin and slack.
+  uint64_t capacity = 0;
+  // Size of the fatbin currently in the slot.
+  uint64_t size = 0;
+};
+
+static const char fatbinSlotNoteName[] = "execrw";
+static const uint32_t fatbinSlotNoteType = 1;
+
+// Note header, name padded to 4 bytes, then the slot.
+static const size_t fatbinSlotDescOffset = 12 + 8;
+static const size_t fatbinSlotNoteSize = fatbinSlotDescOffset + 4 * 8;
+
+static std::vector<char> makeFatbinSlotNote(const FatbinSlot &slot) {
+  std::vector<char> note(fatbinSlotNoteSize, 0);
+  uint32_t header[3] = {sizeof(fatbinSlotNoteName), 4 * 8, fatbinSlotNoteType};
+  uint64_t desc[4] = {slot.offset, slot.addr, slot.capacity, slot.size};
+
+  memcpy(note.data(), header, sizeof(header));
+  memcpy(note.data() + sizeof(header), fatbinSlotNoteName,
+         sizeof(fatbinSlotNoteName));
+  memcpy(note.data() + fatbinSlotDescOffset, desc, sizeof(desc));
+  return note;
+}
+
+// Look for the slot note among the notes in [offset, offset + size) of exec.
+// descOffset is set to the file offset of the slot in the note.
+static bool findFatbinSlotNote(const MappedElf &exec, uint64_t offset,
+                               uint64_t size, FatbinSlot &slot,
+                               uint64_t &descOffset) {
+  if (offset > exec.size() || size > exec.size() - offset)
+    return false;
+
+  const uint64_t end = offset + size;
+  while (end - offset >= 12) {
+    uint32_t header[3];
+    memcpy(header, exec.data() + offset, sizeof(header));
+
+    uint64_t nameOffset = offset + 12;
+    uint64_t descBegin = nameOffset + ((header[0] + 3) & ~3ULL);
+    uint64_t next = descBegin + ((header[1] + 3) & ~3ULL);
+    if (next > end)
+      return false;
+
+    if (header[0] == sizeof(fatbinSlotNoteName) && header[1] == 4 * 8 &&
+        header[2] == fatbinSlotNoteType &&
+        !memcmp(exec.data() + nameOffset, fatbinSlotNoteName,
+                sizeof(fatbinSlotNoteName))) {
+      uint64_t desc[4];
+      memcpy(desc, exec.data() + descBegin, sizeof(desc));
+      slot.offset = desc[0];
+      slot.addr = desc[1];
+      slot.capacity = desc[2];
+      slot.size = desc[3];
+      descOffset = descBegin;
+
+      return slot.size <= slot.capacity && slot.offset <= exec.size() &&
+             slot.capacity <= exec.size() - slot.offset;
+    }
+    offset = next;
+  }
+  return false;
+}
+
+// Find the slot recorded by an earlier rewrite of exec, in either layout.
+static bool findFatbinSlot(const MappedElf &exec, FatbinSlot &slot,
+                           uint64_t &descOffset) {
+  for (size_t i = 1; i < exec.numSections(); ++i) {
+    const ELFIO::Elf64_Shdr &section = exec.sectionHeader(i);
+    if (section.sh_type == ELFIO::SHT_NOTE &&
+        findFatbinSlotNote(exec, section.sh_offset, section.sh_size, slot,
+                           descOffset))
+      return true;
+  }
+
+  for (size_t i = 0; i < exec.numSegments(); ++i) {
+    const ELFIO::Elf64_Phdr &segment = exec.segmentHeader(i);
+    if (segment.p_type == ELFIO::PT_NOTE &&
+        findFatbinSlotNote(exec, segment.p_offset, segment.p_filesz, slot,
+                           descOffset))
+      return true;
+  }
+  return false;
+}
+
+#endif // EXEC_RW_FATBIN_SLOT_HPP
@@ -0,0 +1,241 @@
+#ifndef EXEC_RW_FATBIN_SPLICE_HPP
+#define EXEC_RW_FATBIN_SPLICE_HPP
+
+#include "append-rewrite.hpp"
+#include "fatbin-pieces.hpp"
+#include "log.hpp"
+#include "mapped-elf.hpp"
+#include "offload-bundle.hpp"
+#include "rewrite-stats.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+// Selective replacement of code objects (--replace). Instead of a whole new
+// fatbin, only the code objects that changed are given, each with the ID of
+// the bundle entry it replaces (e.g. hipv4-amdgcn-amd-amdhsa--gfx90a). The new
+// fatbin is the .hip_fatbin of the executable with those entries swapped:
+//
+// - bundles without a replaced entry are a range of the original file,
+// - the others get a copy of their header with the new offsets and sizes,
+//   the new code objects from memory, and the unchanged code objects as
+//   ranges of the original file again,
+//
+// see fatbin-pieces.hpp. Unchanged code objects keep their file offset modulo
+// the page size, and new fatbins start on a page boundary in every layout, so
+// the ranges can be reflinked. New code objects are page aligned, as
+// clang-offload-bundler -bundle-align=4096 does for HIP.
+//
+// Replacements are made against .hip_fatbin, the fatbin the executable was
+// linked with: to iterate, rewrite the original executable with every code
+// object that differs from it. An ID found in more than one bundle (there is
+// one bundle per translation unit) needs the index of the bundle, as
+// <id>@<n>.
+
+struct CodeObjectReplacement {
+  std::string entryId;
+  // The index of the bundle whose entry is replaced, or -1 for the only
+  // bundle that has entryId.
+  long bundle = -1;
+  std::vector<char> codeObject;
+};
+
+// Parse the argument of --replace, <entry-id>[@<bundle>]=<path>, and read the
+// code object at path.
+static bool readCodeObjectReplacement(const std::string &arg,
+                                      CodeObjectReplacement &replacement) {
+  size_t eq = arg.find('=');
+  if (eq == std::string::npos || eq == 0 || eq + 1 == arg.size())
+    return false;
+
+  replacement.entryId = arg.substr(0, eq);
+  replacement.bundle = -1;
+  size_t at = replacement.entryId.rfind('@');
+  if (at != std::string::npos) {
+    const char *index = replacement.entryId.c_str() + at + 1;
+    char *end;
+    replacement.bundle = strtol(index, &end, 10);
+    if (*index == '\0' || *end != '\0' || replacement.bundle < 0)
+      return false;
+    replacement.entryId.resize(at);
+  }
+
+  std::ifstream file(arg.substr(eq + 1), std::ios::in | std::ios::binary);
+  if (!file.is_open())
+    return false;
+  replacement.codeObject.assign(std::istreambuf_iterator<char>(file),
+                                std::istreambuf_iterator<char>());
+  return !file.bad();
+}
+
+// The smallest position from pos on that is congruent to like modulo
+// alignment.
+static uint64_t alignLike(uint64_t pos, uint64_t like, uint64_t alignment) {
+  return pos + (like % alignment + alignment - pos % alignment) % alignment;
+}
+
+// The offset of the .hip_fatbin of exec in the file, and its bundles.
+static bool parseHipFatbin(const MappedElf &exec, uint64_t &fatbinOffset,
+                           std::vector<OffloadBundle> &bundles) {
+  size_t fatbinIdx = exec.findSection(".hip_fatbin");
+  if (!fatbinIdx) {
+    logError() << "can't find .hip_fatbin\n";
+    return false;
+  }
+  const ELFIO::Elf64_Shdr &fatbinSection = exec.sectionHeader(fatbinIdx);
+  if (fatbinSection.sh_type == ELFIO::SHT_NOBITS ||
+      fatbinSection.sh_offset > exec.size() ||
+      fatbinSection.sh_size > exec.size() - fatbinSection.sh_offset) {
+    logError() << ".hip_fatbin lies outside of the file\n";
+    return false;
+  }
+
+  fatbinOffset = fatbinSection.sh_offset;
+  if (!parseOffloadBundles(exec.data() + fatbinOffset, fatbinSection.sh_size,
+                           bundles)) {
+    logError() << "can't find offload bundles in .hip_fatbin\n";
+    return false;
+  }
+  return true;
+}
+
+// Find the entry entryId of bundles, in the bundle at index bundle, or in the
+// only bundle that has it if bundle is -1.
+static bool findBundleEntry(const std::vector<OffloadBundle> &bundles,
+                            const std::string &entryId, long bundle,
+                            size_t &bundleIdx, size_t &entryIdx) {
+  size_t numMatches = 0;
+  for (size_t i = 0; i < bundles.size(); ++i) {
+    if (bundle >= 0 && (size_t)bundle != i)
+      continue;
+    for (size_t j = 0; j < bundles[i].entries.size(); ++j) {
+      if (bundles[i].entries[j].id != entryId)
+        continue;
+      ++numMatches;
+      bundleIdx = i;
+      entryIdx = j;
+    }
+  }
+
+  if (numMatches == 0) {
+    logError() << "no entry " << entryId << " in "
+               << (bundle >= 0 ? "bundle " + std::to_string(bundle) + " of "
+                               : std::string())
+               << ".hip_fatbin\n";
+    return false;
+  }
+  if (numMatches > 1) {
+    logError() << entryId << " is in " << numMatches
+               << " bundles of .hip_fatbin, pick one with " << entryId
+               << "@<n>\n";
+    return false;
+  }
+  return true;
+}
+
+// Build the new fatbin from the .hip_fatbin of exec and the replacements.
+// bundleOffsets gets the offsets of its bundles, for the wrappers.
+static bool spliceFatbin(const MappedElf &exec,
+                         const std::vector<CodeObjectReplacement> &replacements,
+                         FatbinPieces &newFatbin,
+                         std::vector<uint64_t> &bundleOffsets) {
+  const uint64_t pageSize = sysconf(_SC_PAGESIZE);
+
+  uint64_t fatbinOffset;
+  std::vector<OffloadBundle> bundles;
+  if (!parseHipFatbin(exec, fatbinOffset, bundles))
+    return false;
+
+  // The replacement of each entry of each bundle, if any.
+  std::vector<std::vector<const CodeObjectReplacement *>> replacedBy;
+  for (const OffloadBundle &bundle : bundles)
+    replacedBy.emplace_back(bundle.entries.size(), nullptr);
+
+  for (const CodeObjectReplacement &replacement : replacements) {
+    size_t bundleIdx, entryIdx;
+    if (!findBundleEntry(bundles, replacement.entryId, replacement.bundle,
+                         bundleIdx, entryIdx))
+      return false;
+    if (replacedBy[bundleIdx][entryIdx]) {
+      logError() << replacement.entryId << " of bundle " << bundleIdx
+                 << " is replaced twice\n";
+      return false;
+    }
+    replacedBy[bundleIdx][entryIdx] = &replacement;
+  }
+
+  newFatbin = FatbinPieces();
+  bundleOffsets.clear();
+  uint64_t reusedBytes = 0;
+  for (size_t i = 0; i < bundles.size(); ++i) {
+    const OffloadBundle &bundle = bundles[i];
+    const uint64_t bundleStart = alignLike(
+        newFatbin.size(), fatbinOffset + bundle.offset, pageSize);
+    newFatbin.addZeroes(bundleStart - newFatbin.size());
+    bundleOffsets.push_back(bundleStart);
+
+    bool replaced = false;
+    for (const CodeObjectReplacement *replacement : replacedBy[i])
+      replaced = replaced || replacement;
+    if (!replaced) {
+      newFatbin.addFileRange(fatbinOffset + bundle.offset, bundle.size);
+      reusedBytes += bundle.size;
+      continue;
+    }
+
+    // Lay the code objects out in their original order after the header.
+    std::vector<OffloadBundleEntry> entries = bundle.entries;
+    std::vector<size_t> order(entries.size());
+    for (size_t j = 0; j < order.size(); ++j)
+      order[j] = j;
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return entries[a].offset < entries[b].offset;
+    });
+
+    FatbinPieces codeObjects;
+    uint64_t pos = bundleStart + offloadBundleHeaderSize(entries);
+    for (size_t j : order) {
+      OffloadBundleEntry &entry = entries[j];
+      const CodeObjectReplacement *replacement = replacedBy[i][j];
+      const uint64_t ogOffset = fatbinOffset + bundle.offset + entry.offset;
+      uint64_t size = replacement ? replacement->codeObject.size() : entry.size;
+
+      uint64_t start = pos;
+      if (replacement)
+        start = alignUp(pos, pageSize);
+      else if (entry.size)
+        start = alignLike(pos, ogOffset, pageSize);
+      codeObjects.addZeroes(start - pos);
+
+      if (replacement) {
+        codeObjects.addBytes(replacement->codeObject.data(), size);
+      } else {
+        codeObjects.addFileRange(ogOffset, size);
+        reusedBytes += size;
+      }
+
+      entry.offset = start - bundleStart;
+      entry.size = size;
+      pos = start + size;
+    }
+
+    newFatbin.addBytes(writeOffloadBundleHeader(entries));
+    newFatbin.append(codeObjects);
+  }
+
+  logOut() << "spliced " << replacements.size()
+           << " code objects into .hip_fatbin, " << reusedBytes << " of "
+           << newFatbin.size() << " bytes of the new fatbin reused\n";
+  if (currentStats)
+    currentStats->set("reused_fatbin_bytes", reusedBytes);
+  return true;
+}
+
+#endif // EXEC_RW_FATBIN_SPLICE_HPP
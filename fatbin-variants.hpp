@@ -0,0 +1,457 @@
+#ifndef EXEC_RW_FATBIN_VARIANTS_HPP
+#define EXEC_RW_FATBIN_VARIANTS_HPP
+
+#include "append-rewrite.hpp"
+#include "fatbin-align.hpp"
+#include "fatbin-pieces.hpp"
+#include "fatbin-slot.hpp"
+#include "file-copy.hpp"
+#include "log.hpp"
+#include "mapped-elf.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Several fatbins in one executable (--variant), picked at startup by the
+// EXECRW_FATBIN_VARIANT environment variable, e.g. builds of the same
+// application with different levels of instrumentation. Like the append
+// layout, every byte of the original stays where it is, and this is
+// appended, each fatbin in a PT_LOAD of its own:
+//
+//   [ program headers ][ entry stub ][ variant table ] [ fatbin 0 ] ...
+//
+// The wrappers point at the bundles of the first fatbin, the default. The
+// entry point of the executable is moved to the stub, which runs before
+// anything else in the process, the constructors that register the fatbins
+// included. It looks EXECRW_FATBIN_VARIANT up in the environment, and if it
+// names another variant, points the wrappers at its bundles, making their
+// pages writable for the time it takes (they are read-only after relocation
+// under RELRO). Then it jumps to the original entry point. An unknown name
+// gets a message on stderr, and the default.
+// libexecrw-register-stub.so logs which bundles a run registers, see
+// fatbin-register-stub.cpp.
+//
+// The stub is position-independent x86-64 code that only uses system calls:
+// libc isn't initialized yet. Every address in the variant table is relative
+// to the table. Only executables have an entry point, shared libraries can't
+// have variants.
+
+static const char fatbinVariantEnv[] = "EXECRW_FATBIN_VARIANT";
+
+struct FatbinVariant {
+  std::string name;
+  std::string fatbinPath;
+};
+
+// Parse the argument of --variant, <name>=<fatbin>.
+static bool parseFatbinVariant(const std::string &arg, FatbinVariant &variant) {
+  size_t eq = arg.find('=');
+  if (eq == std::string::npos || eq == 0 || eq + 1 == arg.size())
+    return false;
+  variant.name = arg.substr(0, eq);
+  variant.fatbinPath = arg.substr(eq + 1);
+  return true;
+}
+
+// The entry stub, with the variant table right after it at
+// variantTableOffset. %r8 holds the table throughout:
+//
+//     endbr64
+//     push  %rdx                      # the loader's atexit function
+//     lea   table(%rip), %r8
+//     mov   8(%rsp), %rcx             # argc
+//     lea   24(%rsp,%rcx,8), %r9      # envp
+//   env:                              # find EXECRW_FATBIN_VARIANT=
+//     mov   (%r9), %rsi
+//     test  %rsi, %rsi
+//     jz    done
+//     add   $8, %r9
+//     mov   56(%r8), %rdi
+//     add   %r8, %rdi
+//   prefix:
+//     mov   (%rdi), %al
+//     test  %al, %al
+//     jz    found
+//     cmp   (%rsi), %al
+//     jne   env
+//     inc   %rdi
+//     inc   %rsi
+//     jmp   prefix
+//   found:                            # find the variant named %rsi
+//     xor   %ecx, %ecx
+//   variant:
+//     cmp   48(%r8), %rcx
+//     je    unknown
+//     mov   %rcx, %rdx
+//     shl   $4, %rdx
+//     mov   80(%r8,%rdx), %rdi
+//     add   %r8, %rdi
+//     mov   %rsi, %r10
+//   name:
+//     mov   (%rdi), %al
+//     cmp   (%r10), %al
+//     jne   next
+//     test  %al, %al
+//     jz    select
+//     inc   %rdi
+//     inc   %r10
+//     jmp   name
+//   next:
+//     inc   %rcx
+//     jmp   variant
+//   select:                           # mprotect(wrappers, RW)
+//     mov   88(%r8,%rdx), %r9
+//     add   %r8, %r9
+//     mov   16(%r8), %rdi
+//     add   %r8, %rdi
+//     mov   24(%r8), %rsi
+//     mov   $3, %edx
+//     mov   $10, %eax
+//     syscall
+//     test  %rax, %rax
+//     js    done
+//     mov   8(%r8), %rdi
+//     add   %r8, %rdi
+//     mov   40(%r8), %rcx
+//   wrapper:                          # point each wrapper at its bundle
+//     test  %rcx, %rcx
+//     jz    protect
+//     mov   (%r9), %rax
+//     add   %r8, %rax
+//     mov   %rax, 8(%rdi)
+//     add   $8, %r9
+//     add   $24, %rdi
+//     dec   %rcx
+//     jmp   wrapper
+//   protect:                          # mprotect(wrappers, as they were)
+//     mov   16(%r8), %rdi
+//     add   %r8, %rdi
+//     mov   24(%r8), %rsi
+//     mov   32(%r8), %rdx
+//     mov   $10, %eax
+//     syscall
+//     jmp   done
+//   unknown:                          # write(2, message)
+//     mov   $1, %eax
+//     mov   $2, %edi
+//     mov   64(%r8), %rsi
+//     add   %r8, %rsi
+//     mov   72(%r8), %rdx
+//     syscall
+//   done:
+//     pop   %rdx
+//     mov   (%r8), %rax
+//     add   %r8, %rax
+//     jmp   *%rax
+static const unsigned char variantStub[] = {
+    0xf3, 0x0f, 0x1e, 0xfa, 0x52, 0x4c, 0x8d, 0x05, 0xec, 0x00, 0x00, 0x00,
+    0x48, 0x8b, 0x4c, 0x24, 0x08, 0x4c, 0x8d, 0x4c, 0xcc, 0x18, 0x49, 0x8b,
+    0x31, 0x48, 0x85, 0xf6, 0x0f, 0x84, 0xcd, 0x00, 0x00, 0x00, 0x49, 0x83,
+    0xc1, 0x08, 0x49, 0x8b, 0x78, 0x38, 0x4c, 0x01, 0xc7, 0x8a, 0x07, 0x84,
+    0xc0, 0x74, 0x0c, 0x3a, 0x06, 0x75, 0xdf, 0x48, 0xff, 0xc7, 0x48, 0xff,
+    0xc6, 0xeb, 0xee, 0x31, 0xc9, 0x49, 0x3b, 0x48, 0x30, 0x0f, 0x84, 0x8d,
+    0x00, 0x00, 0x00, 0x48, 0x89, 0xca, 0x48, 0xc1, 0xe2, 0x04, 0x49, 0x8b,
+    0x7c, 0x10, 0x50, 0x4c, 0x01, 0xc7, 0x49, 0x89, 0xf2, 0x8a, 0x07, 0x41,
+    0x3a, 0x02, 0x75, 0x0c, 0x84, 0xc0, 0x74, 0x0d, 0x48, 0xff, 0xc7, 0x49,
+    0xff, 0xc2, 0xeb, 0xed, 0x48, 0xff, 0xc1, 0xeb, 0xcc, 0x4d, 0x8b, 0x4c,
+    0x10, 0x58, 0x4d, 0x01, 0xc1, 0x49, 0x8b, 0x78, 0x10, 0x4c, 0x01, 0xc7,
+    0x49, 0x8b, 0x70, 0x18, 0xba, 0x03, 0x00, 0x00, 0x00, 0xb8, 0x0a, 0x00,
+    0x00, 0x00, 0x0f, 0x05, 0x48, 0x85, 0xc0, 0x78, 0x56, 0x49, 0x8b, 0x78,
+    0x08, 0x4c, 0x01, 0xc7, 0x49, 0x8b, 0x48, 0x28, 0x48, 0x85, 0xc9, 0x74,
+    0x17, 0x49, 0x8b, 0x01, 0x4c, 0x01, 0xc0, 0x48, 0x89, 0x47, 0x08, 0x49,
+    0x83, 0xc1, 0x08, 0x48, 0x83, 0xc7, 0x18, 0x48, 0xff, 0xc9, 0xeb, 0xe4,
+    0x49, 0x8b, 0x78, 0x10, 0x4c, 0x01, 0xc7, 0x49, 0x8b, 0x70, 0x18, 0x49,
+    0x8b, 0x50, 0x20, 0xb8, 0x0a, 0x00, 0x00, 0x00, 0x0f, 0x05, 0xeb, 0x17,
+    0xb8, 0x01, 0x00, 0x00, 0x00, 0xbf, 0x02, 0x00, 0x00, 0x00, 0x49, 0x8b,
+    0x70, 0x40, 0x4c, 0x01, 0xc6, 0x49, 0x8b, 0x50, 0x48, 0x0f, 0x05, 0x5a,
+    0x49, 0x8b, 0x00, 0x4c, 0x01, 0xc0, 0xff, 0xe0,
+};
+static const uint64_t variantTableOffset = sizeof(variantStub);
+
+// The variant table the stub reads. Offsets are from the start of the table.
+struct VariantTableHeader {
+  int64_t entry;
+  int64_t wrappers;
+  // The pages of the wrappers, and their protection after the loader is done
+  // with them, as PROT_* flags.
+  int64_t protectStart;
+  uint64_t protectSize;
+  uint64_t protectAfter;
+  uint64_t numWrappers;
+  uint64_t numVariants;
+  // "EXECRW_FATBIN_VARIANT=", and the message for unknown names.
+  int64_t envPrefix;
+  int64_t message;
+  uint64_t messageSize;
+  // Followed by numVariants VariantTableEntry.
+};
+
+struct VariantTableEntry {
+  // The name, and the numWrappers bundle addresses of the variant.
+  int64_t name;
+  int64_t bundles;
+};
+
+// The protection of the pages of [addr, addr + size) once the loader is done,
+// as PROT_* flags.
+static uint64_t protectionAfterLoad(const MappedElf &exec, uint64_t addr,
+                                    uint64_t size) {
+  const uint64_t pageSize = sysconf(_SC_PAGESIZE);
+  uint64_t protection = 1; // PROT_READ
+  for (size_t i = 0; i < exec.numSegments(); ++i) {
+    const ELFIO::Elf64_Phdr &phdr = exec.segmentHeader(i);
+    if (phdr.p_type == ELFIO::PT_LOAD && addr >= phdr.p_vaddr &&
+        addr - phdr.p_vaddr < phdr.p_memsz) {
+      if (phdr.p_flags & ELFIO::PF_W)
+        protection |= 2; // PROT_WRITE
+      if (phdr.p_flags & ELFIO::PF_X)
+        protection |= 4; // PROT_EXEC
+    }
+  }
+  // The loader rounds the end of PT_GNU_RELRO down to a page.
+  for (size_t i = 0; i < exec.numSegments(); ++i) {
+    const ELFIO::Elf64_Phdr &phdr = exec.segmentHeader(i);
+    uint64_t relroEnd = (phdr.p_vaddr + phdr.p_memsz) & ~(pageSize - 1);
+    if (phdr.p_type == ELFIO::PT_GNU_RELRO && addr >= phdr.p_vaddr &&
+        addr + size <= relroEnd)
+      protection &= ~(uint64_t)2;
+  }
+  return protection;
+}
+
+// Append the fatbins and the entry stub to a copy of ogExec. bundleOffsets[v]
+// holds the offsets of the bundles of fatbins[v] the wrappers point to, the
+// same number for every variant.
+static bool variantRewrite(const MappedElf &ogExec, const char *rwExecPath,
+                           const std::vector<std::string> &names,
+                           const std::vector<FatbinPieces> &fatbins,
+                           const std::vector<std::vector<uint64_t>> &bundleOffsets,
+                           FatbinAlign align = FatbinAlign::Auto) {
+  const uint64_t pageSize = sysconf(_SC_PAGESIZE);
+  const ELFIO::Elf64_Ehdr &ogHeader = ogExec.header();
+  const size_t numVariants = fatbins.size();
+  const size_t numWrappers = bundleOffsets[0].size();
+
+  if (ogHeader.e_machine != ELFIO::EM_X86_64 || ogHeader.e_entry == 0) {
+    logError() << "fatbin variants need an x86-64 executable with an entry "
+                  "point\n";
+    return false;
+  }
+
+  size_t fatbinIdx = ogExec.findSection(".hip_fatbin");
+  size_t wrapperIdx = ogExec.findSection(".hipFatBinSegment");
+  if (!fatbinIdx || !wrapperIdx) {
+    logError() << "can't find .hip_fatbin or .hipFatBinSegment\n";
+    return false;
+  }
+  const ELFIO::Elf64_Shdr &wrapperSection = ogExec.sectionHeader(wrapperIdx);
+  if (wrapperSection.sh_type == ELFIO::SHT_NOBITS ||
+      numWrappers * 24 > wrapperSection.sh_size) {
+    logError() << ".hipFatBinSegment holds fewer than " << numWrappers
+               << " wrappers\n";
+    return false;
+  }
+
+  // The program headers, without the slot of an earlier rewrite, which no
+  // longer holds the fatbin in use.
+  std::vector<ELFIO::Elf64_Phdr> phdrs;
+  const ELFIO::Elf64_Phdr *firstLoad = nullptr;
+  size_t lastLoadIdx = 0;
+  uint64_t lastSegmentEnd = 0;
+  for (size_t i = 0; i < ogExec.numSegments(); ++i) {
+    const ELFIO::Elf64_Phdr &phdr = ogExec.segmentHeader(i);
+    if (phdr.p_vaddr + phdr.p_memsz > lastSegmentEnd)
+      lastSegmentEnd = phdr.p_vaddr + phdr.p_memsz;
+
+    FatbinSlot oldSlot;
+    uint64_t oldSlotDesc;
+    if (phdr.p_type == ELFIO::PT_NOTE &&
+        findFatbinSlotNote(ogExec, phdr.p_offset, phdr.p_filesz, oldSlot,
+                           oldSlotDesc))
+      continue;
+
+    phdrs.push_back(phdr);
+    if (phdr.p_type == ELFIO::PT_LOAD) {
+      if (!firstLoad)
+        firstLoad = &phdr;
+      lastLoadIdx = phdrs.size() - 1;
+    }
+  }
+  if (!firstLoad || (firstLoad->p_vaddr - firstLoad->p_offset) % pageSize) {
+    logError() << "can't find a page-aligned PT_LOAD in the executable\n";
+    return false;
+  }
+  const uint64_t loadDelta = firstLoad->p_vaddr - firstLoad->p_offset;
+
+  // The stub segment: program headers, stub, table, bundle addresses and
+  // strings.
+  const uint64_t phdrTableSize =
+      (phdrs.size() + 1 + numVariants) * sizeof(ELFIO::Elf64_Phdr);
+  const uint64_t stubOffset = alignUp(phdrTableSize, 16);
+  const uint64_t tableOffset = stubOffset + variantTableOffset;
+  std::vector<char> table(sizeof(VariantTableHeader) +
+                          numVariants * sizeof(VariantTableEntry) +
+                          numVariants * numWrappers * sizeof(int64_t));
+  auto addString = [&](const std::string &string) {
+    int64_t offset = table.size();
+    table.insert(table.end(), string.begin(), string.end());
+    table.push_back('\0');
+    return offset;
+  };
+
+  VariantTableHeader header = {};
+  header.envPrefix = addString(std::string(fatbinVariantEnv) + "=");
+  std::string message = std::string(fatbinVariantEnv) + " isn't one of";
+  for (const std::string &name : names)
+    message += ' ' + name;
+  message += ", running " + names[0] + '\n';
+  header.message = addString(message);
+  header.messageSize = message.size();
+  std::vector<VariantTableEntry> entries(numVariants);
+  for (size_t v = 0; v < numVariants; ++v) {
+    entries[v].name = addString(names[v]);
+    entries[v].bundles = sizeof(VariantTableHeader) +
+                         numVariants * sizeof(VariantTableEntry) +
+                         v * numWrappers * sizeof(int64_t);
+  }
+
+  uint64_t newOffset = alignUp(ogExec.size(), pageSize);
+  uint64_t minAddr = alignUp(lastSegmentEnd, pageSize);
+  if (newOffset + loadDelta < minAddr)
+    newOffset = minAddr - loadDelta;
+  const uint64_t newAddr = newOffset + loadDelta;
+  const uint64_t tableAddr = newAddr + tableOffset;
+  const uint64_t stubSegmentSize = tableOffset + table.size();
+
+  ELFIO::Elf64_Phdr stubLoad = {};
+  stubLoad.p_type = ELFIO::PT_LOAD;
+  stubLoad.p_flags = ELFIO::PF_R | ELFIO::PF_X;
+  stubLoad.p_offset = newOffset;
+  stubLoad.p_vaddr = newAddr;
+  stubLoad.p_paddr = newAddr;
+  stubLoad.p_filesz = stubSegmentSize;
+  stubLoad.p_memsz = stubSegmentSize;
+  stubLoad.p_align = pageSize;
+  std::vector<ELFIO::Elf64_Phdr> newLoads = {stubLoad};
+
+  // Each fatbin in a segment of its own, aligned as --align asks.
+  std::vector<uint64_t> fatbinOffsets;
+  uint64_t end = newOffset + stubSegmentSize;
+  for (size_t v = 0; v < numVariants; ++v) {
+    uint64_t fatbinAlign =
+        fatbinAlignment(align, ogExec.sectionHeader(fatbinIdx).sh_addralign,
+                        fatbins[v].size());
+    if (loadDelta % fatbinAlign)
+      fatbinAlign = pageSize;
+    const uint64_t offset = alignUp(end, fatbinAlign);
+    ELFIO::Elf64_Phdr fatbinLoad = stubLoad;
+    fatbinLoad.p_flags = ELFIO::PF_R;
+    fatbinLoad.p_offset = offset;
+    fatbinLoad.p_vaddr = offset + loadDelta;
+    fatbinLoad.p_paddr = offset + loadDelta;
+    fatbinLoad.p_filesz = fatbins[v].size();
+    fatbinLoad.p_memsz = fatbins[v].size();
+    fatbinLoad.p_align = fatbinAlign;
+    newLoads.push_back(fatbinLoad);
+    fatbinOffsets.push_back(offset);
+    end = offset + fatbins[v].size();
+
+    for (size_t i = 0; i < numWrappers; ++i) {
+      int64_t bundle = offset + loadDelta + bundleOffsets[v][i] - tableAddr;
+      memcpy(table.data() + entries[v].bundles + i * sizeof(bundle), &bundle,
+             sizeof(bundle));
+    }
+  }
+  phdrs.insert(phdrs.begin() + lastLoadIdx + 1, newLoads.begin(),
+               newLoads.end());
+
+  for (ELFIO::Elf64_Phdr &phdr : phdrs) {
+    if (phdr.p_type != ELFIO::PT_PHDR)
+      continue;
+    phdr.p_offset = newOffset;
+    phdr.p_vaddr = newAddr;
+    phdr.p_paddr = newAddr;
+    phdr.p_filesz = phdrTableSize;
+    phdr.p_memsz = phdrTableSize;
+  }
+
+  const uint64_t wrapperAddr = wrapperSection.sh_addr;
+  const uint64_t protectStart = wrapperAddr & ~(pageSize - 1);
+  header.entry = ogHeader.e_entry - tableAddr;
+  header.wrappers = wrapperAddr - tableAddr;
+  header.protectStart = protectStart - tableAddr;
+  header.protectSize =
+      alignUp(wrapperAddr + numWrappers * 24, pageSize) - protectStart;
+  header.protectAfter =
+      protectionAfterLoad(ogExec, wrapperAddr, numWrappers * 24);
+  header.numWrappers = numWrappers;
+  header.numVariants = numVariants;
+  memcpy(table.data(), &header, sizeof(header));
+  memcpy(table.data() + sizeof(header), entries.data(),
+         entries.size() * sizeof(VariantTableEntry));
+
+  ELFIO::Elf64_Ehdr newHeader = ogHeader;
+  newHeader.e_entry = newAddr + stubOffset;
+  newHeader.e_phoff = newOffset;
+  newHeader.e_phnum = phdrs.size();
+
+  struct stat st;
+  if (fstat(ogExec.fd(), &st) != 0)
+    return false;
+
+  int fd = open(rwExecPath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                st.st_mode & 07777);
+  if (fd < 0) {
+    logError() << "can't create " << rwExecPath << '\n';
+    return false;
+  }
+
+  logOut() << "Copying " << ogExec.size() << " bytes of the original...\n";
+  CopyStats stats;
+  bool ok = copyWholeFile(ogExec.fd(), fd, ogExec.size(), &stats);
+  logOut() << stats.cloned << " bytes reflinked, " << stats.copied
+           << " copied by the kernel, " << stats.buffered
+           << " copied through a buffer\n";
+
+  logOut() << "Appending program header table and entry stub at "
+           << newOffset << '\n';
+  ok = ok && pwriteAll(fd, phdrs.data(), phdrTableSize, newOffset);
+  ok = ok && pwriteAll(fd, variantStub, sizeof(variantStub),
+                       newOffset + stubOffset);
+  ok = ok && pwriteAll(fd, table.data(), table.size(), newOffset + tableOffset);
+  for (size_t v = 0; ok && v < numVariants; ++v) {
+    logOut() << "Appending fatbin " << names[v] << " at " << fatbinOffsets[v]
+             << '\n';
+    ok = fatbins[v].write(ogExec.fd(), fd, fatbinOffsets[v], &stats);
+  }
+
+  logOut() << "Patching ELF header, e_entry : " << newHeader.e_entry
+           << ", e_phoff : " << newHeader.e_phoff
+           << ", e_phnum : " << newHeader.e_phnum << '\n';
+  ok = ok && pwriteAll(fd, &newHeader, sizeof(newHeader), 0);
+
+  // The wrappers point at the default variant, whatever the stub does.
+  std::vector<uint64_t> relocOffsets =
+      findWrapperRelocations(ogExec, wrapperAddr, numWrappers);
+  for (size_t i = 0; ok && i < numWrappers; ++i) {
+    uint64_t addr = fatbinOffsets[0] + loadDelta + bundleOffsets[0][i];
+    ok = pwriteAll(fd, &addr, sizeof(addr),
+                   wrapperSection.sh_offset + i * 24 + 8);
+    if (ok && relocOffsets[i])
+      ok = pwriteAll(fd, &addr, sizeof(addr), relocOffsets[i]);
+  }
+
+  if (close(fd) != 0 || !ok) {
+    logError() << "can't write " << rwExecPath << '\n';
+    return false;
+  }
+  return true;
+}
+
+#endif // EXEC_RW_FATBIN_VARIANTS_HPP
@@ -0,0 +1,158 @@
+#ifndef EXEC_RW_FILE_COPY_HPP
+#define EXEC_RW_FILE_COPY_HPP
+
+#include <cerrno>
+#include <cstdint>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// Byte ranges that already exist in one file are copied to another without
+// going through this process where possible:
+//
+//   1. FICLONE / FICLONERANGE make the destination share the extents of the
+//      source (XFS, btrfs). This needs the source and destination offsets to
+//      be congruent modulo the filesystem block size, only the unaligned head
+//      and tail of a range are copied then.
+//   2. copy_file_range lets the kernel copy the data.
+//   3. As a last resort, the data goes through a buffer.
+
+// How many bytes each of the above copied.
+struct CopyStats {
+  uint64_t cloned = 0;
+  uint64_t copied = 0;
+  uint64_t buffered = 0;
+};
+
+static bool pwriteAll(int fd, const void *data, size_t size, uint64_t offset) {
+  const char *bytes = (const char *)data;
+  while (size != 0) {
+    ssize_t written = pwrite(fd, bytes, size, offset);
+    if (written <= 0)
+      return false;
+    bytes += written;
+    offset += written;
+    size -= written;
+  }
+  return true;
+}
+
+// Whether path and otherPath name the same file.
+static bool isSameFile(const char *path, const char *otherPath) {
+  struct stat st, otherSt;
+  return stat(path, &st) == 0 && stat(otherPath, &otherSt) == 0 &&
+         st.st_dev == otherSt.st_dev && st.st_ino == otherSt.st_ino;
+}
+
+// Make [offset, offset + size) of fd read as zeroes: punch a hole where the
+// filesystem can, write zeroes a block at a time otherwise.
+static bool zeroFileRange(int fd, uint64_t offset, uint64_t size) {
+  if (size == 0 ||
+      fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+                size) == 0)
+    return true;
+  static const char zeroes[65536] = {};
+  while (size != 0) {
+    size_t n = size < sizeof(zeroes) ? size : sizeof(zeroes);
+    if (!pwriteAll(fd, zeroes, n, offset))
+      return false;
+    offset += n;
+    size -= n;
+  }
+  return true;
+}
+
+static bool copyRangeBuffered(int srcFd, uint64_t srcOffset, int dstFd,
+                              uint64_t dstOffset, uint64_t size,
+                              CopyStats *stats) {
+  std::vector<char> buffer(size < (1 << 20) ? size : (1 << 20));
+  while (size != 0) {
+    size_t toRead = size < buffer.size() ? size : buffer.size();
+    ssize_t n = pread(srcFd, buffer.data(), toRead, srcOffset);
+    if (n <= 0)
+      return false;
+    if (pwrite(dstFd, buffer.data(), n, dstOffset) != n)
+      return false;
+
+    srcOffset += n;
+    dstOffset += n;
+    size -= n;
+    if (stats)
+      stats->buffered += n;
+  }
+  return true;
+}
+
+static bool copyRangeInKernel(int srcFd, uint64_t srcOffset, int dstFd,
+                              uint64_t dstOffset, uint64_t size,
+                              CopyStats *stats) {
+  while (size != 0) {
+    off64_t srcPos = srcOffset;
+    off64_t dstPos = dstOffset;
+    ssize_t n = copy_file_range(srcFd, &srcPos, dstFd, &dstPos, size, 0);
+    if (n <= 0)
+      return copyRangeBuffered(srcFd, srcOffset, dstFd, dstOffset, size,
+                               stats);
+
+    srcOffset += n;
+    dstOffset += n;
+    size -= n;
+    if (stats)
+      stats->copied += n;
+  }
+  return true;
+}
+
+// Copy [srcOffset, srcOffset + size) of srcFd to dstFd at dstOffset.
+static bool copyFileRange(int srcFd, uint64_t srcOffset, int dstFd,
+                          uint64_t dstOffset, uint64_t size,
+                          CopyStats *stats = nullptr) {
+  struct stat st;
+  uint64_t blockSize = fstat(dstFd, &st) == 0 ? st.st_blksize : 0;
+
+  if (blockSize != 0 && srcOffset % blockSize == dstOffset % blockSize) {
+    uint64_t head = (blockSize - srcOffset % blockSize) % blockSize;
+    if (head > size)
+      head = size;
+    uint64_t middle = (size - head) / blockSize * blockSize;
+
+    struct file_clone_range range;
+    range.src_fd = srcFd;
+    range.src_offset = srcOffset + head;
+    range.src_length = middle;
+    range.dest_offset = dstOffset + head;
+
+    if (middle != 0 && ioctl(dstFd, FICLONERANGE, &range) == 0) {
+      if (stats)
+        stats->cloned += middle;
+
+      uint64_t tail = size - head - middle;
+      return copyRangeInKernel(srcFd, srcOffset, dstFd, dstOffset, head,
+                               stats) &&
+             copyRangeInKernel(srcFd, srcOffset + head + middle, dstFd,
+                               dstOffset + head + middle, tail, stats);
+    }
+  }
+
+  return copyRangeInKernel(srcFd, srcOffset, dstFd, dstOffset, size, stats);
+}
+
+// Copy the first size bytes of srcFd to the beginning of dstFd, which should
+// be empty.
+static bool copyWholeFile(int srcFd, int dstFd, uint64_t size,
+                          CopyStats *stats = nullptr) {
+  if (ioctl(dstFd, FICLONE, srcFd) == 0) {
+    if (stats)
+      stats->cloned += size;
+    return true;
+  }
+  return copyFileRange(srcFd, 0, dstFd, 0, size, stats);
+}
+
+#endif // EXEC_RW_FILE_COPY_HPP
@@ -0,0 +1,114 @@
+#ifndef EXEC_RW_INPLACE_REWRITE_HPP
+#define EXEC_RW_INPLACE_REWRITE_HPP
+
+#include "append-rewrite.hpp"
+#include "fatbin-pieces.hpp"
+#include "fatbin-slot.hpp"
+#include "file-copy.hpp"
+#include "log.hpp"
+#include "mapped-elf.hpp"
+
+#include <cstdint>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Put a new fatbin into the slot that an earlier rewrite with --slack left in
+// exec, see fatbin-slot.hpp. Nothing is cloned and the file doesn't grow, only
+// the slot, the slot note and the .hipFatBinSegment pointers (and their
+// relocations) are written.
+//
+// If rwExecPath is exec itself it is patched in place, otherwise exec is
+// copied (or reflinked) to rwExecPath first. The new fatbin must fit in the
+// slot.
+static bool inPlaceRewrite(const MappedElf &exec, const FatbinSlot &slot,
+                           uint64_t slotDescOffset, const char *rwExecPath,
+                           const FatbinPieces &newFatbin,
+                           const std::vector<uint64_t> &fatbinOffsets) {
+  const uint64_t newFatbinSize = newFatbin.size();
+  size_t wrapperIdx = exec.findSection(".hipFatBinSegment");
+  if (!wrapperIdx) {
+    logError() << "can't find .hipFatBinSegment\n";
+    return false;
+  }
+
+  const ELFIO::Elf64_Shdr &wrapperSection = exec.sectionHeader(wrapperIdx);
+  if (wrapperSection.sh_type == ELFIO::SHT_NOBITS ||
+      fatbinOffsets.size() * 24 > wrapperSection.sh_size) {
+    logError() << ".hipFatBinSegment holds fewer than " << fatbinOffsets.size()
+               << " wrappers\n";
+    return false;
+  }
+
+  if (newFatbinSize > slot.capacity) {
+    logError() << "new fatbin doesn't fit in the " << slot.capacity
+               << " bytes reserved for it\n";
+    return false;
+  }
+
+  // Read everything needed from the mapping before exec may be written to.
+  std::vector<uint64_t> relocOffsets = findWrapperRelocations(
+      exec, wrapperSection.sh_addr, fatbinOffsets.size());
+
+  struct stat execSt, rwSt;
+  if (fstat(exec.fd(), &execSt) != 0)
+    return false;
+  bool samePath = stat(rwExecPath, &rwSt) == 0 &&
+                  execSt.st_dev == rwSt.st_dev && execSt.st_ino == rwSt.st_ino;
+
+  int fd;
+  bool ok = true;
+  if (samePath) {
+    fd = open(rwExecPath, O_RDWR | O_CLOEXEC);
+  } else {
+    fd = open(rwExecPath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+              execSt.st_mode & 07777);
+    if (fd >= 0) {
+      logOut() << "Copying " << exec.size() << " bytes of the original...\n";
+      CopyStats stats;
+      ok = copyWholeFile(exec.fd(), fd, exec.size(), &stats);
+      logOut() << stats.cloned << " bytes reflinked, " << stats.copied
+               << " copied by the kernel, " << stats.buffered
+               << " copied through a buffer\n";
+    }
+  }
+  if (fd < 0) {
+    logError() << "can't open " << rwExecPath << " for writing\n";
+    return false;
+  }
+
+  logOut() << "Writing new fatbin of " << newFatbinSize << " bytes in place at "
+           << slot.offset << ", " << slot.capacity - newFatbinSize
+           << " bytes of slack left\n";
+  ok = ok && newFatbin.write(exec.fd(), fd, slot.offset);
+
+  // Clear what is left of a larger old fatbin.
+  if (ok && slot.size > newFatbinSize)
+    ok = zeroFileRange(fd, slot.offset + newFatbinSize,
+                       slot.size - newFatbinSize);
+
+  FatbinSlot newSlot = slot;
+  newSlot.size = newFatbinSize;
+  std::vector<char> note = makeFatbinSlotNote(newSlot);
+  ok = ok && pwriteAll(fd, note.data() + fatbinSlotDescOffset,
+                       note.size() - fatbinSlotDescOffset, slotDescOffset);
+
+  // The fatbin pointer is at offset 8 of each 24-byte wrapper.
+  for (size_t i = 0; ok && i < fatbinOffsets.size(); ++i) {
+    uint64_t addr = slot.addr + fatbinOffsets[i];
+    ok = pwriteAll(fd, &addr, sizeof(addr),
+                   wrapperSection.sh_offset + i * 24 + 8);
+    if (ok && relocOffsets[i])
+      ok = pwriteAll(fd, &addr, sizeof(addr), relocOffsets[i]);
+  }
+
+  if (close(fd) != 0 || !ok) {
+    logError() << "can't write " << rwExecPath << '\n';
+    return false;
+  }
+  return true;
+}
+
+#endif // EXEC_RW_INPLACE_REWRITE_HPP
@@ -0,0 +1,505 @@
+#ifndef EXEC_RW_KERNEL_PATCH_HPP
+#define EXEC_RW_KERNEL_PATCH_HPP
+
+#include "append-rewrite.hpp"
+#include "fatbin-splice.hpp"
+#include "log.hpp"
+#include "mapped-elf.hpp"
+#include "offload-bundle.hpp"
+#include "rewrite-stats.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Kernel-granular patching of the code objects of .hip_fatbin
+// (--patch-kernels). Instead of a whole code object, only the kernels that
+// changed are given, in a relocatable object for the same target, as the
+// assembler emits it (llvm-mc -filetype=obj, clang -c on device assembly).
+// Each kernel is made of its code, in .text, and of its kernel descriptor,
+// the 64 bytes of <kernel>.kd in .rodata, which point at the code. In a copy
+// of the code object linked into the executable, for every kernel:
+//
+// - the code of the object is relocated to where it goes, and written over
+//   the old code if it fits, the rest of which is zeroed. Code that grew is
+//   appended to the code object in a new PT_LOAD, behind a copy of the
+//   program header table, as the append layout does for executables,
+// - the descriptor of the object is written over the old one, with its entry
+//   offset pointing at the new code,
+// - the kernel's symbols get the new address and size.
+//
+// The patched code object then replaces the original one as with --replace,
+// see fatbin-splice.hpp, so the work is proportional to the kernels changed,
+// and the rest of the fatbin is reused from the executable.
+//
+// Only the PC-relative relocations the compiler emits for code (s_getpc_b64
+// sequences, REL32_LO/HI, and REL32/REL64) are resolved: against the kernel
+// itself, or by name against the symbols of the original code object.
+// Absolute and GOT relocations would need the loader, and code or data that
+// only the object has can't be referred to. The metadata note isn't
+// rewritten either, the runtime sizes dispatches from it: the kernel
+// arguments must stay the same, and LDS and scratch use can't grow.
+
+struct KernelPatch {
+  // The entry of .hip_fatbin to patch, as for --replace.
+  std::string entryId;
+  long bundle = -1;
+  // The relocatable object with the new kernels.
+  std::vector<char> object;
+  // The kernels to patch, every kernel of object if empty.
+  std::vector<std::string> kernels;
+};
+
+// Parse the argument of --patch-kernels, <entry-id>[@<bundle>]=<path>, and
+// read the object at path.
+static bool readKernelPatch(const std::string &arg, KernelPatch &patch) {
+  CodeObjectReplacement replacement;
+  if (!readCodeObjectReplacement(arg, replacement))
+    return false;
+  patch.entryId = std::move(replacement.entryId);
+  patch.bundle = replacement.bundle;
+  patch.object = std::move(replacement.codeObject);
+  return true;
+}
+
+// The fields of a kernel descriptor that are checked or patched.
+static const uint64_t kernelDescriptorSize = 64;
+static const uint64_t kdGroupSegmentSize = 0;
+static const uint64_t kdPrivateSegmentSize = 4;
+static const uint64_t kdKernargSize = 8;
+static const uint64_t kdEntryOffset = 16;
+
+// Kernel code must start on this boundary.
+static const uint64_t kernelCodeAlign = 256;
+
+// The addend of a relocation in an s_getpc_b64 sequence includes the distance
+// from s_getpc_b64 to the instruction it patches, so it can point a few
+// instructions past the end of the kernel.
+static const uint64_t pcRelativeSlack = 16;
+
+struct KernelPatchStats {
+  uint64_t numPatched = 0;
+  uint64_t numAppended = 0;
+  uint64_t appendedBytes = 0;
+};
+
+// [data, data + size) of section index of elf, if it lies in the file.
+static bool sectionContents(const MappedElf &elf, size_t index,
+                            const char *&data, uint64_t &size) {
+  if (index == 0 || index >= elf.numSections())
+    return false;
+  const ELFIO::Elf64_Shdr &section = elf.sectionHeader(index);
+  if (section.sh_type == ELFIO::SHT_NOBITS || section.sh_offset > elf.size() ||
+      section.sh_size > elf.size() - section.sh_offset)
+    return false;
+  data = elf.data() + section.sh_offset;
+  size = section.sh_size;
+  return true;
+}
+
+// The name of symbol index of the symbol table at symtabIdx, and the symbol.
+static bool readSymbol(const MappedElf &elf, size_t symtabIdx, uint64_t index,
+                       ELFIO::Elf64_Sym &symbol, std::string &name) {
+  const char *symbols, *strings;
+  uint64_t symbolsSize, stringsSize;
+  if (!sectionContents(elf, symtabIdx, symbols, symbolsSize) ||
+      !sectionContents(elf, elf.sectionHeader(symtabIdx).sh_link, strings,
+                       stringsSize) ||
+      index >= symbolsSize / sizeof(symbol))
+    return false;
+  memcpy(&symbol, symbols + index * sizeof(symbol), sizeof(symbol));
+  if (symbol.st_name >= stringsSize)
+    return false;
+  const char *start = strings + symbol.st_name;
+  name.assign(start, strnlen(start, stringsSize - symbol.st_name));
+  return true;
+}
+
+// Calls fn(offset, symbol, name) for every symbol of the symbol tables of
+// elf, offset being that of the symbol in the file.
+template <typename SymbolFn>
+static void forEachSymbol(const MappedElf &elf, SymbolFn fn) {
+  for (size_t i = 1; i < elf.numSections(); ++i) {
+    const ELFIO::Elf64_Shdr &section = elf.sectionHeader(i);
+    if (section.sh_type != ELFIO::SHT_SYMTAB &&
+        section.sh_type != ELFIO::SHT_DYNSYM)
+      continue;
+    ELFIO::Elf64_Sym symbol;
+    std::string name;
+    for (uint64_t j = 1; readSymbol(elf, i, j, symbol, name); ++j)
+      fn(section.sh_offset + j * sizeof(symbol), symbol, name);
+  }
+}
+
+// The definition of name in elf, of the given symbol type, or of any type if
+// type is -1.
+static bool findDefinedSymbol(const MappedElf &elf, const std::string &name,
+                              int type, ELFIO::Elf64_Sym &found) {
+  bool ok = false;
+  forEachSymbol(elf, [&](uint64_t, const ELFIO::Elf64_Sym &symbol,
+                         const std::string &symbolName) {
+    if (!ok && symbolName == name && symbol.st_shndx != 0 &&
+        (type < 0 || (symbol.st_info & 0xf) == type)) {
+      found = symbol;
+      ok = true;
+    }
+  });
+  return ok;
+}
+
+// The file offset of [addr, addr + size) in the loaded sections of elf.
+static bool addrToOffset(const MappedElf &elf, uint64_t addr, uint64_t size,
+                         uint64_t &offset) {
+  for (size_t i = 1; i < elf.numSections(); ++i) {
+    const ELFIO::Elf64_Shdr &section = elf.sectionHeader(i);
+    if (!(section.sh_flags & ELFIO::SHF_ALLOC) ||
+        section.sh_type == ELFIO::SHT_NOBITS || addr < section.sh_addr ||
+        addr - section.sh_addr > section.sh_size ||
+        size > section.sh_size - (addr - section.sh_addr))
+      continue;
+    offset = section.sh_offset + addr - section.sh_addr;
+    return offset <= elf.size() && size <= elf.size() - offset;
+  }
+  return false;
+}
+
+// Apply the relocations of the kernel of object defined by kernel to code,
+// its bytes, for the kernel to run at addr in codeObject.
+static bool relocateKernel(const MappedElf &object, const std::string &name,
+                           const ELFIO::Elf64_Sym &kernel,
+                           const MappedElf &codeObject, uint64_t addr,
+                           std::vector<char> &code) {
+  const uint32_t rel32Type = 4;    // R_AMDGPU_REL32
+  const uint32_t rel64Type = 5;    // R_AMDGPU_REL64
+  const uint32_t rel32LoType = 10; // R_AMDGPU_REL32_LO
+  const uint32_t rel32HiType = 11; // R_AMDGPU_REL32_HI
+  const uint64_t kernelEnd = kernel.st_value + kernel.st_size;
+
+  for (size_t i = 1; i < object.numSections(); ++i) {
+    const ELFIO::Elf64_Shdr &section = object.sectionHeader(i);
+    const char *relocs;
+    uint64_t relocsSize;
+    if (section.sh_type != ELFIO::SHT_RELA ||
+        section.sh_info != kernel.st_shndx ||
+        !sectionContents(object, i, relocs, relocsSize))
+      continue;
+
+    for (uint64_t j = 0; j < relocsSize / sizeof(ELFIO::Elf64_Rela); ++j) {
+      ELFIO::Elf64_Rela reloc;
+      memcpy(&reloc, relocs + j * sizeof(reloc), sizeof(reloc));
+      if (reloc.r_offset < kernel.st_value || reloc.r_offset >= kernelEnd)
+        continue;
+      const uint32_t type = reloc.r_info & 0xffffffff;
+      const uint64_t pos = reloc.r_offset - kernel.st_value;
+
+      ELFIO::Elf64_Sym symbol;
+      std::string symbolName;
+      if (!readSymbol(object, section.sh_link, reloc.r_info >> 32, symbol,
+                      symbolName)) {
+        logError() << "bad relocation at " << reloc.r_offset << " in " << name
+                   << '\n';
+        return false;
+      }
+
+      // Code of the kernel moves with it, the rest is looked up by name in
+      // the code object. References through the section symbol can only be
+      // to the kernel.
+      uint64_t symbolAddr;
+      const bool inKernelSection = symbol.st_shndx == kernel.st_shndx;
+      if ((symbol.st_info & 0xf) == ELFIO::STT_SECTION) {
+        uint64_t target = symbol.st_value + reloc.r_addend;
+        if (!inKernelSection || target < kernel.st_value ||
+            target > kernelEnd + pcRelativeSlack) {
+          logError() << name << " refers to "
+                     << object.sectionName(symbol.st_shndx) << '+'
+                     << reloc.r_addend
+                     << ", outside of the kernel, which the code object "
+                        "doesn't have\n";
+          return false;
+        }
+        symbolAddr = addr - kernel.st_value + symbol.st_value;
+      } else if (inKernelSection && symbol.st_value >= kernel.st_value &&
+                 symbol.st_value <= kernelEnd) {
+        symbolAddr = addr - kernel.st_value + symbol.st_value;
+      } else {
+        ELFIO::Elf64_Sym definition;
+        if (!findDefinedSymbol(codeObject, symbolName, -1, definition)) {
+          logError() << name << " refers to " << symbolName
+                     << ", which the code object doesn't define\n";
+          return false;
+        }
+        symbolAddr = definition.st_value;
+      }
+
+      const int64_t value = symbolAddr + reloc.r_addend - (addr + pos);
+      uint64_t size = type == rel64Type ? 8 : 4;
+      if (pos + size > code.size()) {
+        logError() << "relocation at " << reloc.r_offset << " overruns "
+                   << name << '\n';
+        return false;
+      }
+      if (type == rel64Type) {
+        memcpy(code.data() + pos, &value, 8);
+      } else if (type == rel32LoType || type == rel32HiType) {
+        uint32_t half = type == rel32LoType ? value : value >> 32;
+        memcpy(code.data() + pos, &half, 4);
+      } else if (type == rel32Type && value == (int32_t)value) {
+        int32_t value32 = value;
+        memcpy(code.data() + pos, &value32, 4);
+      } else {
+        logError() << "relocation of type " << type << " against "
+                   << symbolName << " in " << name
+                   << " can't be resolved, only PC-relative ones can\n";
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// The kernels of object: the functions that have a kernel descriptor.
+static std::vector<std::string> listKernels(const MappedElf &object) {
+  std::vector<std::string> kernels;
+  forEachSymbol(object, [&](uint64_t, const ELFIO::Elf64_Sym &symbol,
+                            const std::string &name) {
+    ELFIO::Elf64_Sym descriptor;
+    if ((symbol.st_info & 0xf) == ELFIO::STT_FUNC && symbol.st_shndx != 0 &&
+        findDefinedSymbol(object, name + ".kd", ELFIO::STT_OBJECT,
+                          descriptor))
+      kernels.push_back(name);
+  });
+  return kernels;
+}
+
+// Patch the kernels of patch into [codeObject, codeObject + size), giving
+// the patched code object in out.
+static bool patchCodeObject(const char *codeObject, uint64_t size,
+                            const KernelPatch &patch, std::vector<char> &out,
+                            KernelPatchStats &stats) {
+  MappedElf original, object;
+  if (!original.view(codeObject, size) ||
+      original.header().e_machine != ELFIO::EM_AMDGPU ||
+      original.header().e_type != ELFIO::ET_DYN) {
+    logError() << patch.entryId << " isn't an AMDGPU code object\n";
+    return false;
+  }
+  if (!object.view(patch.object.data(), patch.object.size()) ||
+      object.header().e_machine != ELFIO::EM_AMDGPU ||
+      object.header().e_type != ELFIO::ET_REL) {
+    logError() << "the kernels for " << patch.entryId
+               << " aren't in a relocatable AMDGPU object\n";
+    return false;
+  }
+  if (object.header().e_flags != original.header().e_flags) {
+    logError() << "the kernels for " << patch.entryId
+               << " were built for another target (e_flags "
+               << object.header().e_flags << ", not "
+               << original.header().e_flags << ")\n";
+    return false;
+  }
+
+  std::vector<std::string> kernels =
+      patch.kernels.empty() ? listKernels(object) : patch.kernels;
+  if (kernels.empty()) {
+    logError() << "no kernels to patch into " << patch.entryId << '\n';
+    return false;
+  }
+
+  // Where appended code goes: a new segment after every other one, which
+  // starts with the program header table.
+  uint64_t segmentAlign = kernelCodeAlign, lastSegmentEnd = 0;
+  for (size_t i = 0; i < original.numSegments(); ++i) {
+    const ELFIO::Elf64_Phdr &phdr = original.segmentHeader(i);
+    if (phdr.p_vaddr + phdr.p_memsz > lastSegmentEnd)
+      lastSegmentEnd = phdr.p_vaddr + phdr.p_memsz;
+    if (phdr.p_type == ELFIO::PT_LOAD && phdr.p_align > segmentAlign)
+      segmentAlign = phdr.p_align;
+  }
+  const uint64_t segmentAddr = alignUp(lastSegmentEnd, segmentAlign);
+  const uint64_t segmentOffset = alignUp(size, segmentAlign);
+  const uint64_t phdrTableSize =
+      (original.numSegments() + 1) * sizeof(ELFIO::Elf64_Phdr);
+  uint64_t appendAddr = alignUp(segmentAddr + phdrTableSize, kernelCodeAlign);
+
+  out.assign(codeObject, codeObject + size);
+  std::vector<std::pair<uint64_t, std::vector<char>>> appended;
+  for (const std::string &name : kernels) {
+    ELFIO::Elf64_Sym oldCode, oldDescriptor, newCode, newDescriptor;
+    uint64_t oldCodeOffset, oldDescriptorOffset;
+    if (!findDefinedSymbol(original, name, ELFIO::STT_FUNC, oldCode) ||
+        !findDefinedSymbol(original, name + ".kd", ELFIO::STT_OBJECT,
+                           oldDescriptor) ||
+        !addrToOffset(original, oldCode.st_value, oldCode.st_size,
+                      oldCodeOffset) ||
+        !addrToOffset(original, oldDescriptor.st_value, kernelDescriptorSize,
+                      oldDescriptorOffset)) {
+      logError() << "no kernel " << name << " in " << patch.entryId << '\n';
+      return false;
+    }
+
+    const char *codeSection, *descriptorSection;
+    uint64_t codeSectionSize, descriptorSectionSize;
+    if (!findDefinedSymbol(object, name, ELFIO::STT_FUNC, newCode) ||
+        !findDefinedSymbol(object, name + ".kd", ELFIO::STT_OBJECT,
+                           newDescriptor) ||
+        !sectionContents(object, newCode.st_shndx, codeSection,
+                         codeSectionSize) ||
+        !sectionContents(object, newDescriptor.st_shndx, descriptorSection,
+                         descriptorSectionSize) ||
+        newCode.st_size == 0 || newCode.st_value > codeSectionSize ||
+        newCode.st_size > codeSectionSize - newCode.st_value ||
+        newDescriptor.st_value > descriptorSectionSize ||
+        kernelDescriptorSize > descriptorSectionSize - newDescriptor.st_value) {
+      logError() << "no kernel " << name << " in the object for "
+                 << patch.entryId << '\n';
+      return false;
+    }
+
+    const char *descriptor = descriptorSection + newDescriptor.st_value;
+    const char *oldDescriptorBytes = codeObject + oldDescriptorOffset;
+    auto field = [](const char *descriptor, uint64_t offset) {
+      uint32_t value;
+      memcpy(&value, descriptor + offset, sizeof(value));
+      return value;
+    };
+    if (field(descriptor, kdKernargSize) !=
+            field(oldDescriptorBytes, kdKernargSize) ||
+        field(descriptor, kdGroupSegmentSize) >
+            field(oldDescriptorBytes, kdGroupSegmentSize) ||
+        field(descriptor, kdPrivateSegmentSize) >
+            field(oldDescriptorBytes, kdPrivateSegmentSize)) {
+      logError() << "the arguments, LDS or scratch size of " << name
+                 << " changed, which the metadata of " << patch.entryId
+                 << " would have to follow, patch the whole code object\n";
+      return false;
+    }
+
+    // In place if it fits, appended otherwise.
+    const bool fits = newCode.st_size <= oldCode.st_size;
+    const uint64_t addr = fits ? oldCode.st_value : appendAddr;
+    std::vector<char> code(codeSection + newCode.st_value,
+                           codeSection + newCode.st_value + newCode.st_size);
+    if (!relocateKernel(object, name, newCode, original, addr, code))
+      return false;
+
+    if (fits) {
+      memset(out.data() + oldCodeOffset, 0, oldCode.st_size);
+      memcpy(out.data() + oldCodeOffset, code.data(), code.size());
+      logDebug() << "patched " << name << " in place, " << code.size()
+                 << " bytes at " << addr << '\n';
+    } else {
+      logDebug() << "appended " << name << ", " << code.size()
+                 << " bytes at " << addr << '\n';
+      stats.appendedBytes += code.size();
+      ++stats.numAppended;
+      appendAddr = alignUp(appendAddr + code.size(), kernelCodeAlign);
+      appended.emplace_back(addr, std::move(code));
+    }
+
+    int64_t entryOffset = addr - oldDescriptor.st_value;
+    memcpy(out.data() + oldDescriptorOffset, descriptor, kernelDescriptorSize);
+    memcpy(out.data() + oldDescriptorOffset + kdEntryOffset, &entryOffset,
+           sizeof(entryOffset));
+
+    forEachSymbol(original, [&](uint64_t offset, const ELFIO::Elf64_Sym &symbol,
+                                const std::string &symbolName) {
+      if (symbolName != name || symbol.st_value != oldCode.st_value)
+        return;
+      ELFIO::Elf64_Sym newSymbol = symbol;
+      newSymbol.st_value = addr;
+      newSymbol.st_size = newCode.st_size;
+      memcpy(out.data() + offset, &newSymbol, sizeof(newSymbol));
+    });
+    ++stats.numPatched;
+  }
+
+  if (appended.empty())
+    return true;
+
+  // The new segment, with the program headers, and the PT_LOAD that maps it
+  // right after the last one, so that PT_LOADs stay sorted by address.
+  const uint64_t segmentSize = appendAddr - segmentAddr;
+  std::vector<ELFIO::Elf64_Phdr> phdrs;
+  size_t lastLoadIdx = 0;
+  for (size_t i = 0; i < original.numSegments(); ++i) {
+    phdrs.push_back(original.segmentHeader(i));
+    if (phdrs.back().p_type == ELFIO::PT_LOAD)
+      lastLoadIdx = phdrs.size();
+  }
+  ELFIO::Elf64_Phdr newLoad = {};
+  newLoad.p_type = ELFIO::PT_LOAD;
+  newLoad.p_flags = ELFIO::PF_R | ELFIO::PF_X;
+  newLoad.p_offset = segmentOffset;
+  newLoad.p_vaddr = segmentAddr;
+  newLoad.p_paddr = segmentAddr;
+  newLoad.p_filesz = segmentSize;
+  newLoad.p_memsz = segmentSize;
+  newLoad.p_align = segmentAlign;
+  phdrs.insert(phdrs.begin() + lastLoadIdx, newLoad);
+  for (ELFIO::Elf64_Phdr &phdr : phdrs) {
+    if (phdr.p_type != ELFIO::PT_PHDR)
+      continue;
+    phdr.p_offset = segmentOffset;
+    phdr.p_vaddr = segmentAddr;
+    phdr.p_paddr = segmentAddr;
+    phdr.p_filesz = phdrTableSize;
+    phdr.p_memsz = phdrTableSize;
+  }
+
+  out.resize(segmentOffset + segmentSize, 0);
+  memcpy(out.data() + segmentOffset, phdrs.data(), phdrTableSize);
+  for (const auto &code : appended)
+    memcpy(out.data() + segmentOffset + code.first - segmentAddr,
+           code.second.data(), code.second.size());
+
+  ELFIO::Elf64_Ehdr header = original.header();
+  header.e_phoff = segmentOffset;
+  header.e_phnum = phdrs.size();
+  memcpy(out.data(), &header, sizeof(header));
+  return true;
+}
+
+// Patch the kernels of each patch into its code object of the .hip_fatbin of
+// exec. replacements gets the patched code objects, for spliceFatbin().
+static bool patchKernels(const MappedElf &exec,
+                         const std::vector<KernelPatch> &patches,
+                         std::vector<CodeObjectReplacement> &replacements) {
+  uint64_t fatbinOffset;
+  std::vector<OffloadBundle> bundles;
+  if (!parseHipFatbin(exec, fatbinOffset, bundles))
+    return false;
+
+  KernelPatchStats stats;
+  replacements.clear();
+  for (const KernelPatch &patch : patches) {
+    size_t bundleIdx, entryIdx;
+    if (!findBundleEntry(bundles, patch.entryId, patch.bundle, bundleIdx,
+                         entryIdx))
+      return false;
+    const OffloadBundle &bundle = bundles[bundleIdx];
+    const OffloadBundleEntry &entry = bundle.entries[entryIdx];
+
+    replacements.emplace_back();
+    CodeObjectReplacement &replacement = replacements.back();
+    replacement.entryId = patch.entryId;
+    replacement.bundle = bundleIdx;
+    if (!patchCodeObject(
+            exec.data() + fatbinOffset + bundle.offset + entry.offset,
+            entry.size, patch, replacement.codeObject, stats))
+      return false;
+  }
+
+  logOut() << "patched " << stats.numPatched << " kernels into "
+           << patches.size() << " code objects, " << stats.numAppended
+           << " appended (" << stats.appendedBytes << " bytes)\n";
+  if (currentStats) {
+    currentStats->set("patched_kernels", stats.numPatched);
+    currentStats->set("appended_kernels", stats.numAppended);
+    currentStats->set("appended_kernel_bytes", stats.appendedBytes);
+  }
+  return true;
+}
+
+#endif // EXEC_RW_KERNEL_PATCH_HPP
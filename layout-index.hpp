@@ -0,0 +1,94 @@
+#ifndef EXEC_RW_LAYOUT_INDEX_HPP
+#define EXEC_RW_LAYOUT_INDEX_HPP
+
+#include "elfio/elfio.hpp"
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// An index over the sections of an ELFIO::elfio, built once and then used by
+// every phase of the rewrite instead of scanning the section table:
+//
+// - section lookup by name is a hash lookup,
+// - mapping sections into segments walks the sections sorted by address,
+//   each segment binary-searches for the first section that can lie in it,
+//   instead of testing every section against every segment.
+//
+// Sections added to the file after the index was built must be registered
+// with addSection().
+class LayoutIndex {
+public:
+  void build(const ELFIO::elfio &file) {
+    byName_.clear();
+    byAddress_.clear();
+
+    auto sections = file.sections;
+    byName_.reserve(sections.size());
+    byAddress_.reserve(sections.size());
+    for (size_t i = 0; i < sections.size(); ++i) {
+      // Like a linear scan, lookups find the first section with a given name.
+      byName_.emplace(sections[i]->get_name(), sections[i]);
+      byAddress_.push_back(sections[i]);
+    }
+    std::stable_sort(byAddress_.begin(), byAddress_.end(), compareAddress);
+  }
+
+  void addSection(ELFIO::section *section) {
+    byName_.emplace(section->get_name(), section);
+
+    auto pos = std::upper_bound(byAddress_.begin(), byAddress_.end(), section,
+                                compareAddress);
+    byAddress_.insert(pos, section);
+  }
+
+  ELFIO::section *getSection(const std::string &sectionName) const {
+    auto iter = byName_.find(sectionName);
+    return iter == byName_.end() ? nullptr : iter->second;
+  }
+
+  // Add every section to the segments whose [vaddr, vaddr + memsz) range
+  // holds it: the section starts inside the segment and doesn't end past it.
+  // Each segment gets its sections in section header table order.
+  void mapSectionsToSegments(ELFIO::elfio &file) const {
+    auto segments = file.segments;
+    std::vector<ELFIO::section *> inSegment;
+
+    for (size_t i = 0; i < segments.size(); ++i) {
+      ELFIO::segment *segment = segments[i];
+      auto segmentBegin = segment->get_virtual_address();
+      auto segmentEnd = segmentBegin + segment->get_memory_size();
+
+      inSegment.clear();
+      auto iter = std::lower_bound(
+          byAddress_.begin(), byAddress_.end(), segmentBegin,
+          [](const ELFIO::section *section, ELFIO::Elf64_Addr addr) {
+            return section->get_address() < addr;
+          });
+      for (; iter != byAddress_.end() && (*iter)->get_address() < segmentEnd;
+           ++iter) {
+        if ((*iter)->get_address() + (*iter)->get_size() <= segmentEnd)
+          inSegment.push_back(*iter);
+      }
+
+      std::sort(inSegment.begin(), inSegment.end(),
+                [](const ELFIO::section *a, const ELFIO::section *b) {
+                  return a->get_index() < b->get_index();
+                });
+      for (ELFIO::section *section : inSegment)
+        segment->add_section(section, 1);
+    }
+  }
+
+private:
+  static bool compareAddress(const ELFIO::section *a,
+                             const ELFIO::section *b) {
+    return a->get_address() < b->get_address();
+  }
+
+  std::unordered_map<std::string, ELFIO::section *> byName_;
+  std::vector<ELFIO::section *> byAddress_;
+};
+
+#endif // EXEC_RW_LAYOUT_INDEX_HPP
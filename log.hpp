@@ -0,0 +1,49 @@
+#ifndef EXEC_RW_LOG_HPP
+#define EXEC_RW_LOG_HPP
+
+#include <iostream>
+#include <string>
+
+// Leveled logging for the rewrite pipeline. Only errors are printed unless
+// --log-level asks for more. Messages of a disabled level go to a stream
+// without a buffer, which drops them without formatting anything; callers
+// that do real work to produce a message (dumpSection) check logEnabled()
+// first.
+//
+// The tools turn off std::cout's synchronization with stdio, so that it is
+// fully buffered.
+
+enum class LogLevel { Error, Info, Debug };
+
+inline LogLevel logLevel = LogLevel::Error;
+
+// Where the rewrite pipeline prints its progress. Batch jobs point this at a
+// buffer of their own, so that the output of concurrent jobs doesn't
+// interleave.
+inline thread_local std::ostream *logStream = &std::cout;
+
+static inline bool logEnabled(LogLevel level) { return level <= logLevel; }
+
+static inline std::ostream &logOut(LogLevel level = LogLevel::Info) {
+  static thread_local std::ostream droppedMessages(nullptr);
+  return logEnabled(level) ? *logStream : droppedMessages;
+}
+
+static inline std::ostream &logError() { return logOut(LogLevel::Error); }
+
+static inline std::ostream &logDebug() { return logOut(LogLevel::Debug); }
+
+// Parse the argument of --log-level.
+static inline bool parseLogLevel(const std::string &name, LogLevel &level) {
+  if (name == "error")
+    level = LogLevel::Error;
+  else if (name == "info")
+    level = LogLevel::Info;
+  else if (name == "debug")
+    level = LogLevel::Debug;
+  else
+    return false;
+  return true;
+}
+
+#endif // EXEC_RW_LOG_HPP
@@ -0,0 +1,195 @@
+#ifndef EXEC_RW_MAPPED_ELF_HPP
+#define EXEC_RW_MAPPED_ELF_HPP
+
+#include "elfio/elfio.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A read-only mmap of an ELF64 file, or a view of one already in memory. Only
+// the ELF header, the section header table and the program header table are
+// interpreted (in place); section payloads are never copied and are referred
+// to by file range instead. Sections are indexed by name when opened, so a
+// mapping kept across rewrites (see original-cache.hpp) keeps its index too.
+//
+// ELFIO's structure definitions are used so that <elf.h> isn't needed here,
+// its macros conflict with ELFIO's constants.
+class MappedElf {
+public:
+  MappedElf() = default;
+  MappedElf(const MappedElf &) = delete;
+  MappedElf &operator=(const MappedElf &) = delete;
+
+  ~MappedElf() { close(); }
+
+  bool open(const char *path) {
+    close();
+
+    fd_ = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd_ < 0)
+      return false;
+
+    struct stat st;
+    if (fstat(fd_, &st) != 0 ||
+        st.st_size < (off_t)sizeof(ELFIO::Elf64_Ehdr)) {
+      close();
+      return false;
+    }
+
+    size_ = st.st_size;
+    void *addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (addr == MAP_FAILED) {
+      size_ = 0;
+      close();
+      return false;
+    }
+    data_ = (const char *)addr;
+
+    if (!parseHeaders()) {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  // Interpret [data, data + size) instead of a file, e.g. a code object
+  // extracted from a fatbin. The bytes must outlive this, fd() is -1.
+  bool view(const char *data, size_t size) {
+    close();
+    if (size < sizeof(ELFIO::Elf64_Ehdr))
+      return false;
+    data_ = data;
+    size_ = size;
+    mapped_ = false;
+    if (!parseHeaders()) {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  void close() {
+    if (data_ && mapped_)
+      munmap((void *)data_, size_);
+    if (fd_ >= 0)
+      ::close(fd_);
+    data_ = nullptr;
+    size_ = 0;
+    mapped_ = true;
+    fd_ = -1;
+    numSections_ = 0;
+    shstrndx_ = 0;
+    sectionsByName_.clear();
+  }
+
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+  int fd() const { return fd_; }
+
+  const ELFIO::Elf64_Ehdr &header() const {
+    return *(const ELFIO::Elf64_Ehdr *)data_;
+  }
+
+  size_t numSections() const { return numSections_; }
+
+  const ELFIO::Elf64_Shdr &sectionHeader(size_t index) const {
+    return ((const ELFIO::Elf64_Shdr *)(data_ + header().e_shoff))[index];
+  }
+
+  std::string sectionName(size_t index) const {
+    const ELFIO::Elf64_Shdr &strtab = sectionHeader(shstrndx_);
+    uint64_t nameOffset = sectionHeader(index).sh_name;
+    if (nameOffset >= strtab.sh_size)
+      return "";
+
+    const char *name = data_ + strtab.sh_offset + nameOffset;
+    return std::string(name, strnlen(name, strtab.sh_size - nameOffset));
+  }
+
+  // Returns the index of the first section called sectionName, or 0 (the
+  // index of the null section) if there is none.
+  size_t findSection(const std::string &sectionName) const {
+    auto iter = sectionsByName_.find(sectionName);
+    return iter == sectionsByName_.end() ? 0 : iter->second;
+  }
+
+  size_t numSegments() const { return header().e_phnum; }
+
+  const ELFIO::Elf64_Phdr &segmentHeader(size_t index) const {
+    return ((const ELFIO::Elf64_Phdr *)(data_ + header().e_phoff))[index];
+  }
+
+  // Drop the pages of [offset, offset + size) from this process's resident
+  // set. They stay in the page cache, so this is cheap to undo.
+  void release(uint64_t offset, uint64_t size) const {
+    uint64_t pageSize = sysconf(_SC_PAGESIZE);
+    uint64_t begin = offset & ~(pageSize - 1);
+    uint64_t end = offset + size;
+    if (end > size_)
+      end = size_;
+    if (begin < end)
+      madvise((void *)(data_ + begin), end - begin, MADV_DONTNEED);
+  }
+
+private:
+  bool parseHeaders() {
+    const ELFIO::Elf64_Ehdr &ehdr = header();
+    if (memcmp(ehdr.e_ident, "\177ELF", 4) != 0 ||
+        ehdr.e_ident[4] != ELFIO::ELFCLASS64 ||
+        ehdr.e_ident[5] != ELFIO::ELFDATA2LSB)
+      return false;
+
+    if (ehdr.e_phnum != 0 &&
+        (ehdr.e_phoff > size_ ||
+         ehdr.e_phnum * sizeof(ELFIO::Elf64_Phdr) > size_ - ehdr.e_phoff))
+      return false;
+
+    if (ehdr.e_shoff == 0)
+      return true;
+
+    if (ehdr.e_shoff > size_ ||
+        sizeof(ELFIO::Elf64_Shdr) > size_ - ehdr.e_shoff)
+      return false;
+
+    // Files with more than SHN_LORESERVE sections keep the real counts in the
+    // null section header.
+    numSections_ = ehdr.e_shnum;
+    if (numSections_ == 0)
+      numSections_ = sectionHeader(0).sh_size;
+    shstrndx_ = ehdr.e_shstrndx;
+    if (shstrndx_ == 0xffff)
+      shstrndx_ = sectionHeader(0).sh_link;
+
+    if (numSections_ * sizeof(ELFIO::Elf64_Shdr) > size_ - ehdr.e_shoff ||
+        shstrndx_ >= numSections_)
+      return false;
+
+    const ELFIO::Elf64_Shdr &strtab = sectionHeader(shstrndx_);
+    if (strtab.sh_offset > size_ || strtab.sh_size > size_ - strtab.sh_offset)
+      return false;
+
+    // Like a linear scan, lookups find the first section with a given name.
+    sectionsByName_.reserve(numSections_);
+    for (size_t i = 1; i < numSections_; ++i)
+      sectionsByName_.emplace(sectionName(i), i);
+    return true;
+  }
+
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+  // Whether data_ is a mapping of fd_, rather than a view.
+  bool mapped_ = true;
+  int fd_ = -1;
+  size_t numSections_ = 0;
+  size_t shstrndx_ = 0;
+  std::unordered_map<std::string, size_t> sectionsByName_;
+};
+
+#endif // EXEC_RW_MAPPED_ELF_HPP
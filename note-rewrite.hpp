@@ -0,0 +1,225 @@
+#ifndef EXEC_RW_NOTE_REWRITE_HPP
+#define EXEC_RW_NOTE_REWRITE_HPP
+
+#include "append-rewrite.hpp"
+#include "fatbin-align.hpp"
+#include "fatbin-pieces.hpp"
+#include "fatbin-slot.hpp"
+#include "file-copy.hpp"
+#include "log.hpp"
+#include "mapped-elf.hpp"
+
+#include <cstdint>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The note layout (--layout=note) is the append layout without the relocated
+// program header table. Instead of adding a program header, one PT_NOTE entry
+// of the table is turned into the PT_LOAD of the new fatbin, so e_phnum,
+// e_phoff and every byte of the original image stay as they are:
+//
+//   [ original executable ][ padding ][ new fatbin ]
+//
+// With slack, the slot note follows the slack, and a second PT_NOTE entry
+// becomes its PT_NOTE:
+//
+//   [ original executable ][ padding ][ new fatbin ][ slack ][ slot note ]
+//
+// The entries are reordered within the table so that PT_LOADs stay sorted by
+// address. What gets written is the new segment, the program header table in
+// place, and the .hipFatBinSegment pointers (and their relocations).
+//
+// The PT_NOTE entries given up, in order of preference, are the slot notes of
+// earlier rewrites, the ones that only repeat PT_GNU_PROPERTY, then the others
+// from last to first. Their notes are still in the file and in the section
+// headers, they are only no longer found through the program headers at run
+// time (e.g. the build ID by dl_iterate_phdr). PT_GNU_STACK, PT_GNU_RELRO and
+// the like are never reused, as the loader acts on them.
+//
+// An executable without PT_NOTE gets the append layout instead, and one with
+// a single PT_NOTE gets no slack.
+
+// Indices of the PT_NOTE entries of exec, most expendable first.
+static std::vector<size_t> findReusableNotes(const MappedElf &exec) {
+  const uint32_t gnuPropertyType = 0x6474e553; // PT_GNU_PROPERTY
+  std::vector<size_t> slotNotes, propertyNotes, otherNotes;
+
+  for (size_t i = exec.numSegments(); i-- > 0;) {
+    const ELFIO::Elf64_Phdr &phdr = exec.segmentHeader(i);
+    if (phdr.p_type != ELFIO::PT_NOTE)
+      continue;
+
+    FatbinSlot slot;
+    uint64_t slotDesc;
+    if (findFatbinSlotNote(exec, phdr.p_offset, phdr.p_filesz, slot,
+                           slotDesc)) {
+      slotNotes.push_back(i);
+      continue;
+    }
+
+    bool isProperty = false;
+    for (size_t j = 0; j < exec.numSegments(); ++j) {
+      const ELFIO::Elf64_Phdr &other = exec.segmentHeader(j);
+      isProperty = isProperty || (other.p_type == gnuPropertyType &&
+                                  other.p_offset == phdr.p_offset &&
+                                  other.p_filesz == phdr.p_filesz);
+    }
+    (isProperty ? propertyNotes : otherNotes).push_back(i);
+  }
+
+  slotNotes.insert(slotNotes.end(), propertyNotes.begin(), propertyNotes.end());
+  slotNotes.insert(slotNotes.end(), otherNotes.begin(), otherNotes.end());
+  return slotNotes;
+}
+
+static bool noteRewrite(const MappedElf &ogExec, const char *rwExecPath,
+                        const FatbinPieces &newFatbin,
+                        const std::vector<uint64_t> &fatbinOffsets,
+                        uint64_t slack = 0,
+                        FatbinAlign align = FatbinAlign::Auto) {
+  const ELFIO::Elf64_Ehdr &ogHeader = ogExec.header();
+  const uint64_t newFatbinSize = newFatbin.size();
+
+  std::vector<size_t> reusableNotes = findReusableNotes(ogExec);
+  if (reusableNotes.empty()) {
+    logOut() << "no PT_NOTE to turn into a PT_LOAD, appending a program "
+                "header table instead\n";
+    return appendRewrite(ogExec, rwExecPath, newFatbin, fatbinOffsets, slack,
+                         align);
+  }
+  if (slack && reusableNotes.size() < 2) {
+    logOut() << "no second PT_NOTE for the fatbin slot note, not reserving "
+                "slack\n";
+    slack = 0;
+  }
+
+  size_t fatbinIdx = ogExec.findSection(".hip_fatbin");
+  size_t wrapperIdx = ogExec.findSection(".hipFatBinSegment");
+  if (!fatbinIdx || !wrapperIdx) {
+    logError() << "can't find .hip_fatbin or .hipFatBinSegment\n";
+    return false;
+  }
+
+  const ELFIO::Elf64_Shdr &wrapperSection = ogExec.sectionHeader(wrapperIdx);
+  if (wrapperSection.sh_type == ELFIO::SHT_NOBITS ||
+      fatbinOffsets.size() * 24 > wrapperSection.sh_size) {
+    logError() << ".hipFatBinSegment holds fewer than " << fatbinOffsets.size()
+               << " wrappers\n";
+    return false;
+  }
+
+  // The new segment only holds the fatbin, so its offset and address can be
+  // aligned independently of the rest of the executable.
+  const uint64_t fatbinAlign =
+      fatbinAlignment(align, ogExec.sectionHeader(fatbinIdx).sh_addralign,
+                      newFatbinSize + slack);
+  uint64_t lastSegmentEnd = 0;
+  for (size_t i = 0; i < ogExec.numSegments(); ++i) {
+    const ELFIO::Elf64_Phdr &phdr = ogExec.segmentHeader(i);
+    if (phdr.p_vaddr + phdr.p_memsz > lastSegmentEnd)
+      lastSegmentEnd = phdr.p_vaddr + phdr.p_memsz;
+  }
+
+  const uint64_t newOffset = alignUp(ogExec.size(), fatbinAlign);
+  const uint64_t newAddr = alignUp(lastSegmentEnd, fatbinAlign);
+  const uint64_t noteOffset = alignUp(newFatbinSize + slack, 4);
+  const uint64_t loadSize =
+      slack ? noteOffset + fatbinSlotNoteSize : newFatbinSize;
+
+  ELFIO::Elf64_Phdr newLoad = {};
+  newLoad.p_type = ELFIO::PT_LOAD;
+  newLoad.p_flags = ELFIO::PF_R;
+  newLoad.p_offset = newOffset;
+  newLoad.p_vaddr = newAddr;
+  newLoad.p_paddr = newAddr;
+  newLoad.p_filesz = loadSize;
+  newLoad.p_memsz = loadSize;
+  newLoad.p_align = fatbinAlign;
+
+  FatbinSlot slot;
+  slot.offset = newOffset;
+  slot.addr = newAddr;
+  slot.capacity = newFatbinSize + slack;
+  slot.size = newFatbinSize;
+
+  ELFIO::Elf64_Phdr noteSegment = {};
+  noteSegment.p_type = ELFIO::PT_NOTE;
+  noteSegment.p_flags = ELFIO::PF_R;
+  noteSegment.p_offset = newOffset + noteOffset;
+  noteSegment.p_vaddr = newAddr + noteOffset;
+  noteSegment.p_paddr = newAddr + noteOffset;
+  noteSegment.p_filesz = fatbinSlotNoteSize;
+  noteSegment.p_memsz = fatbinSlotNoteSize;
+  noteSegment.p_align = 4;
+
+  // Rebuild the table without the reused entries, with the new PT_LOAD after
+  // the last one and the slot note at the end.
+  std::vector<ELFIO::Elf64_Phdr> phdrs;
+  size_t lastLoadIdx = 0;
+  for (size_t i = 0; i < ogExec.numSegments(); ++i) {
+    if (i == reusableNotes[0] || (slack && i == reusableNotes[1]))
+      continue;
+    phdrs.push_back(ogExec.segmentHeader(i));
+    if (phdrs.back().p_type == ELFIO::PT_LOAD)
+      lastLoadIdx = phdrs.size();
+  }
+  phdrs.insert(phdrs.begin() + lastLoadIdx, newLoad);
+  if (slack)
+    phdrs.push_back(noteSegment);
+
+  struct stat st;
+  if (fstat(ogExec.fd(), &st) != 0)
+    return false;
+
+  int fd = open(rwExecPath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                st.st_mode & 07777);
+  if (fd < 0) {
+    logError() << "can't create " << rwExecPath << '\n';
+    return false;
+  }
+
+  logOut() << "Copying " << ogExec.size() << " bytes of the original...\n";
+  CopyStats stats;
+  bool ok = copyWholeFile(ogExec.fd(), fd, ogExec.size(), &stats);
+  logOut() << stats.cloned << " bytes reflinked, " << stats.copied
+           << " copied by the kernel, " << stats.buffered
+           << " copied through a buffer\n";
+
+  logOut() << "Appending new fatbin at " << newOffset << ", in place of "
+           << "PT_NOTE " << reusableNotes[0] << "...\n";
+  ok = ok && newFatbin.write(ogExec.fd(), fd, newOffset);
+
+  // The slack is a hole, the file is extended by the note.
+  if (slack) {
+    logOut() << "Reserving " << slack << " bytes of slack after the new "
+             << "fatbin, slot note in place of PT_NOTE " << reusableNotes[1]
+             << '\n';
+    std::vector<char> note = makeFatbinSlotNote(slot);
+    ok = ok && pwriteAll(fd, note.data(), note.size(), newOffset + noteOffset);
+  }
+
+  ok = ok && pwriteAll(fd, phdrs.data(), phdrs.size() * sizeof(phdrs[0]),
+                       ogHeader.e_phoff);
+
+  // The fatbin pointer is at offset 8 of each 24-byte wrapper.
+  std::vector<uint64_t> relocOffsets = findWrapperRelocations(
+      ogExec, wrapperSection.sh_addr, fatbinOffsets.size());
+  for (size_t i = 0; ok && i < fatbinOffsets.size(); ++i) {
+    uint64_t addr = newAddr + fatbinOffsets[i];
+    ok = pwriteAll(fd, &addr, sizeof(addr),
+                   wrapperSection.sh_offset + i * 24 + 8);
+    if (ok && relocOffsets[i])
+      ok = pwriteAll(fd, &addr, sizeof(addr), relocOffsets[i]);
+  }
+
+  if (close(fd) != 0 || !ok) {
+    logError() << "can't write " << rwExecPath << '\n';
+    return false;
+  }
+  return true;
+}
+
+#endif // EXEC_RW_NOTE_REWRITE_HPP
@@ -0,0 +1,150 @@
+#ifndef EXEC_RW_OFFLOAD_BUNDLE_HPP
+#define EXEC_RW_OFFLOAD_BUNDLE_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// A fatbin, as found in .hip_fatbin, is a sequence of clang offload bundles,
+// one per translation unit, each padded to some alignment. Every bundle is
+// pointed to by one wrapper in .hipFatBinSegment. A bundle is laid out as:
+//
+//   "__CLANG_OFFLOAD_BUNDLE__"              24 bytes
+//   number of entries                       uint64_t
+//   for each entry :
+//     offset of the code object             uint64_t, from start of bundle
+//     size of the code object               uint64_t
+//     length of the entry ID                uint64_t
+//     entry ID                              e.g. hipv4-amdgcn-amd-amdhsa--gfx90a
+//   code objects
+
+static const char offloadBundleMagic[] = "__CLANG_OFFLOAD_BUNDLE__";
+static const size_t offloadBundleMagicSize = sizeof(offloadBundleMagic) - 1;
+
+struct OffloadBundleEntry {
+  uint64_t offset;
+  uint64_t size;
+  std::string id;
+};
+
+struct OffloadBundle {
+  // Offset of the bundle from the start of the fatbin.
+  uint64_t offset;
+  // Size of the bundle, from its magic to the end of its last code object.
+  uint64_t size;
+  std::vector<OffloadBundleEntry> entries;
+};
+
+static bool readU64(const char *data, size_t size, uint64_t offset,
+                    uint64_t &value) {
+  if (offset > size || size - offset < sizeof(value))
+    return false;
+  memcpy(&value, data + offset, sizeof(value));
+  return true;
+}
+
+// Parse the bundle at the start of [data, data + size).
+static bool parseOffloadBundle(const char *data, size_t size,
+                               OffloadBundle &bundle) {
+  if (size < offloadBundleMagicSize ||
+      memcmp(data, offloadBundleMagic, offloadBundleMagicSize) != 0)
+    return false;
+
+  uint64_t numEntries;
+  uint64_t pos = offloadBundleMagicSize;
+  if (!readU64(data, size, pos, numEntries))
+    return false;
+  pos += sizeof(uint64_t);
+
+  bundle.entries.clear();
+  bundle.size = pos;
+  for (uint64_t i = 0; i < numEntries; ++i) {
+    OffloadBundleEntry entry;
+    uint64_t idSize;
+    if (!readU64(data, size, pos, entry.offset) ||
+        !readU64(data, size, pos + 8, entry.size) ||
+        !readU64(data, size, pos + 16, idSize))
+      return false;
+    pos += 24;
+
+    if (idSize > size - pos || entry.offset > size ||
+        entry.size > size - entry.offset)
+      return false;
+    entry.id.assign(data + pos, idSize);
+    pos += idSize;
+
+    if (pos > bundle.size)
+      bundle.size = pos;
+    if (entry.offset + entry.size > bundle.size)
+      bundle.size = entry.offset + entry.size;
+    bundle.entries.push_back(entry);
+  }
+  return true;
+}
+
+// Parse every bundle in the fatbin. The fatbin has to start with a bundle,
+// and whatever follows a bundle up to the next magic is padding.
+static bool parseOffloadBundles(const char *data, size_t size,
+                                std::vector<OffloadBundle> &bundles) {
+  bundles.clear();
+
+  uint64_t offset = 0;
+  while (offset < size) {
+    OffloadBundle bundle;
+    if (!parseOffloadBundle(data + offset, size - offset, bundle))
+      return false;
+    bundle.offset = offset;
+    bundles.push_back(bundle);
+
+    offset += bundle.size;
+    const void *next = memmem(data + offset, size - offset, offloadBundleMagic,
+                              offloadBundleMagicSize);
+    if (!next)
+      break;
+    offset = (const char *)next - data;
+  }
+  return !bundles.empty();
+}
+
+// The size of the header of a bundle with these entries, which is where its
+// code objects can start.
+static uint64_t
+offloadBundleHeaderSize(const std::vector<OffloadBundleEntry> &entries) {
+  uint64_t size = offloadBundleMagicSize + sizeof(uint64_t);
+  for (const OffloadBundleEntry &entry : entries)
+    size += 3 * sizeof(uint64_t) + entry.id.size();
+  return size;
+}
+
+// The header of a bundle with these entries, without its code objects.
+static std::vector<char>
+writeOffloadBundleHeader(const std::vector<OffloadBundleEntry> &entries) {
+  std::vector<char> header(offloadBundleMagic,
+                           offloadBundleMagic + offloadBundleMagicSize);
+  auto appendU64 = [&](uint64_t value) {
+    const char *bytes = (const char *)&value;
+    header.insert(header.end(), bytes, bytes + sizeof(value));
+  };
+  appendU64(entries.size());
+  for (const OffloadBundleEntry &entry : entries) {
+    appendU64(entry.offset);
+    appendU64(entry.size);
+    appendU64(entry.id.size());
+    header.insert(header.end(), entry.id.begin(), entry.id.end());
+  }
+  return header;
+}
+
+// Offsets the .hipFatBinSegment wrappers should point to, relative to the
+// start of the fatbin. This is what gen_co_offsets.py derives from the output
+// of roc-obj-ls.
+static std::vector<uint64_t>
+getCodeObjectOffsets(const std::vector<OffloadBundle> &bundles) {
+  std::vector<uint64_t> offsets;
+  for (const OffloadBundle &bundle : bundles)
+    offsets.push_back(bundle.offset);
+  return offsets;
+}
+
+#endif // EXEC_RW_OFFLOAD_BUNDLE_HPP
@@ -0,0 +1,100 @@
+#ifndef EXEC_RW_ORIGINAL_CACHE_HPP
+#define EXEC_RW_ORIGINAL_CACHE_HPP
+
+#include "mapped-elf.hpp"
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <sys/stat.h>
+
+// Original executables kept mapped across rewrites, for processes that
+// rewrite the same executables over and over (the daemon mode of exec-rw2,
+// see rewrite-daemon.hpp). A MappedElf is never modified once opened, so one
+// mapping serves any number of concurrent rewrites. Its section index is
+// built when it's opened, and kept with it. The rest of what a rewrite reads
+// from the original depends on the request: the clone and its LayoutIndex are
+// built anew each time, the output being a different file.
+//
+// An entry is only reused while the file at its path is the same: same device
+// and inode, same size and modification time. A file that changed is mapped
+// again, and rewrites still holding the old mapping keep it until they are
+// done. The least recently used entries are unmapped once there are more than
+// maxEntries.
+class OriginalCache {
+public:
+  explicit OriginalCache(size_t maxEntries = 64) : maxEntries_(maxEntries) {}
+
+  OriginalCache(const OriginalCache &) = delete;
+  OriginalCache &operator=(const OriginalCache &) = delete;
+
+  // The mapping of the executable at path, nullptr if it can't be mapped.
+  // hit is set if the mapping was cached.
+  std::shared_ptr<const MappedElf> open(const char *path, bool &hit) {
+    hit = false;
+    struct stat st;
+    if (stat(path, &st) != 0)
+      return nullptr;
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (auto entry = entries_.begin(); entry != entries_.end(); ++entry) {
+        if (entry->path != path)
+          continue;
+        if (sameFile(*entry, st)) {
+          entries_.splice(entries_.begin(), entries_, entry);
+          hit = true;
+          return entries_.front().exec;
+        }
+        entries_.erase(entry);
+        break;
+      }
+    }
+
+    // Mapping doesn't hold the lock, so that a slow open doesn't stall the
+    // rewrites of other executables.
+    auto exec = std::make_shared<MappedElf>();
+    if (!exec->open(path))
+      return nullptr;
+
+    // Key the entry with the file that was mapped, which may have changed
+    // since the stat() above.
+    if (fstat(exec->fd(), &st) != 0)
+      return exec;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.push_front({path, st.st_dev, st.st_ino, (uint64_t)st.st_size,
+                         st.st_mtim.tv_sec, st.st_mtim.tv_nsec, exec});
+    while (entries_.size() > maxEntries_)
+      entries_.pop_back();
+    return exec;
+  }
+
+private:
+  struct Entry {
+    std::string path;
+    dev_t dev;
+    ino_t ino;
+    uint64_t size;
+    time_t mtimeSec;
+    long mtimeNsec;
+    std::shared_ptr<const MappedElf> exec;
+  };
+
+  static bool sameFile(const Entry &entry, const struct stat &st) {
+    return entry.dev == st.st_dev && entry.ino == st.st_ino &&
+           entry.size == (uint64_t)st.st_size &&
+           entry.mtimeSec == st.st_mtim.tv_sec &&
+           entry.mtimeNsec == st.st_mtim.tv_nsec;
+  }
+
+  const size_t maxEntries_;
+  std::mutex mutex_;
+  // Most recently used first.
+  std::list<Entry> entries_;
+};
+
+#endif // EXEC_RW_ORIGINAL_CACHE_HPP
@@ -0,0 +1,224 @@
+#ifndef EXEC_RW_REWRITE_CACHE_HPP
+#define EXEC_RW_REWRITE_CACHE_HPP
+
+#include "content-hash.hpp"
+#include "file-copy.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A directory of rewritten executables, keyed by the hashes of everything
+// that went into them. A rewrite whose inputs were seen before copies the
+// earlier output (by reflink where the filesystem can) instead of running.
+//
+// Several processes and threads can share a cache directory:
+//
+// - entries are written to a temporary file in the directory and renamed
+//   into place, so an entry is either complete or not there,
+// - a hit bumps the entry's mtime, insertions evict the entries with the
+//   oldest mtime until the directory fits in its size bound. An entry that
+//   is evicted while it is being copied out stays readable through the open
+//   file descriptor.
+class RewriteCache {
+public:
+  // maxSize 0 means the cache is never trimmed.
+  RewriteCache(std::string dir, uint64_t maxSize)
+      : dir_(std::move(dir)), maxSize_(maxSize) {}
+
+  const std::string &dir() const { return dir_; }
+
+  // Create the cache directory unless it exists already.
+  bool create() const {
+    return mkdir(dir_.c_str(), 0777) == 0 || errno == EEXIST;
+  }
+
+  // The key of the output of a rewrite. tag names what the output depends on
+  // besides the given files, the layout for instance. The rewriting tool
+  // itself is hashed in as well, a rebuilt tool doesn't reuse old outputs.
+  static bool makeKey(const std::string &tag,
+                      const std::vector<const char *> &inputPaths,
+                      std::string &key) {
+    uint64_t digest;
+    if (!hashFile("/proc/self/exe", digest))
+      return false;
+    key = tag + "-" + toHex(digest);
+
+    for (const char *path : inputPaths) {
+      if (!hashFile(path, digest))
+        return false;
+      key += "-" + toHex(digest);
+    }
+    return true;
+  }
+
+  // Copy the entry for key to outPath, if there is one.
+  bool fetch(const std::string &key, const char *outPath) const {
+    int entryFd = open(entryPath(key).c_str(), O_RDONLY | O_CLOEXEC);
+    if (entryFd < 0)
+      return false;
+
+    struct stat st;
+    if (fstat(entryFd, &st) != 0 || st.st_size == 0) {
+      close(entryFd);
+      return false;
+    }
+
+    int outFd = open(outPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                     st.st_mode & 07777);
+    if (outFd < 0) {
+      close(entryFd);
+      return false;
+    }
+
+    bool ok = copyWholeFile(entryFd, outFd, st.st_size) &&
+              fchmod(outFd, st.st_mode & 07777) == 0;
+    ok = close(outFd) == 0 && ok;
+
+    // The entry was just used, it is the last to be evicted now.
+    if (ok)
+      futimens(entryFd, nullptr);
+    close(entryFd);
+    return ok;
+  }
+
+  // Add the file at path as the entry for key, then trim the cache.
+  bool insert(const std::string &key, const char *path) const {
+    int srcFd = open(path, O_RDONLY | O_CLOEXEC);
+    if (srcFd < 0)
+      return false;
+
+    struct stat st;
+    if (fstat(srcFd, &st) != 0) {
+      close(srcFd);
+      return false;
+    }
+
+    std::string tmpPath = dir_ + "/" + tmpPrefix + key + "-XXXXXX";
+    int tmpFd = mkostemp(&tmpPath[0], O_CLOEXEC);
+    if (tmpFd < 0) {
+      close(srcFd);
+      return false;
+    }
+
+    bool ok = copyWholeFile(srcFd, tmpFd, st.st_size) &&
+              fchmod(tmpFd, st.st_mode & 07777) == 0 &&
+              fdatasync(tmpFd) == 0;
+    ok = close(tmpFd) == 0 && ok;
+    close(srcFd);
+
+    if (!ok || rename(tmpPath.c_str(), entryPath(key).c_str()) != 0) {
+      unlink(tmpPath.c_str());
+      return false;
+    }
+
+    trim();
+    return true;
+  }
+
+  // Evict the least recently used entries until the cache fits in maxSize.
+  // Temporary files that were left behind by a crashed insert are removed
+  // once they are an hour old.
+  void trim() const {
+    DIR *dir = opendir(dir_.c_str());
+    if (!dir)
+      return;
+
+    struct Entry {
+      std::string path;
+      struct timespec mtime;
+      uint64_t size;
+    };
+    std::vector<Entry> entries;
+    uint64_t totalSize = 0;
+    time_t now = time(nullptr);
+
+    while (struct dirent *dirEntry = readdir(dir)) {
+      std::string name = dirEntry->d_name;
+      if (name == "." || name == "..")
+        continue;
+
+      std::string path = dir_ + "/" + name;
+      struct stat st;
+      if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+        continue;
+
+      if (name.compare(0, tmpPrefix.size(), tmpPrefix) == 0) {
+        if (now - st.st_mtime > 60 * 60)
+          unlink(path.c_str());
+        continue;
+      }
+
+      entries.push_back({path, st.st_mtim, (uint64_t)st.st_size});
+      totalSize += st.st_size;
+    }
+    closedir(dir);
+
+    if (maxSize_ == 0 || totalSize <= maxSize_)
+      return;
+
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry &a, const Entry &b) {
+                if (a.mtime.tv_sec != b.mtime.tv_sec)
+                  return a.mtime.tv_sec < b.mtime.tv_sec;
+                return a.mtime.tv_nsec < b.mtime.tv_nsec;
+              });
+    for (const Entry &entry : entries) {
+      if (totalSize <= maxSize_)
+        break;
+      // Another process trimming at the same time may have been first.
+      unlink(entry.path.c_str());
+      totalSize -= entry.size;
+    }
+  }
+
+private:
+  static inline const std::string tmpPrefix = ".tmp-";
+
+  std::string entryPath(const std::string &key) const {
+    return dir_ + "/" + key;
+  }
+
+  std::string dir_;
+  uint64_t maxSize_;
+};
+
+// Parse a size such as 512M for --cache-size. The suffixes K, M and G are
+// binary multiples. Returns false if str isn't a size.
+static bool parseSize(const char *str, uint64_t &size) {
+  char *end;
+  size = strtoull(str, &end, 10);
+  if (end == str)
+    return false;
+
+  switch (*end) {
+  case 'K':
+  case 'k':
+    size <<= 10;
+    ++end;
+    break;
+  case 'M':
+  case 'm':
+    size <<= 20;
+    ++end;
+    break;
+  case 'G':
+  case 'g':
+    size <<= 30;
+    ++end;
+    break;
+  }
+  return *end == '\0';
+}
+
+#endif // EXEC_RW_REWRITE_CACHE_HPP
@@ -0,0 +1,259 @@
+#ifndef EXEC_RW_REWRITE_DAEMON_HPP
+#define EXEC_RW_REWRITE_DAEMON_HPP
+
+#include "batch.hpp"
+#include "log.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Daemon mode of exec-rw2 (--serve): a long-running process that rewrites
+// executables on request, so that the originals stay mapped from one rewrite
+// to the next (see original-cache.hpp). Requests come over a Unix-domain
+// socket and are served by a fixed pool of worker threads, each accepting one
+// connection at a time.
+//
+// A connection carries one request: the client sends the arguments of a
+// rewrite, as a line of a batch manifest (see batch.hpp), and shuts down its
+// side of the connection. The daemon answers with the log of the rewrite
+// followed by a last line, "ok" or "FAILED", and closes the connection. Paths
+// are opened by the daemon, so clients send absolute ones.
+//
+// SIGINT and SIGTERM stop the daemon once the requests in progress are
+// answered, and remove the socket.
+
+static const char daemonOk[] = "ok";
+static const char daemonFailed[] = "FAILED";
+
+static bool sendAll(int fd, const std::string &data) {
+  for (size_t done = 0; done < data.size();) {
+    ssize_t n = send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    done += n;
+  }
+  return true;
+}
+
+// Everything the peer sends until it shuts down its side, up to maxSize bytes.
+static bool receiveAll(int fd, std::string &data, size_t maxSize) {
+  data.clear();
+  char buffer[4096];
+  for (;;) {
+    ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return false;
+    if (n == 0)
+      return true;
+    if (data.size() + n > maxSize)
+      return false;
+    data.append(buffer, n);
+  }
+}
+
+static bool makeSocketAddress(const char *socketPath, sockaddr_un &addr) {
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socketPath) >= sizeof(addr.sun_path))
+    return false;
+  strcpy(addr.sun_path, socketPath);
+  return true;
+}
+
+static int connectDaemon(const char *socketPath) {
+  sockaddr_un addr;
+  if (!makeSocketAddress(socketPath, addr))
+    return -1;
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (const sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Serve rewrite(args) for requests of minArgs to maxArgs arguments on
+// socketPath, with numWorkers threads, until SIGINT or SIGTERM. Returns false
+// if the socket can't be set up.
+template <typename RewriteFn>
+static bool serveRewrites(const char *socketPath, size_t minArgs,
+                          size_t maxArgs, unsigned numWorkers,
+                          RewriteFn rewrite) {
+  using Clock = std::chrono::steady_clock;
+
+  sockaddr_un addr;
+  if (!makeSocketAddress(socketPath, addr)) {
+    std::cout << "socket path " << socketPath << " is too long\n";
+    return false;
+  }
+
+  // A socket nobody listens on is left over from a daemon that died.
+  int runningFd = connectDaemon(socketPath);
+  if (runningFd >= 0) {
+    close(runningFd);
+    std::cout << "a daemon is already serving " << socketPath << '\n';
+    return false;
+  }
+  unlink(socketPath);
+
+  int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listenFd < 0 ||
+      bind(listenFd, (const sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(listenFd, SOMAXCONN) != 0) {
+    std::cout << "can't listen on " << socketPath << " : " << strerror(errno)
+              << '\n';
+    if (listenFd >= 0)
+      close(listenFd);
+    return false;
+  }
+
+  // The signals are taken by sigwait() below rather than by a handler, so
+  // they have to be blocked in every thread, starting with this one.
+  sigset_t stopSignals;
+  sigemptyset(&stopSignals);
+  sigaddset(&stopSignals, SIGINT);
+  sigaddset(&stopSignals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stopSignals, nullptr);
+
+  std::mutex reportMutex;
+  std::atomic<size_t> numRequests(0);
+
+  auto worker = [&]() {
+    for (;;) {
+      int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED)
+          continue;
+        // The listening socket was shut down.
+        return;
+      }
+
+      std::string request;
+      std::ostringstream requestLog;
+      std::vector<std::string> args;
+      bool ok = false;
+      auto requestStart = Clock::now();
+      if (!receiveAll(fd, request, 1 << 16)) {
+        requestLog << "can't read the request\n";
+      } else {
+        args = splitBatchLine(request);
+        // Nothing to answer to a connection that only checks whether the
+        // daemon is running.
+        if (args.empty()) {
+          close(fd);
+          continue;
+        }
+        if (args.size() < minArgs || args.size() > maxArgs) {
+          requestLog << "expected " << minArgs << " to " << maxArgs
+                     << " arguments, found " << args.size() << '\n';
+        } else {
+          logStream = &requestLog;
+          ok = rewrite(args);
+          logStream = &std::cout;
+        }
+      }
+      double ms =
+          std::chrono::duration<double, std::milli>(Clock::now() - requestStart)
+              .count();
+
+      requestLog << (ok ? daemonOk : daemonFailed) << '\n';
+      sendAll(fd, requestLog.str());
+      close(fd);
+
+      std::lock_guard<std::mutex> lock(reportMutex);
+      std::cout << '[' << ++numRequests << "] " << (ok ? "ok     " : "FAILED ")
+                << ms << " ms  "
+                << (args.size() > 2 ? args[2] : std::string("?")) << std::endl;
+    }
+  };
+
+  if (numWorkers == 0)
+    numWorkers = 1;
+  std::cout << "serving on " << socketPath << " with " << numWorkers
+            << " threads" << std::endl;
+
+  std::vector<std::thread> workers;
+  for (unsigned i = 0; i < numWorkers; ++i)
+    workers.emplace_back(worker);
+
+  int signal;
+  sigwait(&stopSignals, &signal);
+
+  // Workers blocked in accept() return once the socket is shut down; the
+  // others finish their request first.
+  shutdown(listenFd, SHUT_RDWR);
+  for (std::thread &thread : workers)
+    thread.join();
+  close(listenFd);
+  unlink(socketPath);
+
+  std::cout << "served " << numRequests << " requests\n";
+  return true;
+}
+
+// Send the arguments of a rewrite to the daemon at socketPath and print its
+// log. Relative paths are made absolute first. Returns true if the rewrite
+// succeeded.
+static bool requestRewrite(const char *socketPath,
+                           const std::vector<std::string> &args) {
+  char cwd[PATH_MAX];
+  if (!getcwd(cwd, sizeof(cwd))) {
+    std::cout << "can't get the current directory\n";
+    return false;
+  }
+
+  std::string request;
+  for (const std::string &arg : args) {
+    if (splitBatchLine(arg).size() != 1) {
+      std::cout << "can't send path " << arg << " to the daemon\n";
+      return false;
+    }
+    request += request.empty() ? "" : " ";
+    request += arg[0] == '/' ? arg : std::string(cwd) + "/" + arg;
+  }
+  request += '\n';
+
+  int fd = connectDaemon(socketPath);
+  if (fd < 0) {
+    std::cout << "can't connect to the daemon at " << socketPath << '\n';
+    return false;
+  }
+
+  std::string response;
+  bool sent = sendAll(fd, request) && shutdown(fd, SHUT_WR) == 0;
+  bool received = sent && receiveAll(fd, response, SIZE_MAX);
+  close(fd);
+  if (!received) {
+    std::cout << "lost the connection to the daemon at " << socketPath << '\n';
+    return false;
+  }
+
+  // The status is the last line, the rest is the log of the rewrite.
+  size_t statusStart = response.rfind('\n', response.size() - 2);
+  statusStart = statusStart == std::string::npos ? 0 : statusStart + 1;
+  std::cout << response.substr(0, statusStart);
+  return response.compare(statusStart, std::string::npos,
+                          std::string(daemonOk) + "\n") == 0;
+}
+
+#endif // EXEC_RW_REWRITE_DAEMON_HPP
@@ -0,0 +1,219 @@
+#ifndef EXEC_RW_REWRITE_STATS_HPP
+#define EXEC_RW_REWRITE_STATS_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+// Statistics of one rewrite, for --stats=<file>. Each phase of the pipeline
+// records its wall time, and what the calling thread did meanwhile:
+//
+// - the bytes and syscalls counted in /proc/thread-self/io. Those are read
+//   and write-like syscalls (including copy_file_range and sendfile); pages
+//   touched through an mmap show up as page faults instead,
+// - minor and major page faults from getrusage(RUSAGE_THREAD),
+// - the process' peak RSS at the end of the phase.
+//
+// The counters are per thread, so that concurrent batch jobs each get their
+// own. Phases are recorded with StatsPhase, which does nothing unless the
+// thread has a RewriteStats to record into.
+
+struct ThreadCounters {
+  uint64_t readBytes = 0;
+  uint64_t writeBytes = 0;
+  uint64_t readSyscalls = 0;
+  uint64_t writeSyscalls = 0;
+  uint64_t minorFaults = 0;
+  uint64_t majorFaults = 0;
+
+  static ThreadCounters now() {
+    ThreadCounters counters;
+    if (FILE *io = fopen("/proc/thread-self/io", "r")) {
+      char name[32];
+      unsigned long long value;
+      while (fscanf(io, "%31[^:]: %llu\n", name, &value) == 2) {
+        std::string field = name;
+        if (field == "rchar")
+          counters.readBytes = value;
+        else if (field == "wchar")
+          counters.writeBytes = value;
+        else if (field == "syscr")
+          counters.readSyscalls = value;
+        else if (field == "syscw")
+          counters.writeSyscalls = value;
+      }
+      fclose(io);
+    }
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_THREAD, &usage) == 0) {
+      counters.minorFaults = usage.ru_minflt;
+      counters.majorFaults = usage.ru_majflt;
+    }
+    return counters;
+  }
+};
+
+static long peakRssKb() {
+  struct rusage usage;
+  return getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : 0;
+}
+
+class RewriteStats {
+public:
+  struct Phase {
+    std::string name;
+    double wallMs;
+    ThreadCounters counters;
+    long peakRssKb;
+  };
+
+  RewriteStats() : start_(std::chrono::steady_clock::now()) {}
+
+  void addPhase(Phase phase) { phases_.push_back(std::move(phase)); }
+
+  // Counts and other facts about the rewrite, such as the number of sections
+  // in the input. Strings are quoted in the report, numbers and flags
+  // aren't.
+  void set(const std::string &name, uint64_t value) {
+    facts_.emplace_back(name, std::to_string(value));
+  }
+
+  void set(const std::string &name, const std::string &value) {
+    facts_.emplace_back(name, quote(value));
+  }
+
+  void setFlag(const std::string &name, bool value) {
+    facts_.emplace_back(name, value ? "true" : "false");
+  }
+
+  // The phases as a JSON object, keyed by phase name.
+  std::string phasesJson() const {
+    std::string json = "{";
+    for (const Phase &phase : phases_) {
+      if (json.size() > 1)
+        json += ',';
+      json += quote(phase.name) + ":{\"wall_ms\":" +
+              std::to_string(phase.wallMs) +
+              ",\"read_bytes\":" + std::to_string(phase.counters.readBytes) +
+              ",\"write_bytes\":" + std::to_string(phase.counters.writeBytes) +
+              ",\"read_syscalls\":" +
+              std::to_string(phase.counters.readSyscalls) +
+              ",\"write_syscalls\":" +
+              std::to_string(phase.counters.writeSyscalls) +
+              ",\"minor_faults\":" +
+              std::to_string(phase.counters.minorFaults) +
+              ",\"major_faults\":" +
+              std::to_string(phase.counters.majorFaults) +
+              ",\"peak_rss_kb\":" + std::to_string(phase.peakRssKb) + "}";
+    }
+    return json + "}";
+  }
+
+  // The whole report, a single line of JSON.
+  std::string json() const {
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start_;
+
+    std::string json = "{";
+    for (const auto &fact : facts_)
+      json += quote(fact.first) + ":" + fact.second + ",";
+    json += "\"wall_ms\":" + std::to_string(elapsed.count()) +
+            ",\"peak_rss_kb\":" + std::to_string(peakRssKb()) +
+            ",\"phases\":" + phasesJson() + "}";
+    return json;
+  }
+
+private:
+  static std::string quote(const std::string &value) {
+    std::string quoted = "\"";
+    for (char c : value) {
+      if (c == '"' || c == '\\')
+        quoted += '\\';
+      if ((unsigned char)c < 0x20) {
+        char escaped[8];
+        snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        quoted += escaped;
+      } else {
+        quoted += c;
+      }
+    }
+    return quoted + "\"";
+  }
+
+  std::chrono::steady_clock::time_point start_;
+  std::vector<Phase> phases_;
+  std::vector<std::pair<std::string, std::string>> facts_;
+};
+
+// The statistics of the rewrite running on this thread, if any.
+inline thread_local RewriteStats *currentStats = nullptr;
+
+// Records a phase from construction to end() (or destruction) into
+// currentStats.
+class StatsPhase {
+public:
+  explicit StatsPhase(const char *name) : name_(name) {
+    if (!currentStats)
+      return;
+    start_ = std::chrono::steady_clock::now();
+    counters_ = ThreadCounters::now();
+    running_ = true;
+  }
+
+  StatsPhase(const StatsPhase &) = delete;
+  StatsPhase &operator=(const StatsPhase &) = delete;
+
+  ~StatsPhase() { end(); }
+
+  void end() {
+    if (!running_)
+      return;
+    running_ = false;
+
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start_;
+    ThreadCounters counters = ThreadCounters::now();
+    counters.readBytes -= counters_.readBytes;
+    counters.writeBytes -= counters_.writeBytes;
+    counters.readSyscalls -= counters_.readSyscalls;
+    counters.writeSyscalls -= counters_.writeSyscalls;
+    counters.minorFaults -= counters_.minorFaults;
+    counters.majorFaults -= counters_.majorFaults;
+
+    currentStats->addPhase({name_, elapsed.count(), counters, peakRssKb()});
+  }
+
+private:
+  const char *name_;
+  std::chrono::steady_clock::time_point start_;
+  ThreadCounters counters_;
+  bool running_ = false;
+};
+
+// Empty the --stats file, or create it, before the first rewrite.
+static bool createStatsFile(const char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  return fd >= 0 && close(fd) == 0;
+}
+
+// Append the report of one rewrite to the --stats file, as one line. The line
+// goes out in a single O_APPEND write, so that the reports of concurrent batch
+// jobs don't interleave.
+static bool appendStats(const char *path, const RewriteStats &stats) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return false;
+  std::string line = stats.json() + "\n";
+  bool ok = write(fd, line.data(), line.size()) == (ssize_t)line.size();
+  return close(fd) == 0 && ok;
+}
+
+#endif // EXEC_RW_REWRITE_STATS_HPP
@@ -0,0 +1,110 @@
+#!/bin/bash
+
+# Runs a tiny HIP-shaped executable with libexecrw-register-stub.so standing in
+# for the HIP runtime, and checks the file offset of every bundle it registers,
+# with libexecrw-preload.so and with fatbin variants.
+# Run ./build.sh first; cc and python3 are needed as well.
+
+repo=`cd "$(dirname "$0")" && pwd`
+dir=`mktemp -d /tmp/test-stub-XXXXXX` || exit 1
+trap 'rm -rf "$dir"' EXIT
+cd "$dir"
+
+# Fatbins of two offload bundles 8K apart, each with an empty host entry and a
+# code object named after the fatbin.
+python3 - <<'EOF'
+import struct
+ids = [b"host-x86_64-unknown-linux-gnu-", b"hipv4-amdgcn-amd-amdhsa--gfx90a"]
+for name in ["og", "new", "fast", "instr"]:
+    fatbin = b""
+    for i in range(2):
+        code = b"\x7fELF" + name.encode() + b"-%d" % i + bytes(1000 + i * 3000)
+        header = b"__CLANG_OFFLOAD_BUNDLE__" + struct.pack("<Q", len(ids))
+        for id, size in zip(ids, [0, len(code)]):
+            header += struct.pack("<QQQ", 4096, size, len(id)) + id
+        fatbin += (header.ljust(4096, b"\0") + code).ljust(8192, b"\0")
+    open(name + ".bin", "wb").write(fatbin)
+EOF
+
+# The executable embeds og.bin and registers the two wrappers of its
+# .hipFatBinSegment from a constructor, as the ones hipcc builds do. It's
+# linked with the stub in place of the HIP runtime.
+cat > host.c <<'EOF'
+#include <stdint.h>
+struct FatbinWrapper { uint32_t magic, version; const void *binary, *unused; };
+void **__hipRegisterFatBinary(const void *data);
+__asm__(".section .hip_fatbin,\"a\",@progbits\n.p2align 12\n"
+        "fatbin:\n.incbin \"og.bin\"\n.previous\n");
+extern const char fatbin[];
+__attribute__((section(".hipFatBinSegment"), used))
+struct FatbinWrapper wrappers[2] = {{0x48495046, 1, fatbin, 0},
+                                    {0x48495046, 1, fatbin + 8192, 0}};
+__attribute__((constructor)) static void registerFatbins(void) {
+  __hipRegisterFatBinary(&wrappers[0]);
+  __hipRegisterFatBinary(&wrappers[1]);
+}
+int main(void) { return 0; }
+EOF
+stub="$repo/libexecrw-register-stub.so"
+cc -O1 host.c "$stub" -Wl,-rpath,"$repo" -o host || exit 1
+
+failed=0
+
+# The offset of the contents of file $2 in file $1.
+offsetOf() {
+  python3 -c 'import sys; print(open(sys.argv[1], "rb").read().find(open(sys.argv[2], "rb").read()))' "$1" "$2"
+}
+
+# Check that the registrations logged in $1 point, in order, into object $2 at
+# the offsets that follow.
+expectBundles() {
+  local log=$1 object=$2
+  shift 2
+  local got=`sed -n 's/^exec-rw stub : wrapper .* in \(.*\) at \([0-9]*\), .*/\1 \2/p' $log`
+  local expected=`for offset in "$@"; do echo "$object $offset"; done`
+  if [ "$got" == "$expected" ]; then
+    echo "ok   $log"
+  else
+    echo "FAIL $log, expected :"
+    echo "$expected"
+    echo "registered :"
+    echo "$got"
+    failed=1
+  fi
+}
+
+og=`offsetOf host og.bin`
+
+./host 2> own.log
+expectBundles own.log "(executable)" $og $((og + 8192))
+
+# libexecrw-preload.so swaps in new.bin, or leaves the fatbin of an object
+# without an entry in the map alone.
+hash=`"$repo/exec-rw2" --fatbin-hash host | cut -d ' ' -f 1`
+echo "$hash $dir/new.bin" > fatbins.map
+echo "0123456789abcdef $dir/new.bin" > other.map
+EXECRW_FATBIN_MAP=fatbins.map LD_PRELOAD="$repo/libexecrw-preload.so" ./host \
+  2> map.log
+expectBundles map.log "$dir/new.bin" 0 8192
+EXECRW_FATBIN_MAP=other.map LD_PRELOAD="$repo/libexecrw-preload.so" ./host \
+  2> other-map.log
+expectBundles other-map.log "(executable)" $og $((og + 8192))
+
+# The variants of an executable, selected by EXECRW_FATBIN_VARIANT; an unknown
+# name runs the first one.
+"$repo/exec-rw2" --variant=fast=fast.bin --variant=instr=instr.bin host \
+  host.variants > /dev/null || exit 1
+fast=`offsetOf host.variants fast.bin`
+instr=`offsetOf host.variants instr.bin`
+./host.variants 2> default.log
+expectBundles default.log "(executable)" $fast $((fast + 8192))
+EXECRW_FATBIN_VARIANT=instr ./host.variants 2> instr.log
+expectBundles instr.log "(executable)" $instr $((instr + 8192))
+EXECRW_FATBIN_VARIANT=debug ./host.variants 2> unknown.log
+expectBundles unknown.log "(executable)" $fast $((fast + 8192))
+if ! grep -q "^EXECRW_FATBIN_VARIANT isn't one of fast instr" unknown.log; then
+  echo "FAIL unknown.log, the unknown variant isn't reported"
+  failed=1
+fi
+
+exit $failed
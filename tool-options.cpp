@@ -0,0 +1,168 @@
+#include "tool-options.hpp"
+
+#include "compressed-bundle.hpp"
+#include "fatbin-align.hpp"
+#include "fatbin-prune.hpp"
+#include "log.hpp"
+#include "rewrite-stats.hpp"
+
+#include <cstring>
+#include <iostream>
+
+// The options of libexecrw's front ends, see tool-options.hpp.
+
+ToolOptionStatus parseToolOption(const char *arg, ToolOptions &tool) {
+  RewriteOptions &options = tool.rewrite;
+  if (!strcmp(arg, "--mmap")) {
+    options.useMmap = true;
+  } else if (!strncmp(arg, "--layout=", 9)) {
+    options.layout = arg + 9;
+    if (options.layout != "clone" && options.layout != "append" &&
+        options.layout != "note") {
+      std::cout << "unknown layout " << options.layout << '\n';
+      return ToolOptionStatus::Invalid;
+    }
+  } else if (!strncmp(arg, "--align=", 8)) {
+    if (!parseFatbinAlign(arg + 8, options.align)) {
+      std::cout << "unknown alignment " << arg + 8 << '\n';
+      return ToolOptionStatus::Invalid;
+    }
+  } else if (!strcmp(arg, "--rename-sections")) {
+    options.sections.rename = true;
+  } else if (!strcmp(arg, "--drop-old-fatbin")) {
+    options.sections.dropOld = true;
+  } else if (!strncmp(arg, "--slack=", 8)) {
+    if (!parseSize(arg + 8, options.slack)) {
+      std::cout << "invalid slack " << arg + 8 << '\n';
+      return ToolOptionStatus::Invalid;
+    }
+  } else if (!strncmp(arg, "--targets=", 10)) {
+    if (!parseTargets(arg + 10, options.targets)) {
+      std::cout << "invalid targets " << arg + 10 << '\n';
+      return ToolOptionStatus::Invalid;
+    }
+  } else if (!strcmp(arg, "--compress") || !strncmp(arg, "--compress=", 11)) {
+    const char *method = arg[10] == '=' ? arg + 11 : "";
+    if (!parseBundleCompression(method, options.compression)) {
+      std::cout << "unsupported compression " << method << '\n';
+      return ToolOptionStatus::Invalid;
+    }
+    options.compress = true;
+  } else if (!strcmp(arg, "--compress-debug-sections") ||
+             !strncmp(arg, "--compress-debug-sections=", 26)) {
+    const char *method = arg[25] == '=' ? arg + 26 : "";
+    if (!parseBundleCompression(method, options.debugCompression)) {
+      std::cout << "unsupported compression " << method << '\n';
+      return ToolOptionStatus::Invalid;
+    }
+    options.compressDebugSections = true;
+  } else if (!strncmp(arg, "--delta=", 8)) {
+    options.deltaPath = arg + 8;
+  } else if (!strcmp(arg, "--apply-delta")) {
+    tool.applyDelta = true;
+  } else if (!strncmp(arg, "--cache-dir=", 12)) {
+    tool.cacheDir = arg + 12;
+  } else if (!strncmp(arg, "--cache-size=", 13)) {
+    if (!parseSize(arg + 13, tool.cacheSize)) {
+      std::cout << "invalid cache size " << arg + 13 << '\n';
+      return ToolOptionStatus::Invalid;
+    }
+  } else if (!strncmp(arg, "--log-level=", 12)) {
+    if (!parseLogLevel(arg + 12, logLevel)) {
+      std::cout << "unknown log level " << arg + 12 << '\n';
+      return ToolOptionStatus::Invalid;
+    }
+  } else if (!strcmp(arg, "--verbose")) {
+    logLevel = LogLevel::Info;
+  } else if (!strncmp(arg, "--stats=", 8)) {
+    options.statsPath = arg + 8;
+  } else {
+    return ToolOptionStatus::Unknown;
+  }
+  return ToolOptionStatus::Parsed;
+}
+
+void showRewriteOptionsHelp(std::ostream &out) {
+  out << "  --mmap           clone the executable from an mmap, without "
+         "loading section\n"
+         "                   contents into memory\n";
+  out << "  --layout=clone   rebuild the executable around the new "
+         "fatbin (default)\n";
+  out << "  --layout=append  append the new fatbin and program headers "
+         "to a copy of the\n"
+         "                   executable, patching only headers and "
+         "fatbin wrappers\n";
+  out << "  --layout=note    like append, but turn a PT_NOTE into the "
+         "new PT_LOAD instead\n"
+         "                   of relocating the program header table\n";
+  out << "  --align=<a>      align the new fatbin to pages (page), huge "
+         "pages (2m), or\n"
+         "                   to huge pages if it's at least 2 MiB "
+         "(auto, default)\n";
+  out << "  --rename-sections  name the new fatbin .hip_fatbin and the "
+         "original\n"
+         "                     .hip_fatbin.orig (clone layout)\n";
+  out << "  --drop-old-fatbin  leave the contents of the original "
+         "fatbin out of the\n"
+         "                     output as a hole, which saves disk "
+         "blocks but not file\n"
+         "                     size (clone layout, every wrapper must "
+         "point to the new\n"
+         "                     fatbin)\n";
+  out << "  --slack=<n>      reserve <n> bytes after the new fatbin, "
+         "a later rewrite\n"
+         "                   whose fatbin fits replaces it in place "
+         "(K, M and G\n"
+         "                   suffixes accepted)\n";
+  out << "  --compress[=<m>] insert the fatbin as compressed offload "
+         "bundles, <m> is zlib\n"
+         "                   or zstd (default : zstd if built with it, "
+         "zlib otherwise)\n";
+  out << "  --compress-debug-sections[=<m>]  compress the .debug_* "
+         "sections, <m> as\n"
+         "                   for --compress (clone layout)\n";
+  out << "  --targets=<list> keep only the code objects of these GPU "
+         "targets, e.g.\n"
+         "                   gfx90a,gfx942 (a processor allows every "
+         "feature combination)\n";
+}
+
+void showToolOptionsHelp(std::ostream &out) {
+  out << "  --delta=<file>   also write a delta that rebuilds the new "
+         "executable from the\n"
+         "                   original to <file>\n";
+  out << "  --apply-delta    rebuild <path-to-new-exe> from "
+         "<path-to-exe> and the delta\n"
+         "                   given in place of <path-to-fatbin>\n";
+  out << "  --cache-dir=<dir>  reuse the output of earlier rewrites of "
+         "the same inputs,\n"
+         "                     kept in <dir>\n";
+  out << "  --cache-size=<n>   evict the least recently used outputs "
+         "once <dir> holds\n"
+         "                     more than <n> bytes (K, M and G "
+         "suffixes accepted)\n";
+  out << "  --log-level=<l>  error (default), info or debug\n";
+  out << "  --verbose        same as --log-level=info\n";
+  out << "  --stats=<file>   write the time, I/O and memory use of every "
+         "phase of each\n"
+         "                   rewrite to <file>, one line of JSON per "
+         "rewrite\n";
+}
+
+bool setUpToolOptions(ToolOptions &tool) {
+  if (tool.cacheDir) {
+    tool.cache.reset(new RewriteCache(tool.cacheDir, tool.cacheSize));
+    if (!tool.cache->create()) {
+      std::cout << "can't create cache directory " << tool.cacheDir << '\n';
+      return false;
+    }
+    tool.rewrite.cache = tool.cache.get();
+  }
+
+  if (tool.rewrite.statsPath && !createStatsFile(tool.rewrite.statsPath)) {
+    std::cout << "can't create statistics file " << tool.rewrite.statsPath
+              << '\n';
+    return false;
+  }
+  return true;
+}
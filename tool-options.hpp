@@ -0,0 +1,41 @@
+#ifndef EXEC_RW_TOOL_OPTIONS_HPP
+#define EXEC_RW_TOOL_OPTIONS_HPP
+
+#include "execrw.hpp"
+#include "rewrite-cache.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+
+// The command line options exec-rw and exec-rw2 share, parsed into a
+// RewriteOptions and the few settings the tools act on themselves. Each tool
+// parses its own options around these, see tool-options.cpp.
+
+struct ToolOptions {
+  RewriteOptions rewrite;
+  // Rebuild the output from the original and a delta instead.
+  bool applyDelta = false;
+  const char *cacheDir = nullptr;
+  uint64_t cacheSize = 0;
+  // The cache of cacheDir, once setUpToolOptions() created it.
+  std::unique_ptr<RewriteCache> cache;
+};
+
+enum class ToolOptionStatus { Parsed, Unknown, Invalid };
+
+// Parse arg if it's one of the shared options. The error of an invalid one is
+// printed, the tool then shows its help and exits.
+ToolOptionStatus parseToolOption(const char *arg, ToolOptions &options);
+
+// The help of the shared options: those of the rewrite itself, and those for
+// deltas, the cache, logging and statistics, which the tools list after their
+// own.
+void showRewriteOptionsHelp(std::ostream &out);
+void showToolOptionsHelp(std::ostream &out);
+
+// Create the cache directory and the statistics file the options name, and
+// point the rewrite options at the cache. Errors are printed.
+bool setUpToolOptions(ToolOptions &options);
+
+#endif // EXEC_RW_TOOL_OPTIONS_HPP